@@ -0,0 +1,337 @@
+/*
+*	Approximate K-nearest neighbors search with IVF-PQ (see ann.h)
+*/
+#include "ann.h"
+#include "kdtree.h"
+#include "system.h"
+#include <math.h>
+
+/******************************************************
+*	PRIVATE functions
+*******************************************************/
+
+// index of the centroid nearest to point (scalar, for the low dimensional codebooks)
+static int NearestCodeword(const float* point, const float* codewords, int count, int dim) {
+	int best = 0;
+	float best_dist = 0;
+	int c, d;
+	for (c = 0; c < count; c++) {
+		float dist = 0;
+		for (d = 0; d < dim; d++) {
+			float diff = point[d] - codewords[c * dim + d];
+			dist += diff * diff;
+		}
+		if (c == 0 || dist < best_dist) {
+			best_dist = dist;
+			best = c;
+		}
+	}
+	return best;
+}
+
+// index of the coarse centroid nearest to query, using the SIMD distance kernel
+static int NearestList(const ANNIndex* index, const Feature* query) {
+	Feature distances[KNN_BLOCK_SIZE];
+	int best = 0;
+	Feature best_dist = 0;
+	int block_start, i;
+	for (block_start = 0; block_start < index->ListCount; block_start += KNN_BLOCK_SIZE) {
+		int block_size = index->ListCount - block_start;
+		if (block_size > KNN_BLOCK_SIZE) block_size = KNN_BLOCK_SIZE;
+		index->Distances(query, index->Centroids + block_start * FEATURE_VECTOR_LENGTH, block_size, distances);
+		for (i = 0; i < block_size; i++) {
+			if ((block_start == 0 && i == 0) || distances[i] < best_dist) {
+				best_dist = distances[i];
+				best = block_start + i;
+			}
+		}
+	}
+	return best;
+}
+
+/*
+*	Lloyd's k-means on n points of dim floats. centroids are seeded with evenly spaced points so
+*	the result is deterministic. centroids that lose all their points keep their last position
+*/
+static void KMeans(const float* points, int n, int dim, int k, float* centroids) {
+	float* sums = MemAllocate(sizeof(float) * k * dim);
+	int* counts = MemAllocate(sizeof(int) * k);
+	int i, c, d, iteration;
+
+	for (c = 0; c < k; c++) {
+		const float* seed = points + (int)(((long long)c * n) / k) * dim;
+		for (d = 0; d < dim; d++) centroids[c * dim + d] = seed[d];
+	}
+
+	for (iteration = 0; iteration < ANN_KMEANS_ITERATIONS; iteration++) {
+		for (i = 0; i < k * dim; i++) sums[i] = 0;
+		for (c = 0; c < k; c++) counts[c] = 0;
+
+		for (i = 0; i < n; i++) {
+			int nearest = NearestCodeword(points + i * dim, centroids, k, dim);
+			for (d = 0; d < dim; d++) sums[nearest * dim + d] += points[i * dim + d];
+			counts[nearest]++;
+		}
+		for (c = 0; c < k; c++) {
+			if (counts[c] == 0) continue;
+			for (d = 0; d < dim; d++) centroids[c * dim + d] = sums[c * dim + d] / counts[c];
+		}
+	}
+
+	FreeMemory(counts);
+	FreeMemory(sums);
+}
+
+// k-means for the coarse centroids, with the assignment step done by the distance kernel
+static void TrainCoarseCentroids(ANNIndex* index, const Feature* sample, int n) {
+	int k = index->ListCount;
+	double* sums = MemAllocate(sizeof(double) * k * FEATURE_VECTOR_LENGTH);
+	int* counts = MemAllocate(sizeof(int) * k);
+	int i, c, d, iteration;
+
+	for (c = 0; c < k; c++) {
+		const Feature* seed = sample + (int)(((long long)c * n) / k) * FEATURE_VECTOR_LENGTH;
+		for (d = 0; d < FEATURE_VECTOR_LENGTH; d++) index->Centroids[c * FEATURE_VECTOR_LENGTH + d] = seed[d];
+	}
+
+	for (iteration = 0; iteration < ANN_KMEANS_ITERATIONS; iteration++) {
+		for (i = 0; i < k * FEATURE_VECTOR_LENGTH; i++) sums[i] = 0;
+		for (c = 0; c < k; c++) counts[c] = 0;
+
+		for (i = 0; i < n; i++) {
+			const Feature* point = sample + i * FEATURE_VECTOR_LENGTH;
+			int nearest = NearestList(index, point);
+			for (d = 0; d < FEATURE_VECTOR_LENGTH; d++) sums[nearest * FEATURE_VECTOR_LENGTH + d] += point[d];
+			counts[nearest]++;
+		}
+		for (c = 0; c < k; c++) {
+			if (counts[c] == 0) continue;
+			for (d = 0; d < FEATURE_VECTOR_LENGTH; d++) {
+				index->Centroids[c * FEATURE_VECTOR_LENGTH + d] = (Feature)(sums[c * FEATURE_VECTOR_LENGTH + d] / counts[c]);
+			}
+		}
+	}
+
+	FreeMemory(counts);
+	FreeMemory(sums);
+}
+
+// a coarse centroid and its distance from the query, for ranking the lists to visit
+typedef struct {
+	Feature Dist;
+	int List;
+} ListDistance;
+
+// orders lists by distance, then by number (as NeighborHeap orders rows)
+static int CompareListDistance(const void* a, const void* b) {
+	const ListDistance* x = (const ListDistance*)a;
+	const ListDistance* y = (const ListDistance*)b;
+	if (x->Dist != y->Dist) return x->Dist < y->Dist ? -1 : 1;
+	return x->List - y->List;
+}
+
+/*
+*	moves the wanted nearest of the count lists to the front, nearest first. a quickselect
+*	partitions around the wanted-th list, so only those in front are sorted, and wanted is not
+*	bounded by a NeighborHeap: every list can be visited
+*/
+static void SelectNearestLists(ListDistance* lists, int count, int wanted) {
+	int left = 0, right = count - 1;
+	while (wanted < count && left < right) {
+		ListDistance pivot = lists[left + (right - left) / 2];
+		int i = left, j = right;
+		while (i <= j) {
+			while (CompareListDistance(&lists[i], &pivot) < 0) i++;
+			while (CompareListDistance(&lists[j], &pivot) > 0) j--;
+			if (i <= j) {
+				ListDistance swap = lists[i];
+				lists[i++] = lists[j];
+				lists[j--] = swap;
+			}
+		}
+		if (wanted - 1 <= j) right = j;			// the wanted-th list is in the left part
+		else if (wanted - 1 >= i) left = i;		// or in the right part
+		else break;								// or between them, equal to the pivot
+	}
+	qsort(lists, wanted, sizeof(ListDistance), CompareListDistance);
+}
+
+// residual of row from centroid as floats
+static void Residual(const Feature* row, const Feature* centroid, float* residual) {
+	int d;
+	for (d = 0; d < FEATURE_VECTOR_LENGTH; d++) {
+		residual[d] = (float)(row[d] - centroid[d]);
+	}
+}
+
+
+/******************************************************
+*	PUBLIC functions
+*******************************************************/
+int ANNListCount(int size) {
+	int list_count = (int)(sqrt((double)size) + 0.5);
+	if (list_count < 1) list_count = 1;
+	if (list_count > ANN_MAX_LISTS) list_count = ANN_MAX_LISTS;
+	return list_count;
+}
+
+ANNIndex* BuildANNIndex(PackedDataSet* packed, int probes) {
+	int size = packed->Size;
+	int i, m, d;
+
+	ANNIndex* index = MemAllocate(sizeof(ANNIndex));
+	index->Size = size;
+	index->ListCount = ANNListCount(size);
+	if (probes < 1) probes = 1;
+	if (probes > index->ListCount) probes = index->ListCount;
+	index->Probes = probes;
+	index->Distances = packed->Distances;
+	index->Centroids = MemAllocateAligned(sizeof(Feature) * FEATURE_VECTOR_LENGTH * index->ListCount, FEATURE_ALIGNMENT);
+	index->Codebooks = MemAllocate(sizeof(float) * ANN_SUBQUANTIZERS * ANN_CODEBOOK_SIZE * ANN_SUBVECTOR_LENGTH);
+	index->ListStart = MemAllocate(sizeof(int) * (index->ListCount + 1));
+	index->Codes = MemAllocate(sizeof(unsigned char) * ANN_SUBQUANTIZERS * (size > 0 ? size : 1));
+	index->Labels = MemAllocate(sizeof(char) * (size > 0 ? size : 1));
+	if (size == 0) {
+		for (i = 0; i <= index->ListCount; i++) index->ListStart[i] = 0;
+		for (i = 0; i < FEATURE_VECTOR_LENGTH * index->ListCount; i++) index->Centroids[i] = 0;
+		for (i = 0; i < ANN_SUBQUANTIZERS * ANN_CODEBOOK_SIZE * ANN_SUBVECTOR_LENGTH; i++) index->Codebooks[i] = 0;
+		packed->Approximate = index;
+		return index;
+	}
+
+	// train the coarse centroids on evenly spaced rows
+	int sample_count = size < ANN_TRAINING_SAMPLE ? size : ANN_TRAINING_SAMPLE;
+	Feature* sample = MemAllocateAligned(sizeof(Feature) * FEATURE_VECTOR_LENGTH * sample_count, FEATURE_ALIGNMENT);
+	for (i = 0; i < sample_count; i++) {
+		const Feature* row = packed->Features + (int)(((long long)i * size) / sample_count) * FEATURE_VECTOR_LENGTH;
+		for (d = 0; d < FEATURE_VECTOR_LENGTH; d++) sample[i * FEATURE_VECTOR_LENGTH + d] = row[d];
+	}
+	TrainCoarseCentroids(index, sample, sample_count);
+
+	// train one codebook per group of features on the residuals of the sample
+	float* residuals = MemAllocate(sizeof(float) * FEATURE_VECTOR_LENGTH * sample_count);
+	float* subvectors = MemAllocate(sizeof(float) * ANN_SUBVECTOR_LENGTH * sample_count);
+	for (i = 0; i < sample_count; i++) {
+		const Feature* row = sample + i * FEATURE_VECTOR_LENGTH;
+		Residual(row, index->Centroids + NearestList(index, row) * FEATURE_VECTOR_LENGTH, residuals + i * FEATURE_VECTOR_LENGTH);
+	}
+	for (m = 0; m < ANN_SUBQUANTIZERS; m++) {
+		for (i = 0; i < sample_count; i++) {
+			for (d = 0; d < ANN_SUBVECTOR_LENGTH; d++) {
+				subvectors[i * ANN_SUBVECTOR_LENGTH + d] = residuals[i * FEATURE_VECTOR_LENGTH + m * ANN_SUBVECTOR_LENGTH + d];
+			}
+		}
+		KMeans(subvectors, sample_count, ANN_SUBVECTOR_LENGTH, ANN_CODEBOOK_SIZE,
+			index->Codebooks + m * ANN_CODEBOOK_SIZE * ANN_SUBVECTOR_LENGTH);
+	}
+	FreeMemory(subvectors);
+	FreeMemory(residuals);
+	FreeAligned(sample);
+
+	// assign every row to a list, then encode the rows list by list (counting sort)
+	int* row_list = MemAllocate(sizeof(int) * size);
+	for (i = 0; i <= index->ListCount; i++) index->ListStart[i] = 0;
+	for (i = 0; i < size; i++) {
+		row_list[i] = NearestList(index, packed->Features + i * FEATURE_VECTOR_LENGTH);
+		index->ListStart[row_list[i] + 1]++;
+	}
+	for (i = 0; i < index->ListCount; i++) index->ListStart[i + 1] += index->ListStart[i];
+
+	int* next_slot = MemAllocate(sizeof(int) * index->ListCount);
+	for (i = 0; i < index->ListCount; i++) next_slot[i] = index->ListStart[i];
+	float residual[FEATURE_VECTOR_LENGTH];
+	for (i = 0; i < size; i++) {
+		int list = row_list[i];
+		int slot = next_slot[list]++;
+		Residual(packed->Features + i * FEATURE_VECTOR_LENGTH, index->Centroids + list * FEATURE_VECTOR_LENGTH, residual);
+		for (m = 0; m < ANN_SUBQUANTIZERS; m++) {
+			index->Codes[slot * ANN_SUBQUANTIZERS + m] = (unsigned char)NearestCodeword(residual + m * ANN_SUBVECTOR_LENGTH,
+				index->Codebooks + m * ANN_CODEBOOK_SIZE * ANN_SUBVECTOR_LENGTH, ANN_CODEBOOK_SIZE, ANN_SUBVECTOR_LENGTH);
+		}
+		index->Labels[slot] = packed->Labels[i];
+	}
+	FreeMemory(next_slot);
+	FreeMemory(row_list);
+
+	FreeANNIndex(packed->Approximate);
+	packed->Approximate = index;
+	return index;
+}
+
+void DropANNRows(PackedDataSet* packed) {
+	FreeKDTree(packed->Tree);
+	packed->Tree = NULL;
+	if (packed->Mapping) {
+		UnmapFile(packed->Mapping);
+		packed->Mapping = NULL;
+	}
+	else {
+		FreeAligned(packed->Features);
+		if (packed->Labels) FreeMemory(packed->Labels);
+	}
+	packed->Features = NULL;
+	packed->Labels = NULL;
+}
+
+void FreeANNIndex(ANNIndex* index) {
+	if (!index) return;
+	FreeAligned(index->Centroids);
+	FreeMemory(index->Codebooks);
+	FreeMemory(index->ListStart);
+	FreeMemory(index->Codes);
+	FreeMemory(index->Labels);
+	FreeMemory(index);
+}
+
+void SearchANNIndex(const ANNIndex* index, const Feature* query, NeighborHeap* heap) {
+	Feature distances[KNN_BLOCK_SIZE];
+	float table[ANN_SUBQUANTIZERS * ANN_CODEBOOK_SIZE];		// distance from each query subvector to each codeword
+	float residual[FEATURE_VECTOR_LENGTH];
+	int block_start, i, m, c, d, p;
+
+	// find the lists to visit
+	ListDistance* lists = MemAllocate(sizeof(ListDistance) * index->ListCount);
+	for (block_start = 0; block_start < index->ListCount; block_start += KNN_BLOCK_SIZE) {
+		int block_size = index->ListCount - block_start;
+		if (block_size > KNN_BLOCK_SIZE) block_size = KNN_BLOCK_SIZE;
+		index->Distances(query, index->Centroids + block_start * FEATURE_VECTOR_LENGTH, block_size, distances);
+		for (i = 0; i < block_size; i++) {
+			lists[block_start + i].Dist = distances[i];
+			lists[block_start + i].List = block_start + i;
+		}
+	}
+	int probe_count = index->Probes < index->ListCount ? index->Probes : index->ListCount;
+	SelectNearestLists(lists, index->ListCount, probe_count);
+
+	for (p = 0; p < probe_count; p++) {
+		int list = lists[p].List;
+		int start = index->ListStart[list];
+		int end = index->ListStart[list + 1];
+		if (start == end) continue;
+
+		// residuals are relative to the list's centroid, so the lookup table is per list
+		Residual(query, index->Centroids + list * FEATURE_VECTOR_LENGTH, residual);
+		for (m = 0; m < ANN_SUBQUANTIZERS; m++) {
+			const float* codebook = index->Codebooks + m * ANN_CODEBOOK_SIZE * ANN_SUBVECTOR_LENGTH;
+			const float* sub_query = residual + m * ANN_SUBVECTOR_LENGTH;
+			for (c = 0; c < ANN_CODEBOOK_SIZE; c++) {
+				float dist = 0;
+				for (d = 0; d < ANN_SUBVECTOR_LENGTH; d++) {
+					float diff = sub_query[d] - codebook[c * ANN_SUBVECTOR_LENGTH + d];
+					dist += diff * diff;
+				}
+				table[m * ANN_CODEBOOK_SIZE + c] = dist;
+			}
+		}
+
+		const unsigned char* code = index->Codes + start * ANN_SUBQUANTIZERS;
+		for (i = start; i < end; i++, code += ANN_SUBQUANTIZERS) {
+			float dist = 0;
+			for (m = 0; m < ANN_SUBQUANTIZERS; m++) {
+				dist += table[m * ANN_CODEBOOK_SIZE + code[m]];
+			}
+			NeighborHeap_Offer(heap, dist, index->Labels[i], i);
+		}
+	}
+	FreeMemory(lists);
+}
@@ -0,0 +1,56 @@
+#ifndef ANN_H
+#define ANN_H
+
+/*
+*	Approximate K-nearest neighbors search with an inverted file of product quantized codes (IVF-PQ).
+*
+*	The training rows are clustered around ListCount coarse centroids. Each row is stored in the
+*	list of its nearest centroid, and its residual from that centroid is compressed to
+*	ANN_SUBQUANTIZERS bytes: one codebook index per group of ANN_SUBVECTOR_LENGTH features.
+*	A query only visits the Probes lists whose centroids are nearest to it, and distances to the
+*	codes are looked up from small per-list tables instead of being computed from the features.
+*
+*	Probes is the recall/speed knob: more probes visit more lists, which is slower but misses
+*	fewer true neighbors. With Probes == ListCount every row is visited.
+*/
+
+#include "ocr.h"
+#include "knn.h"
+
+#define ANN_SUBQUANTIZERS 8									// bytes per encoded row
+#define ANN_SUBVECTOR_LENGTH (FEATURE_VECTOR_LENGTH / ANN_SUBQUANTIZERS)
+#define ANN_CODEBOOK_SIZE 256								// codewords per subquantizer (one byte)
+#define ANN_KMEANS_ITERATIONS 12
+#define ANN_TRAINING_SAMPLE 32768							// rows used to train the centroids and codebooks
+#define ANN_DEFAULT_PROBES 4
+#define ANN_MAX_LISTS 4096										// ListCount is sqrt(Size), up to this
+
+struct _ANNIndex {
+	int Size;					// number of encoded rows
+	int ListCount;				// number of coarse centroids (inverted lists)
+	int Probes;					// lists visited per query, 1 to ListCount
+	Feature* Centroids;			// ListCount * FEATURE_VECTOR_LENGTH, FEATURE_ALIGNMENT aligned
+	float* Codebooks;			// ANN_SUBQUANTIZERS * ANN_CODEBOOK_SIZE * ANN_SUBVECTOR_LENGTH
+	int* ListStart;				// rows of list i are ListStart[i] to ListStart[i + 1] - 1
+	unsigned char* Codes;		// Size * ANN_SUBQUANTIZERS, grouped by list
+	char* Labels;				// class label of each encoded row
+	DistanceKernel Distances;	// kernel used against the coarse centroids
+};
+
+// number of lists of an index over size rows
+int ANNListCount(int size);
+
+// builds an index over the rows of packed and stores it in packed->Approximate. probes is
+// clamped to 1..ListCount. the packed rows are left untouched, so exact search stays available
+ANNIndex* BuildANNIndex(PackedDataSet* packed, int probes);
+
+// frees (or unmaps) the rows, labels and KD-tree of packed once its index is built, leaving only the
+// codes in memory. the set can then only be searched through packed->Approximate
+void DropANNRows(PackedDataSet* packed);
+
+void FreeANNIndex(ANNIndex* index);
+
+// offers the approximate distances of the rows in the Probes nearest lists to heap
+void SearchANNIndex(const ANNIndex* index, const Feature* query, NeighborHeap* heap);
+
+#endif
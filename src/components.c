@@ -0,0 +1,247 @@
+/*
+*	Connected component labeling (see components.h)
+*/
+#include "components.h"
+#include "system.h"
+#include <string.h>
+
+#define LABEL_MIN_BAND_ROWS 64		// fewest rows worth giving a labeling thread
+
+typedef struct {
+	const BinaryDocument* bd;
+	int y_start;					// rows y_start to y_end - 1 of the page
+	int y_end;
+	ComponentRun* runs;				// runs of the band in page order. the component of a run is its index until the bands are joined
+	int* parent;					// union-find forest over the runs
+	Component* boxes;				// bounding box and pixel count of the tree rooted at each run
+	int run_count;
+	int run_capacity;
+	int first_row_end;				// runs of row y_start are runs[0] to runs[first_row_end - 1]
+	int last_row_start;				// runs of row y_end - 1 start at runs[last_row_start]
+} LabelBand;
+
+static int FindRoot(int* parent, int run) {
+	while (parent[run] != run) {
+		parent[run] = parent[parent[run]];		// path halving
+		run = parent[run];
+	}
+	return run;
+}
+
+// joins the trees of runs a and b. the root with the lower index is kept, so the result does not depend on the order of the joins
+static void JoinRuns(int* parent, Component* boxes, int a, int b) {
+	a = FindRoot(parent, a);
+	b = FindRoot(parent, b);
+	if (a == b) return;
+	if (b < a) {
+		int swap = a;
+		a = b;
+		b = swap;
+	}
+	parent[b] = a;
+	if (boxes[b].min_x < boxes[a].min_x) boxes[a].min_x = boxes[b].min_x;
+	if (boxes[b].max_x > boxes[a].max_x) boxes[a].max_x = boxes[b].max_x;
+	if (boxes[b].min_y < boxes[a].min_y) boxes[a].min_y = boxes[b].min_y;
+	if (boxes[b].max_y > boxes[a].max_y) boxes[a].max_y = boxes[b].max_y;
+	boxes[a].pixel_count += boxes[b].pixel_count;
+}
+
+// joins the 8-connected runs of two consecutive rows (each sorted by x)
+static void JoinRows(int* parent, Component* boxes, const ComponentRun* runs, int above_start, int above_end, int row_start, int row_end) {
+	int i = above_start;
+	int j = row_start;
+	while (i < above_end && j < row_end) {
+		// runs that overlap or touch diagonally
+		if (runs[i].x_start <= runs[j].x_end && runs[j].x_start <= runs[i].x_end) {
+			JoinRuns(parent, boxes, i, j);
+		}
+		if (runs[i].x_end < runs[j].x_end) i++;
+		else j++;
+	}
+}
+
+// first pixel at or after x whose bit is set (or clear, if set is 0). width if there is none
+static int NextEdge(const unsigned long long* row, int words_per_row, int width, int x, int set) {
+	int w = x / PACKED_WORD_BITS;
+	if (w >= words_per_row) return width;
+	unsigned long long bits = (set ? row[w] : ~row[w]) & (~0ULL << (x % PACKED_WORD_BITS));
+	while (bits == 0) {
+		if (++w >= words_per_row) return width;
+		bits = set ? row[w] : ~row[w];
+	}
+	x = w * PACKED_WORD_BITS + LowestSetBit64(bits);
+	return x < width ? x : width;
+}
+
+static void AddRun(LabelBand* band, int y, int x_start, int x_end) {
+	if (band->run_count == band->run_capacity) {
+		int capacity = band->run_capacity * 2;
+		ComponentRun* runs = MemAllocate(sizeof(ComponentRun) * capacity);
+		int* parent = MemAllocate(sizeof(int) * capacity);
+		Component* boxes = MemAllocate(sizeof(Component) * capacity);
+		memcpy(runs, band->runs, sizeof(ComponentRun) * band->run_count);
+		memcpy(parent, band->parent, sizeof(int) * band->run_count);
+		memcpy(boxes, band->boxes, sizeof(Component) * band->run_count);
+		FreeMemory(band->runs);
+		FreeMemory(band->parent);
+		FreeMemory(band->boxes);
+		band->runs = runs;
+		band->parent = parent;
+		band->boxes = boxes;
+		band->run_capacity = capacity;
+	}
+	int i = band->run_count++;
+	band->runs[i].y = y;
+	band->runs[i].x_start = x_start;
+	band->runs[i].x_end = x_end;
+	band->runs[i].component = i;
+	band->parent[i] = i;
+	band->boxes[i].min_x = x_start;
+	band->boxes[i].max_x = x_end - 1;
+	band->boxes[i].min_y = y;
+	band->boxes[i].max_y = y;
+	band->boxes[i].pixel_count = x_end - x_start;
+}
+
+static void LabelBandWorker(void* arg) {
+	LabelBand* band = (LabelBand*)arg;
+	const BinaryDocument* bd = band->bd;
+	int width = bd->width;
+	int words_per_row = PACKED_WORDS(width);
+	unsigned char* scratch = MemAllocate(sizeof(unsigned char) * (width > 0 ? width : 1));
+	unsigned long long* buffer = MemAllocate(sizeof(unsigned long long) * (words_per_row > 0 ? words_per_row : 1));
+	int above_start = 0, above_end = 0;		// runs of the row above
+	int y;
+
+	band->run_capacity = 256;
+	band->run_count = 0;
+	band->runs = MemAllocate(sizeof(ComponentRun) * band->run_capacity);
+	band->parent = MemAllocate(sizeof(int) * band->run_capacity);
+	band->boxes = MemAllocate(sizeof(Component) * band->run_capacity);
+	band->first_row_end = 0;
+	band->last_row_start = 0;
+
+	for (y = band->y_start; y < band->y_end; y++) {
+		const unsigned long long* row = BinaryDocument_GetPackedRow(bd, y, scratch, buffer);
+		int row_start = band->run_count;
+		int x = NextEdge(row, words_per_row, width, 0, 1);
+		while (x < width) {
+			int x_end = NextEdge(row, words_per_row, width, x, 0);
+			AddRun(band, y, x, x_end);
+			x = x_end < width ? NextEdge(row, words_per_row, width, x_end, 1) : width;
+		}
+		if (y > band->y_start) {
+			JoinRows(band->parent, band->boxes, band->runs, above_start, above_end, row_start, band->run_count);
+		}
+		else {
+			band->first_row_end = band->run_count;
+		}
+		above_start = row_start;
+		above_end = band->run_count;
+	}
+	band->last_row_start = above_start;
+
+	FreeMemory(scratch);
+	FreeMemory(buffer);
+}
+
+ComponentLabeling LabelComponents(const BinaryDocument* bd) {
+	int height = bd->height;
+	int thread_count = GetWorkerThreadCount();
+	if (thread_count > height / LABEL_MIN_BAND_ROWS) thread_count = height / LABEL_MIN_BAND_ROWS;
+	if (thread_count < 1) thread_count = 1;
+	LabelBand* bands = MemAllocate(sizeof(LabelBand) * thread_count);
+	int i, b;
+	for (b = 0; b < thread_count; b++) {
+		bands[b].bd = bd;
+		bands[b].y_start = (int)((long long)height * b / thread_count);
+		bands[b].y_end = (int)((long long)height * (b + 1) / thread_count);
+	}
+	RunParallel(LabelBandWorker, bands, sizeof(LabelBand), thread_count);
+
+	// one forest over the runs of every band, in page order
+	int run_count = 0;
+	for (b = 0; b < thread_count; b++) {
+		run_count += bands[b].run_count;
+	}
+	ComponentRun* runs = MemAllocate(sizeof(ComponentRun) * (run_count > 0 ? run_count : 1));
+	int* parent = MemAllocate(sizeof(int) * (run_count > 0 ? run_count : 1));
+	Component* boxes = MemAllocate(sizeof(Component) * (run_count > 0 ? run_count : 1));
+	int offset = 0;
+	for (b = 0; b < thread_count; b++) {
+		LabelBand* band = &bands[b];
+		memcpy(runs + offset, band->runs, sizeof(ComponentRun) * band->run_count);
+		memcpy(boxes + offset, band->boxes, sizeof(Component) * band->run_count);
+		for (i = 0; i < band->run_count; i++) {
+			parent[offset + i] = band->parent[i] + offset;
+		}
+
+		// join the seam between the last row of the band above and the first row of this one
+		if (b > 0) {
+			LabelBand* above = &bands[b - 1];
+			int above_offset = offset - above->run_count;
+			if (above->y_end > above->y_start && band->y_end > band->y_start) {
+				JoinRows(parent, boxes, runs, above_offset + above->last_row_start, offset, offset, offset + band->first_row_end);
+			}
+		}
+		offset += band->run_count;
+		FreeMemory(band->runs);
+		FreeMemory(band->parent);
+		FreeMemory(band->boxes);
+	}
+	FreeMemory(bands);
+
+	// number the components in the order their first run appears, and count their runs
+	ComponentLabeling labeling;
+	int* number = MemAllocate(sizeof(int) * (run_count > 0 ? run_count : 1));		// component of each root, or -1
+	for (i = 0; i < run_count; i++) {
+		number[i] = -1;
+	}
+	int component_count = 0;
+	for (i = 0; i < run_count; i++) {
+		int root = FindRoot(parent, i);
+		if (number[root] < 0) number[root] = component_count++;
+		runs[i].component = number[root];
+	}
+	labeling.components = MemAllocate(sizeof(Component) * (component_count > 0 ? component_count : 1));
+	labeling.component_count = component_count;
+	for (i = 0; i < run_count; i++) {
+		if (parent[i] == i) {
+			Component* component = &labeling.components[number[i]];
+			*component = boxes[i];
+			component->run_count = 0;
+		}
+	}
+	for (i = 0; i < run_count; i++) {
+		labeling.components[runs[i].component].run_count++;
+	}
+
+	// group the runs by component, keeping page order within each
+	int first_run = 0;
+	for (i = 0; i < component_count; i++) {
+		labeling.components[i].first_run = first_run;
+		first_run += labeling.components[i].run_count;
+		labeling.components[i].run_count = 0;
+	}
+	labeling.runs = MemAllocate(sizeof(ComponentRun) * (run_count > 0 ? run_count : 1));
+	labeling.run_count = run_count;
+	for (i = 0; i < run_count; i++) {
+		Component* component = &labeling.components[runs[i].component];
+		labeling.runs[component->first_run + component->run_count++] = runs[i];
+	}
+
+	FreeMemory(number);
+	FreeMemory(runs);
+	FreeMemory(parent);
+	FreeMemory(boxes);
+	return labeling;
+}
+
+void ComponentLabeling_Free(ComponentLabeling* labeling) {
+	FreeMemory(labeling->components);
+	FreeMemory(labeling->runs);
+	labeling->components = NULL;
+	labeling->runs = NULL;
+	labeling->component_count = 0;
+	labeling->run_count = 0;
+}
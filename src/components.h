@@ -0,0 +1,44 @@
+#ifndef COMPONENTS_H
+#define COMPONENTS_H
+
+/*
+*	Connected component labeling of the foreground of a binary document.
+*	The page is read once, a packed row at a time, as runs of foreground pixels. every run starts
+*	as a component of its own and is joined (union-find) to the runs it touches in the row above,
+*	8-connected, the bounding boxes and pixel counts being merged as the runs are joined. Row bands
+*	are labeled in parallel and then joined along their seams, and the components are numbered in
+*	the order their first pixel is met, so the result does not depend on the number of bands.
+*/
+
+#include "preprocess.h"
+
+typedef struct _ComponentRun {
+	int y;
+	int x_start;			// first pixel of the run
+	int x_end;				// one past its last pixel
+	int component;			// index of the component in ComponentLabeling.components
+} ComponentRun;
+
+typedef struct _Component {
+	int min_x;				// bounding box, inclusive
+	int max_x;
+	int min_y;
+	int max_y;
+	int pixel_count;
+	int first_run;			// runs of the component, in page order: runs[first_run] onwards
+	int run_count;
+} Component;
+
+typedef struct _ComponentLabeling {
+	Component* components;
+	int component_count;
+	ComponentRun* runs;		// every run of the page, grouped by component
+	int run_count;
+} ComponentLabeling;
+
+// labels the foreground of the document, reading it through BinaryDocument_GetPackedRow
+ComponentLabeling LabelComponents(const BinaryDocument* bd);
+
+void ComponentLabeling_Free(ComponentLabeling* labeling);
+
+#endif
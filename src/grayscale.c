@@ -0,0 +1,127 @@
+/*
+*	BGR to grayscale kernels for binarization (see grayscale.h)
+*/
+#include "grayscale.h"
+#include "system.h"
+
+#if LCDK == 0 && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define GRAY_X86 1
+#include <immintrin.h>
+#else
+#define GRAY_X86 0
+#endif
+
+// the vector kernels are compiled for their instruction set regardless of the global compiler flags
+#if defined(__GNUC__) || defined(__clang__)
+#define GRAY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define GRAY_TARGET(isa)
+#endif
+
+// (v * LUMA_RECIPROCAL) >> (16 + LUMA_RECIPROCAL_SHIFT) == v / LUMA_SCALE for every v up to 255 * LUMA_SCALE
+#define LUMA_RECIPROCAL 41944
+#define LUMA_RECIPROCAL_SHIFT 6
+
+void GrayscaleRowScalar(const unsigned char* bgr, int width, unsigned char* gray) {
+	int x;
+	for (x = 0; x < width; x++) {
+		const unsigned char* pixel = bgr + x * 3;		// info stored in BGR order
+		gray[x] = (unsigned char)((LUMA_R * pixel[2] + LUMA_G * pixel[1] + LUMA_B * pixel[0]) / LUMA_SCALE);
+	}
+}
+
+#if GRAY_X86
+/******************************************************************************
+*	A 16 byte window starting at a pixel holds that pixel and the next three.
+*	One shuffle moves their blue and green bytes into pairs and their red bytes
+*	next to zeros, so a multiply-add of unsigned bytes by the signed weights gives
+*	LUMA_B * b + LUMA_G * g for the 4 pixels and LUMA_R * r for the 4 pixels as
+*	16 bit sums. two windows are combined into the weighted sums of 8 pixels,
+*	which the reciprocal multiply divides by LUMA_SCALE.
+*	the last window of each step reads 4 bytes past the step's pixels, so the
+*	loops stop short of the end of the row and finish with the scalar kernel.
+*******************************************************************************/
+#define LUMA_SHUFFLE 0, 1, 3, 4, 6, 7, 9, 10, 2, -1, 5, -1, 8, -1, 11, -1
+#define LUMA_WEIGHTS LUMA_B, LUMA_G, LUMA_B, LUMA_G, LUMA_B, LUMA_G, LUMA_B, LUMA_G, LUMA_R, 0, LUMA_R, 0, LUMA_R, 0, LUMA_R, 0
+
+// luma of the 8 pixels starting at p, as 16 bit lanes
+GRAY_TARGET("ssse3")
+static __m128i LumaSSSE3(const unsigned char* p, __m128i shuffle, __m128i weights) {
+	__m128i low = _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), shuffle), weights);
+	__m128i high = _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), shuffle), weights);
+	__m128i sums = _mm_add_epi16(_mm_unpacklo_epi64(low, high), _mm_unpackhi_epi64(low, high));
+	return _mm_srli_epi16(_mm_mulhi_epu16(sums, _mm_set1_epi16((short)LUMA_RECIPROCAL)), LUMA_RECIPROCAL_SHIFT);
+}
+
+GRAY_TARGET("ssse3")
+static void GrayscaleRowSSSE3(const unsigned char* bgr, int width, unsigned char* gray) {
+	const __m128i shuffle = _mm_setr_epi8(LUMA_SHUFFLE);
+	const __m128i weights = _mm_setr_epi8(LUMA_WEIGHTS);
+	int x;
+	for (x = 0; x + 18 <= width; x += 16) {
+		const unsigned char* p = bgr + x * 3;
+		__m128i low = LumaSSSE3(p, shuffle, weights);
+		__m128i high = LumaSSSE3(p + 24, shuffle, weights);
+		_mm_storeu_si128((__m128i*)(gray + x), _mm_packus_epi16(low, high));
+	}
+	GrayscaleRowScalar(bgr + x * 3, width - x, gray + x);
+}
+
+// luma of the 16 pixels starting at p: the low 128 bit lane converts pixels 0 to 7, the high lane 8 to 15
+GRAY_TARGET("avx2")
+static __m256i LumaAVX2(const unsigned char* p, __m256i shuffle, __m256i weights) {
+	__m256i first = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+		_mm_loadu_si128((const __m128i*)(p + 24)), 1);
+	__m256i second = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + 12))),
+		_mm_loadu_si128((const __m128i*)(p + 36)), 1);
+	__m256i low = _mm256_maddubs_epi16(_mm256_shuffle_epi8(first, shuffle), weights);
+	__m256i high = _mm256_maddubs_epi16(_mm256_shuffle_epi8(second, shuffle), weights);
+	__m256i sums = _mm256_add_epi16(_mm256_unpacklo_epi64(low, high), _mm256_unpackhi_epi64(low, high));
+	return _mm256_srli_epi16(_mm256_mulhi_epu16(sums, _mm256_set1_epi16((short)LUMA_RECIPROCAL)), LUMA_RECIPROCAL_SHIFT);
+}
+
+GRAY_TARGET("avx2")
+static void GrayscaleRowAVX2(const unsigned char* bgr, int width, unsigned char* gray) {
+	const __m256i shuffle = _mm256_setr_epi8(LUMA_SHUFFLE, LUMA_SHUFFLE);
+	const __m256i weights = _mm256_setr_epi8(LUMA_WEIGHTS, LUMA_WEIGHTS);
+	int x;
+	for (x = 0; x + 34 <= width; x += 32) {
+		const unsigned char* p = bgr + x * 3;
+		__m256i low = LumaAVX2(p, shuffle, weights);
+		__m256i high = LumaAVX2(p + 48, shuffle, weights);
+		// packing works within the 128 bit lanes, leaving the 8 byte groups in the order 0, 2, 1, 3
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xd8);
+		_mm256_storeu_si256((__m256i*)(gray + x), packed);
+	}
+	GrayscaleRowScalar(bgr + x * 3, width - x, gray + x);
+}
+#endif
+
+
+GrayscaleKernel SelectGrayscaleKernel() {
+#if GRAY_X86
+	int features = GetCPUFeatures();
+	if (features & CPU_AVX2)		return GrayscaleRowAVX2;
+	if (features & CPU_SSSE3)		return GrayscaleRowSSSE3;
+#endif
+	return GrayscaleRowScalar;
+}
+
+const char* GrayscaleKernelName(GrayscaleKernel kernel) {
+#if GRAY_X86
+	if (kernel == GrayscaleRowAVX2)		return "AVX2";
+	if (kernel == GrayscaleRowSSSE3)	return "SSSE3";
+#endif
+	return "scalar";
+}
+
+int GetGrayscaleKernels(GrayscaleKernel* kernels, int max_kernels) {
+	int count = 0;
+	if (count < max_kernels) kernels[count++] = GrayscaleRowScalar;
+#if GRAY_X86
+	int features = GetCPUFeatures();
+	if ((features & CPU_SSSE3) && count < max_kernels) kernels[count++] = GrayscaleRowSSSE3;
+	if ((features & CPU_AVX2) && count < max_kernels) kernels[count++] = GrayscaleRowAVX2;
+#endif
+	return count;
+}
@@ -0,0 +1,31 @@
+#ifndef GRAYSCALE_H
+#define GRAYSCALE_H
+
+/*
+*	BGR to grayscale kernels for binarization.
+*	Every kernel converts one row of 24 bit BGR pixels to 8 bit luma with the integer
+*	luminosity weights (LUMA_R * r + LUMA_G * g + LUMA_B * b) / LUMA_SCALE, and every
+*	kernel gives exactly the result of GrayscaleRowScalar(). The widest instruction set
+*	supported by the running CPU is picked at runtime.
+*	gray may be the start of bgr itself (in place conversion): no pixel is written before
+*	the bytes it overwrites have been read.
+*/
+
+#define LUMA_R 21			// luminosity weights, in hundredths
+#define LUMA_G 72
+#define LUMA_B 7
+#define LUMA_SCALE 100
+
+typedef void (*GrayscaleKernel)(const unsigned char* bgr, int width, unsigned char* gray);
+
+void GrayscaleRowScalar(const unsigned char* bgr, int width, unsigned char* gray);
+
+GrayscaleKernel SelectGrayscaleKernel();
+
+// name of the kernel SelectGrayscaleKernel() returns, for diagnostics
+const char* GrayscaleKernelName(GrayscaleKernel kernel);
+
+// every kernel this build has for the running CPU, scalar first. returns how many were written to kernels
+int GetGrayscaleKernels(GrayscaleKernel* kernels, int max_kernels);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+*	KD-tree for exact K-nearest neighbors search over a packed training set (see kdtree.h)
+*/
+#include "kdtree.h"
+#include "system.h"
+
+/******************************************************
+*	PRIVATE functions
+*******************************************************/
+
+// feature dim of the row at position i of the build order
+#define ROW_FEATURE(features, order, i, dim) ((features)[(order)[i] * FEATURE_VECTOR_LENGTH + (dim)])
+
+// partially sorts order[start, start + count) on feature dim so the element at position nth
+// is the one that would be there if fully sorted (quickselect)
+static void SelectNth(const Feature* features, int* order, int start, int count, int nth, int dim) {
+	int lo = start;
+	int hi = start + count - 1;
+	while (lo < hi) {
+		Feature pivot = ROW_FEATURE(features, order, (lo + hi) / 2, dim);
+		int i = lo;
+		int j = hi;
+		while (i <= j) {
+			while (ROW_FEATURE(features, order, i, dim) < pivot) i++;
+			while (ROW_FEATURE(features, order, j, dim) > pivot) j--;
+			if (i <= j) {
+				int tmp = order[i];
+				order[i] = order[j];
+				order[j] = tmp;
+				i++;
+				j--;
+			}
+		}
+		if (nth <= j) hi = j;
+		else if (nth >= i) lo = i;
+		else break;
+	}
+}
+
+// recursively builds the subtree over order[start, start + count) and returns its node index
+static int BuildNode(KDTree* tree, const Feature* features, int* order, int start, int count) {
+	int node_index = tree->NodeCount++;
+	KDNode* node = &tree->Nodes[node_index];
+	node->Start = start;
+	node->Count = count;
+	node->Left = -1;
+	node->Right = -1;
+	node->SplitDim = 0;
+	node->SplitValue = 0;
+	if (count <= KD_TREE_LEAF_SIZE) return node_index;
+
+	// split on the feature with the largest spread
+	Feature min[FEATURE_VECTOR_LENGTH], max[FEATURE_VECTOR_LENGTH];
+	int i, j;
+	for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+		min[j] = max[j] = ROW_FEATURE(features, order, start, j);
+	}
+	for (i = start + 1; i < start + count; i++) {
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			Feature f = ROW_FEATURE(features, order, i, j);
+			if (f < min[j]) min[j] = f;
+			if (f > max[j]) max[j] = f;
+		}
+	}
+	int split_dim = 0;
+	for (j = 1; j < FEATURE_VECTOR_LENGTH; j++) {
+		if (max[j] - min[j] > max[split_dim] - min[split_dim]) split_dim = j;
+	}
+	if (max[split_dim] == min[split_dim]) return node_index;		// all rows identical, keep as one leaf
+
+	int half = count / 2;
+	SelectNth(features, order, start, count, start + half, split_dim);
+	Feature split_value = ROW_FEATURE(features, order, start + half, split_dim);
+
+	int left = BuildNode(tree, features, order, start, half);
+	int right = BuildNode(tree, features, order, start + half, count - half);
+
+	node->Left = left;
+	node->Right = right;
+	node->SplitDim = split_dim;
+	node->SplitValue = split_value;
+	return node_index;
+}
+
+/*
+*	offsets: per-feature distance from the query to the box of this node (0 where the query is inside)
+*	box_dist: sum of squared offsets, a lower bound on the distance to any row in the node
+*/
+static void SearchNode(const PackedDataSet* packed, int node_index, const Feature* query, Feature* offsets,
+						double box_dist, NeighborHeap* heap) {
+	const KDNode* node = &packed->Tree->Nodes[node_index];
+
+	if (node->Left < 0) {		// leaf: scan its rows with the distance kernel
+		Feature distances[KD_TREE_LEAF_SIZE];
+		int start = node->Start;
+		int remaining = node->Count;
+		int i;
+		while (remaining > 0) {		// leaves of identical rows may hold more than KD_TREE_LEAF_SIZE
+			int block = remaining > KD_TREE_LEAF_SIZE ? KD_TREE_LEAF_SIZE : remaining;
+			packed->Distances(query, packed->Features + start * FEATURE_VECTOR_LENGTH, block, distances);
+			for (i = 0; i < block; i++) {
+				NeighborHeap_Offer(heap, distances[i], packed->Labels[start + i], start + i);
+			}
+			start += block;
+			remaining -= block;
+		}
+		return;
+	}
+
+	int dim = node->SplitDim;
+	Feature diff = query[dim] - node->SplitValue;
+	int near_child = diff <= 0 ? node->Left : node->Right;
+	int far_child = diff <= 0 ? node->Right : node->Left;
+
+	SearchNode(packed, near_child, query, offsets, box_dist, heap);
+
+	// the far box is at least as far as the splitting plane along dim
+	Feature old_offset = offsets[dim];
+	double far_dist = box_dist - (double)old_offset * old_offset + (double)diff * diff;
+	if (heap->Count < heap->K || far_dist <= heap->Items[0].DistSquared) {		// <= so ties are resolved like brute force
+		offsets[dim] = diff;
+		SearchNode(packed, far_child, query, offsets, far_dist, heap);
+		offsets[dim] = old_offset;
+	}
+}
+
+
+/******************************************************
+*	PUBLIC functions
+*******************************************************/
+KDTree* BuildKDTree(PackedDataSet* packed) {
+	int size = packed->Size;
+	int i, j;
+
+	KDTree* tree = MemAllocate(sizeof(KDTree));
+	tree->NodeCount = 0;
+	tree->Mapped = 0;
+	// a tree with leaves of at least KD_TREE_LEAF_SIZE / 2 rows has fewer than 4 * size / KD_TREE_LEAF_SIZE nodes
+	tree->Nodes = MemAllocate(sizeof(KDNode) * (4 * size / KD_TREE_LEAF_SIZE + 1));
+
+	int* order = MemAllocate(sizeof(int) * (size > 0 ? size : 1));
+	for (i = 0; i < size; i++) {
+		order[i] = i;
+	}
+	if (size > 0) BuildNode(tree, packed->Features, order, 0, size);
+
+	// reorder the packed rows so every leaf is contiguous
+	Feature* features = MemAllocateAligned(sizeof(Feature) * FEATURE_VECTOR_LENGTH * (size > 0 ? size : 1), FEATURE_ALIGNMENT);
+	char* labels = MemAllocate(sizeof(char) * (size > 0 ? size : 1));
+	for (i = 0; i < size; i++) {
+		const Feature* source = packed->Features + order[i] * FEATURE_VECTOR_LENGTH;
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			features[i * FEATURE_VECTOR_LENGTH + j] = source[j];
+		}
+		labels[i] = packed->Labels[order[i]];
+	}
+	if (packed->Mapping) {		// nothing points into a mapped file any more, and FreePackedDataSet frees the copies
+		UnmapFile(packed->Mapping);
+		packed->Mapping = NULL;
+	}
+	else {
+		FreeAligned(packed->Features);
+		FreeMemory(packed->Labels);
+	}
+	FreeMemory(order);
+	packed->Features = features;
+	packed->Labels = labels;
+
+	FreeKDTree(packed->Tree);
+	packed->Tree = tree;
+	return tree;
+}
+
+void FreeKDTree(KDTree* tree) {
+	if (!tree) return;
+	if (!tree->Mapped) FreeMemory(tree->Nodes);
+	FreeMemory(tree);
+}
+
+int CheckKDTree(const KDTree* tree, int size) {
+	const KDNode* nodes = tree->Nodes;
+	int node_count = tree->NodeCount;
+	int i;
+	if (node_count < 1 || nodes[0].Start != 0 || nodes[0].Count != size) return 0;
+
+	// every node but the root is the child of exactly one node before it
+	unsigned char* referenced = MemAllocate(sizeof(unsigned char) * node_count);
+	for (i = 0; i < node_count; i++) {
+		referenced[i] = 0;
+	}
+	for (i = 0; i < node_count; i++) {
+		const KDNode* node = &nodes[i];
+		if (node->Start < 0 || node->Count < 0 || node->Start > size - node->Count) break;
+		if (node->Left < 0 && node->Right < 0) continue;		// leaf
+
+		// a split node halves its rows as BuildNode does, which also bounds the depth of a search
+		if (node->Left <= i || node->Right <= i || node->Left >= node_count || node->Right >= node_count || node->Left == node->Right) break;
+		if (referenced[node->Left] || referenced[node->Right]) break;
+		if (node->SplitDim < 0 || node->SplitDim >= FEATURE_VECTOR_LENGTH || node->Count <= KD_TREE_LEAF_SIZE) break;
+		const KDNode* left = &nodes[node->Left];
+		const KDNode* right = &nodes[node->Right];
+		if (left->Start != node->Start || left->Count != node->Count / 2) break;
+		if (right->Start != node->Start + left->Count || right->Count != node->Count - left->Count) break;
+		referenced[node->Left] = 1;
+		referenced[node->Right] = 1;
+	}
+	FreeMemory(referenced);
+	return i == node_count;
+}
+
+void SearchKDTree(const PackedDataSet* packed, const Feature* query, NeighborHeap* heap) {
+	Feature offsets[FEATURE_VECTOR_LENGTH];
+	int j;
+	if (!packed->Tree || packed->Tree->NodeCount == 0) return;
+	for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+		offsets[j] = 0;
+	}
+	SearchNode(packed, 0, query, offsets, 0.0, heap);
+}
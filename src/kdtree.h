@@ -0,0 +1,42 @@
+#ifndef KDTREE_H
+#define KDTREE_H
+
+/*
+*	KD-tree over the rows of a PackedDataSet for exact K-nearest neighbors search.
+*	Building the tree reorders the rows of the packed set so that every leaf is a
+*	contiguous run of rows, which lets the leaves be scanned with the SIMD distance kernels.
+*/
+
+#include "ocr.h"
+#include "knn.h"
+
+#define KD_TREE_LEAF_SIZE 32		// maximum number of rows in a leaf
+#define KD_TREE_MIN_SIZE 1024		// training sets smaller than this are searched faster by brute force
+
+typedef struct {
+	int Start;				// first row of the packed set under this node
+	int Count;				// number of rows under this node
+	int Left, Right;		// child nodes, -1 for a leaf
+	int SplitDim;			// feature the node splits on
+	Feature SplitValue;		// rows in Left have feature SplitDim <= SplitValue, rows in Right >= SplitValue
+} KDNode;
+
+struct _KDTree {
+	KDNode* Nodes;			// Nodes[0] is the root
+	int NodeCount;
+	int Mapped;				// 1 if Nodes point into a mapped training set file
+};
+
+// builds a tree over packed (reordering its rows into new buffers) and stores it in packed->Tree
+KDTree* BuildKDTree(PackedDataSet* packed);
+
+void FreeKDTree(KDTree* tree);
+
+// returns 1 if the nodes of tree are laid out as BuildKDTree lays out a tree over size rows, so that
+// a search cannot leave the rows or the nodes (for trees read from a file)
+int CheckKDTree(const KDTree* tree, int size);
+
+// offers the rows of packed that can still be among the nearest to heap, visiting the closest leaves first
+void SearchKDTree(const PackedDataSet* packed, const Feature* query, NeighborHeap* heap);
+
+#endif
@@ -0,0 +1,282 @@
+/*
+*	Distance kernels for K-nearest neighbors classification (see knn.h)
+*/
+#include "knn.h"
+#include "system.h"
+
+#if LCDK == 0 && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define KNN_X86 1
+#include <immintrin.h>
+#else
+#define KNN_X86 0
+#endif
+
+// the vector kernels are compiled for their instruction set regardless of the global compiler flags
+#if defined(__GNUC__) || defined(__clang__)
+#define KNN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KNN_TARGET(isa)
+#endif
+
+void SquaredDistancesScalar(const Feature* query, const Feature* rows, int count, Feature* distances) {
+	int i, j;
+	for (i = 0; i < count; i++, rows += FEATURE_VECTOR_LENGTH) {
+		Feature dist_squared = 0;
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			Feature diff = query[j] - rows[j];
+			dist_squared += diff * diff;
+		}
+		distances[i] = dist_squared;
+	}
+}
+
+#if KNN_X86
+#if !FEATURE_SINGLE_PRECISION
+/******************************************************************************
+*	double precision kernels: a row of 16 doubles is 8 SSE, 4 AVX or 2 AVX-512 registers
+*******************************************************************************/
+KNN_TARGET("sse2")
+static void SquaredDistancesSSE2(const Feature* query, const Feature* rows, int count, Feature* distances) {
+	__m128d q[8];
+	int i, j;
+	for (j = 0; j < 8; j++) q[j] = _mm_loadu_pd(query + 2 * j);
+
+	for (i = 0; i < count; i++, rows += FEATURE_VECTOR_LENGTH) {
+		__m128d acc0 = _mm_setzero_pd();
+		__m128d acc1 = _mm_setzero_pd();
+		for (j = 0; j < 8; j += 2) {
+			__m128d d0 = _mm_sub_pd(q[j], _mm_load_pd(rows + 2 * j));
+			__m128d d1 = _mm_sub_pd(q[j + 1], _mm_load_pd(rows + 2 * j + 2));
+			acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+			acc1 = _mm_add_pd(acc1, _mm_mul_pd(d1, d1));
+		}
+		acc0 = _mm_add_pd(acc0, acc1);
+		acc0 = _mm_add_sd(acc0, _mm_unpackhi_pd(acc0, acc0));
+		distances[i] = _mm_cvtsd_f64(acc0);
+	}
+}
+
+KNN_TARGET("avx2,fma")
+static void SquaredDistancesAVX2(const Feature* query, const Feature* rows, int count, Feature* distances) {
+	__m256d q0 = _mm256_loadu_pd(query);
+	__m256d q1 = _mm256_loadu_pd(query + 4);
+	__m256d q2 = _mm256_loadu_pd(query + 8);
+	__m256d q3 = _mm256_loadu_pd(query + 12);
+	int i;
+	for (i = 0; i < count; i++, rows += FEATURE_VECTOR_LENGTH) {
+		__m256d d0 = _mm256_sub_pd(q0, _mm256_load_pd(rows));
+		__m256d d1 = _mm256_sub_pd(q1, _mm256_load_pd(rows + 4));
+		__m256d d2 = _mm256_sub_pd(q2, _mm256_load_pd(rows + 8));
+		__m256d d3 = _mm256_sub_pd(q3, _mm256_load_pd(rows + 12));
+		__m256d acc0 = _mm256_fmadd_pd(d1, d1, _mm256_mul_pd(d0, d0));
+		__m256d acc1 = _mm256_fmadd_pd(d3, d3, _mm256_mul_pd(d2, d2));
+		__m256d acc = _mm256_add_pd(acc0, acc1);
+		__m128d sum = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+		sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+		distances[i] = _mm_cvtsd_f64(sum);
+	}
+}
+
+KNN_TARGET("avx512f")
+static void SquaredDistancesAVX512(const Feature* query, const Feature* rows, int count, Feature* distances) {
+	__m512d q0 = _mm512_loadu_pd(query);
+	__m512d q1 = _mm512_loadu_pd(query + 8);
+	int i;
+	for (i = 0; i < count; i++, rows += FEATURE_VECTOR_LENGTH) {
+		__m512d d0 = _mm512_sub_pd(q0, _mm512_load_pd(rows));
+		__m512d d1 = _mm512_sub_pd(q1, _mm512_load_pd(rows + 8));
+		distances[i] = _mm512_reduce_add_pd(_mm512_fmadd_pd(d1, d1, _mm512_mul_pd(d0, d0)));
+	}
+}
+
+#else
+/******************************************************************************
+*	single precision kernels: a row of 16 floats is 4 SSE, 2 AVX or 1 AVX-512 register
+*******************************************************************************/
+KNN_TARGET("sse2")
+static void SquaredDistancesSSE2(const Feature* query, const Feature* rows, int count, Feature* distances) {
+	__m128 q0 = _mm_loadu_ps(query);
+	__m128 q1 = _mm_loadu_ps(query + 4);
+	__m128 q2 = _mm_loadu_ps(query + 8);
+	__m128 q3 = _mm_loadu_ps(query + 12);
+	int i;
+	for (i = 0; i < count; i++, rows += FEATURE_VECTOR_LENGTH) {
+		__m128 d0 = _mm_sub_ps(q0, _mm_load_ps(rows));
+		__m128 d1 = _mm_sub_ps(q1, _mm_load_ps(rows + 4));
+		__m128 d2 = _mm_sub_ps(q2, _mm_load_ps(rows + 8));
+		__m128 d3 = _mm_sub_ps(q3, _mm_load_ps(rows + 12));
+		__m128 acc = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)),
+								_mm_add_ps(_mm_mul_ps(d2, d2), _mm_mul_ps(d3, d3)));
+		acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+		acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+		distances[i] = _mm_cvtss_f32(acc);
+	}
+}
+
+KNN_TARGET("avx2,fma")
+static void SquaredDistancesAVX2(const Feature* query, const Feature* rows, int count, Feature* distances) {
+	__m256 q0 = _mm256_loadu_ps(query);
+	__m256 q1 = _mm256_loadu_ps(query + 8);
+	int i;
+	for (i = 0; i < count; i++, rows += FEATURE_VECTOR_LENGTH) {
+		__m256 d0 = _mm256_sub_ps(q0, _mm256_load_ps(rows));
+		__m256 d1 = _mm256_sub_ps(q1, _mm256_load_ps(rows + 8));
+		__m256 acc = _mm256_fmadd_ps(d1, d1, _mm256_mul_ps(d0, d0));
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		distances[i] = _mm_cvtss_f32(sum);
+	}
+}
+
+KNN_TARGET("avx512f")
+static void SquaredDistancesAVX512(const Feature* query, const Feature* rows, int count, Feature* distances) {
+	__m512 q = _mm512_loadu_ps(query);
+	int i;
+	for (i = 0; i < count; i++, rows += FEATURE_VECTOR_LENGTH) {
+		__m512 d = _mm512_sub_ps(q, _mm512_load_ps(rows));
+		distances[i] = _mm512_reduce_add_ps(_mm512_mul_ps(d, d));
+	}
+}
+#endif
+#endif
+
+/******************************************************************************
+*	top-k selection
+*******************************************************************************/
+void NeighborHeap_Init(NeighborHeap* heap, int k) {
+	if (k > KNN_MAX_K) k = KNN_MAX_K;
+	if (k < 1) k = 1;
+	heap->K = k;
+	heap->Count = 0;
+}
+
+// a is farther than b (rows break ties so the order is deterministic)
+static int NeighborFarther(const Neighbor* a, const Neighbor* b) {
+	if (a->DistSquared != b->DistSquared) return a->DistSquared > b->DistSquared;
+	return a->Index > b->Index;
+}
+
+void NeighborHeap_Insert(NeighborHeap* heap, double dist_squared, char class_label, int index) {
+	Neighbor candidate;
+	candidate.DistSquared = dist_squared;
+	candidate.ClassLabel = class_label;
+	candidate.Index = index;
+	Neighbor* items = heap->Items;
+	int i;
+
+	if (heap->Count < heap->K) {		// sift the new neighbor up from the bottom
+		i = heap->Count++;
+		while (i > 0) {
+			int parent = (i - 1) / 2;
+			if (!NeighborFarther(&candidate, &items[parent])) break;
+			items[i] = items[parent];
+			i = parent;
+		}
+		items[i] = candidate;
+		return;
+	}
+
+	if (!NeighborFarther(&items[0], &candidate)) return;
+
+	// replace the farthest neighbor and sift the new one down
+	i = 0;
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= heap->Count) break;
+		if (child + 1 < heap->Count && NeighborFarther(&items[child + 1], &items[child])) child++;
+		if (!NeighborFarther(&items[child], &candidate)) break;
+		items[i] = items[child];
+		i = child;
+	}
+	items[i] = candidate;
+}
+
+int NeighborHeap_Sort(NeighborHeap* heap) {
+	int count = heap->Count;
+	int i, j;
+	for (i = 1; i < count; i++) {		// insertion sort, k is small
+		Neighbor n = heap->Items[i];
+		for (j = i; j > 0 && NeighborFarther(&heap->Items[j - 1], &n); j--) {
+			heap->Items[j] = heap->Items[j - 1];
+		}
+		heap->Items[j] = n;
+	}
+	heap->Count = 0;
+	return count;
+}
+
+void SearchNearest(const PackedDataSet* train, const Feature* query, NeighborHeap* heap) {
+	Feature distances[KNN_BLOCK_SIZE];
+	int block_start, i;
+	for (block_start = 0; block_start < train->Size; block_start += KNN_BLOCK_SIZE) {
+		int block_size = train->Size - block_start;
+		if (block_size > KNN_BLOCK_SIZE) block_size = KNN_BLOCK_SIZE;
+		train->Distances(query, train->Features + block_start * FEATURE_VECTOR_LENGTH, block_size, distances);
+
+		for (i = 0; i < block_size; i++) {
+			NeighborHeap_Offer(heap, distances[i], train->Labels[block_start + i], block_start + i);
+		}
+	}
+}
+
+void SearchNearestBatch(const PackedDataSet* train, const Feature* queries, int query_count, NeighborHeap* heaps) {
+	Feature distances[KNN_BLOCK_SIZE];
+	int block_start, q, i;
+	for (block_start = 0; block_start < train->Size; block_start += KNN_BLOCK_SIZE) {
+		int block_size = train->Size - block_start;
+		if (block_size > KNN_BLOCK_SIZE) block_size = KNN_BLOCK_SIZE;
+		const Feature* block = train->Features + block_start * FEATURE_VECTOR_LENGTH;
+		const char* labels = train->Labels + block_start;
+
+		for (q = 0; q < query_count; q++) {		// the block stays in cache across all queries
+			NeighborHeap* heap = &heaps[q];
+			train->Distances(queries + q * FEATURE_VECTOR_LENGTH, block, block_size, distances);
+			for (i = 0; i < block_size; i++) {
+				NeighborHeap_Offer(heap, distances[i], labels[i], block_start + i);
+			}
+		}
+	}
+}
+
+char VoteNeighbors(const Neighbor* sorted, int k) {
+	int votes[256];				// contains vote count for the class of the K-nearest neighbors
+	int i;
+	for (i = 0; i < k; i++) {
+		votes[(unsigned char)sorted[i].ClassLabel] = 0;
+	}
+	for (i = 0; i < k; i++) {
+		votes[(unsigned char)sorted[i].ClassLabel]++;
+	}
+	int max = 0;
+	char max_char = sorted[0].ClassLabel;		// most frequent class in K-nearest neighbors
+	for (i = 0; i < k; i++) {		// get character with the most frequent votes
+		char class_label = sorted[i].ClassLabel;
+		int votes_i = votes[(unsigned char)class_label];
+		if (votes_i > max) {
+			max = votes_i;
+			max_char = class_label;
+		}
+	}
+	return max_char;
+}
+
+
+DistanceKernel SelectDistanceKernel() {
+#if KNN_X86
+	int features = GetCPUFeatures();
+	if (features & CPU_AVX512F)		return SquaredDistancesAVX512;
+	if (features & CPU_AVX2)		return SquaredDistancesAVX2;
+	if (features & CPU_SSE2)		return SquaredDistancesSSE2;
+#endif
+	return SquaredDistancesScalar;
+}
+
+const char* DistanceKernelName(DistanceKernel kernel) {
+#if KNN_X86
+	if (kernel == SquaredDistancesAVX512)	return "AVX-512";
+	if (kernel == SquaredDistancesAVX2)		return "AVX2";
+	if (kernel == SquaredDistancesSSE2)		return "SSE2";
+#endif
+	return "scalar";
+}
@@ -0,0 +1,70 @@
+#ifndef KNN_H
+#define KNN_H
+
+/*
+*	Distance kernels for K-nearest neighbors classification.
+*	Every kernel computes the squared euclidean distance from one query vector to a
+*	block of packed training rows. The widest instruction set supported by the running
+*	CPU is picked at runtime, with a portable scalar kernel as the fallback.
+*/
+
+#include "ocr.h"
+
+#define KNN_BLOCK_SIZE 256		// training rows whose distances are computed per kernel call
+#define KNN_MAX_K 32			// largest supported k (the command line rejects larger ones; the search clamps them)
+#define KNN_QUERY_TILE 64		// queries scored together per pass over the training set
+
+typedef struct {
+	double DistSquared;
+	char ClassLabel;
+	int Index;				// row of the neighbor in the packed training set
+} Neighbor;			// struct containing a neighbor's distance squared and class label
+
+/*
+*	Bounded max-heap holding the k nearest neighbors seen so far. The root is the
+*	farthest of them, so a candidate that is not closer than the root is rejected
+*	with a single comparison and a full scan is O(n) with no allocation.
+*/
+typedef struct {
+	int K;					// capacity
+	int Count;				// neighbors currently held
+	Neighbor Items[KNN_MAX_K];
+} NeighborHeap;
+
+void NeighborHeap_Init(NeighborHeap* heap, int k);
+
+// adds a candidate, evicting the farthest neighbor once the heap is full. use NeighborHeap_Offer
+void NeighborHeap_Insert(NeighborHeap* heap, double dist_squared, char class_label, int index);
+
+// inserts the candidate if it is closer than the farthest neighbor held (ties keep the earlier row)
+static inline void NeighborHeap_Offer(NeighborHeap* heap, double dist_squared, char class_label, int index) {
+	if (heap->Count == heap->K && dist_squared >= heap->Items[0].DistSquared) return;
+	NeighborHeap_Insert(heap, dist_squared, class_label, index);
+}
+
+// empties the heap into Items in order of increasing distance (then row) and returns the count
+int NeighborHeap_Sort(NeighborHeap* heap);
+
+// offers every row of train to heap (exact brute force search for a single query)
+void SearchNearest(const PackedDataSet* train, const Feature* query, NeighborHeap* heap);
+
+/*
+*	Brute force search for many queries at once (query_count rows of FEATURE_VECTOR_LENGTH
+*	features, each with its own initialized heap). The training set is walked one block of
+*	KNN_BLOCK_SIZE rows at a time and every query is scored against a block while it is
+*	still in cache, so the set is streamed from memory once per call instead of once per query.
+*/
+void SearchNearestBatch(const PackedDataSet* train, const Feature* queries, int query_count, NeighborHeap* heaps);
+
+// returns the most frequent class among the k nearest neighbors, sorted nearest first.
+// ties go to the class whose first neighbor is nearest
+char VoteNeighbors(const Neighbor* sorted, int k);
+
+DistanceKernel SelectDistanceKernel();
+
+// name of the kernel SelectDistanceKernel() returns, for diagnostics
+const char* DistanceKernelName(DistanceKernel kernel);
+
+void SquaredDistancesScalar(const Feature* query, const Feature* rows, int count, Feature* distances);
+
+#endif
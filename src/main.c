@@ -7,6 +7,11 @@
 #include "preprocess.h"
 #include "ocr.h"
 #include "system.h"
+#include "knn.h"
+#include "kdtree.h"
+#include "ann.h"
+#include "grayscale.h"
+#include "components.h"
 
 #define PI 3.1415927
 
@@ -41,12 +46,13 @@ unsigned char* ReadBMP(char* file_name, int* height, int* width) {
 	BMP* bmp;
 	bmp = BMP_ReadFile(file_name);
 
-	if (BMP_GetError() != BMP_OK) {
+	if (bmp == NULL) {		// BMP_GetError() is shared by all threads, so check the result itself
 		return NULL;
 	}
 	*width = BMP_GetWidth(bmp);
 	*height = BMP_GetHeight(bmp);
 	out_image = BMP_GetData(bmp);
+	BMP_Free(bmp);
 #else
 	out_image = usb_imread(file_name);
 	*width = InfoHeader.Width;
@@ -55,6 +61,36 @@ unsigned char* ReadBMP(char* file_name, int* height, int* width) {
 	return out_image;
 }
 
+/*
+*	Binarizes a page straight from its file. On the desktop the pixels are read in place from a
+*	memory mapping of the file instead of being copied to the heap first; bitmaps the mapping does
+*	not support (32 bpp, palettes, compression) and LCDK go through ReadBMP(). returns 0 if the page
+*	could not be read, or if its header does not fit the file
+*/
+int BinarizeFile(char* file_name, BinarizeMethod method, int packed, BinaryDocument* bd) {
+#if LCDK == 0
+	BMP* bmp = BMP_MapFile(file_name);
+	if (bmp == NULL) {
+		if (BMP_GetError() != BMP_FILE_NOT_SUPPORTED) return 0;
+	}
+	else if (BMP_GetDepth(bmp) == 24) {
+		int stride;
+		const unsigned char* pixels = BMP_GetMappedPixels(bmp, &stride);
+		*bd = BinarizePixels(pixels, stride, BMP_GetHeight(bmp), BMP_GetWidth(bmp), method, packed);
+		BMP_Free(bmp);
+		return 1;
+	}
+	else {
+		BMP_Free(bmp);
+	}
+#endif
+	int height, width;
+	unsigned char* image_rgb = ReadBMP(file_name, &height, &width);
+	if (image_rgb == NULL) return 0;
+	*bd = BinarizeWithMethod(image_rgb, height, width, method, packed);
+	return 1;
+}
+
 
 void OCRTest(int k, int write) {
 	unsigned char* image_rgb;
@@ -104,12 +140,15 @@ void OCRTest(int k, int write) {
 		}
 		fclose(fp3);
 
+		// the character boundaries are only drawn for this dump
+		unsigned char* mask = DrawGlyphBoundaries(&bd);
 		FILE* fp2;
 		fp2 = fopen("data/mask_output.txt", "w");
 		for (i = 0; i < height*width; i++) {
-			fprintf(fp2, "%d\n", (int)bd.boundaries[i]);
+			fprintf(fp2, "%d\n", (int)mask[i]);
 		}
 		fclose(fp2);
+		FreeMemory(mask);
 
 		//write output to file
 		FILE* fp;
@@ -130,6 +169,1491 @@ void OCRTest(int k, int write) {
 }
 
 
+/*****************************************************************************
+*	Runs the full OCR pipeline (binarize, deskew, segment, classify) on a single page
+*	and returns what was recognized (see OCRResult), or NULL if the page could not be read.
+*	training_set is only read, so one set can be shared by any number of threads.
+*	binarize selects the thresholding method and deskew the skew estimator. with
+*	virtual_deskew set the page is never rotated: the skew angle is kept on the
+*	document and applied while it is segmented. with stream set the page is read,
+*	binarized and segmented a strip of rows at a time and never held whole in
+*	memory; such a page is not deskewed, and is always segmented by its projection
+*	profiles. segment selects the segmentation method otherwise.
+*	The characters of the page are allocated from arena, which is reset before
+*	returning (with NULL they are allocated from the heap).
+*****************************************************************************/
+OCRResult* OCRPage(DataSet* training_set, char* file_name, int k, BinarizeMethod binarize, DeskewMethod deskew, int virtual_deskew, int stream,
+	SegmentMethod segment, Arena* arena) {
+	if (stream) {		// the glyphs of a streamed page have no boxes
+		BinarizeStream* page = BinarizeStream_Open(file_name, binarize);
+		if (page == NULL) return NULL;
+		DataSet* test_set = SegmentTextStream(training_set, page, NULL, 0, arena);
+		BinarizeStream_Close(page);
+		if (test_set == NULL) {
+			fprintf(stderr, "%s: read error before the end of the page\n", file_name);
+			if (arena) ArenaReset(arena);
+			return NULL;
+		}
+		OCRResult* output = ClassifyPage(training_set, test_set, NULL, k);
+		FreeDataSet(test_set);
+		if (arena) ArenaReset(arena);
+		return output;
+	}
+
+	BinaryDocument bd;
+	if (!BinarizeFile(file_name, binarize, 1, &bd)) return NULL;		// every later stage reads the page a packed row at a time
+	if (virtual_deskew) {
+		DeskewVirtual(&bd, deskew);
+	}
+	else {
+		DeskewWithMethod(&bd, deskew);
+	}
+
+	DataSet* test_set = SegmentTextWithMethod(training_set, &bd, NULL, 0, segment, arena);
+	OCRResult* output = ClassifyPage(training_set, test_set, &bd, k);
+
+	BinaryDocument_Free(&bd);
+	FreeDataSet(test_set);
+	if (arena) ArenaReset(arena);
+	return output;
+}
+
+
+/*****************************************************************************
+*	Batch mode
+*	Pages are handed out one at a time to a pool of worker threads. Results are
+*	printed in input order as soon as every page before them has finished.
+*****************************************************************************/
+typedef struct {
+	char** files;				// pages to process
+	int file_count;
+	int next_file;				// index of the next page to hand out
+	int next_output;			// index of the next page to print
+	OCRResult** results;		// what was recognized on each page (NULL if unreadable)
+	int* done;					// set to 1 once a page has been processed
+	int failures;				// number of pages that could not be read
+	DataSet* training_set;		// shared, read-only
+	int k;
+	BinarizeMethod binarize;
+	DeskewMethod deskew;
+	int virtual_deskew;
+	int stream;
+	SegmentMethod segment;
+	double review_confidence;	// pages of lower confidence are flagged for review (0 prints no confidence)
+	Mutex* lock;				// guards every member above that the workers modify
+} BatchJob;
+
+// prints every finished page at the front of the queue. must be called with job->lock held
+void FlushBatchResults(BatchJob* job) {
+	while (job->next_output < job->file_count && job->done[job->next_output]) {
+		int i = job->next_output;
+		printf("==> %s <==\n", job->files[i]);
+		if (job->results[i]) {
+			printf("%s\n", job->results[i]->Text);
+			if (job->review_confidence > 0) {
+				printf("confidence %.3f%s\n", job->results[i]->Confidence,
+					job->results[i]->Confidence < job->review_confidence ? ", review" : "");
+			}
+			FreeOCRResult(job->results[i]);
+			job->results[i] = NULL;
+		}
+		else {
+			printf("File not found\n");
+		}
+		job->next_output++;
+	}
+	fflush(stdout);
+}
+
+#define PAGE_ARENA_BLOCK (256 * 1024)		// enough for the characters of a dense page
+
+void BatchWorker(void* arg) {
+	BatchJob* job = *(BatchJob**)arg;
+	Arena* arena = ArenaCreate(PAGE_ARENA_BLOCK);		// reused by every page of this worker
+	for (;;) {
+		MutexLock(job->lock);
+		int i = job->next_file++;
+		MutexUnlock(job->lock);
+		if (i >= job->file_count) break;
+
+		OCRResult* output = OCRPage(job->training_set, job->files[i], job->k, job->binarize, job->deskew, job->virtual_deskew, job->stream, job->segment,
+			arena);
+
+		MutexLock(job->lock);
+		job->results[i] = output;
+		job->done[i] = 1;
+		if (!output) job->failures++;
+		FlushBatchResults(job);
+		MutexUnlock(job->lock);
+	}
+	ArenaFree(arena);
+}
+
+// runs every page in files through thread_count workers. returns the number of pages that failed,
+// or -1 if ann_probes is more than the lists of the index.
+// ann_probes > 0 classifies with the approximate index instead of exact search. review_confidence > 0 prints
+// the confidence of each page and flags those below it
+int OCRBatch(char** files, int file_count, int k, int thread_count, int ann_probes, BinarizeMethod binarize, DeskewMethod deskew, int virtual_deskew, int stream,
+	SegmentMethod segment, double review_confidence) {
+	int i;
+	BatchJob job;
+	job.files = files;
+	job.file_count = file_count;
+	job.next_file = 0;
+	job.next_output = 0;
+	job.results = MemAllocate(sizeof(OCRResult*) * file_count);
+	job.done = MemAllocate(sizeof(int) * file_count);
+	for (i = 0; i < file_count; i++) {
+		job.results[i] = NULL;
+		job.done[i] = 0;
+	}
+	job.failures = 0;
+	job.k = k;
+	job.binarize = binarize;
+	job.deskew = deskew;
+	job.virtual_deskew = virtual_deskew;
+	job.stream = stream;
+	job.segment = segment;
+	job.review_confidence = review_confidence;
+	job.lock = MutexCreate();
+
+	double start = GetTimeSeconds();
+	job.training_set = InitTrainingSet();		// loaded once and shared by every worker
+	if (ann_probes > 0) {
+		// the lists of the index depend on the size of the training set, which -a could not know
+		int list_count = ANNListCount(job.training_set->Packed->Size);
+		if (ann_probes > list_count) {
+			fprintf(stderr, "-a must be between 1 and %d, the number of lists of the index\n", list_count);
+			FreeDataSet(job.training_set);
+			MutexFree(job.lock);
+			FreeMemory(job.done);
+			FreeMemory(job.results);
+			return -1;
+		}
+		// search only reads the codes, so the rows are released once they are encoded
+		BuildANNIndex(job.training_set->Packed, ann_probes);
+		DropANNRows(job.training_set->Packed);
+	}
+
+	// pages run in parallel with each other, so each page only gets a thread of its own
+	// unless there are fewer pages than threads
+	int page_threads = thread_count > file_count ? thread_count / file_count : 1;
+	SetWorkerThreadCount(page_threads);
+	if (thread_count > file_count) thread_count = file_count;
+	if (thread_count < 1) thread_count = 1;
+	BatchJob** worker_args = MemAllocate(sizeof(BatchJob*) * thread_count);
+	for (i = 0; i < thread_count; i++) {
+		worker_args[i] = &job;
+	}
+	RunParallel(BatchWorker, worker_args, sizeof(BatchJob*), thread_count);
+
+	double elapsed = GetTimeSeconds() - start;
+	fprintf(stderr, "%d pages in %.3f s (%.2f pages/s) on %d threads\n",
+		file_count, elapsed, elapsed > 0 ? file_count / elapsed : 0.0, thread_count);
+
+	int failures = job.failures;
+	FreeMemory(worker_args);
+	FreeDataSet(job.training_set);
+	MutexFree(job.lock);
+	FreeMemory(job.done);
+	FreeMemory(job.results);
+	return failures;
+}
+
+/*****************************************************************************
+*	Sample pages
+*	The bundled pages the benchmarks and checks below run on.
+*****************************************************************************/
+#define SAMPLE_PAGE_COUNT 4
+
+char* SAMPLE_PAGES[SAMPLE_PAGE_COUNT] = { "data/arial.bmp", "data/roboto.bmp", "data/tahoma.bmp", "data/verdana.bmp" };
+
+// binarizes every sample page with Otsu's method (into packed rows if packed is set). returns 0,
+// with nothing left allocated, if a page could not be read
+int LoadSamplePages(BinaryDocument* pages, int packed) {
+	int p, q;
+	for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+		if (!BinarizeFile(SAMPLE_PAGES[p], BINARIZE_OTSU, packed, &pages[p])) {
+			printf("could not read %s\n", SAMPLE_PAGES[p]);
+			for (q = 0; q < p; q++) {
+				BinaryDocument_Free(&pages[q]);
+			}
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void FreeSamplePages(BinaryDocument* pages) {
+	int p;
+	for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+		BinaryDocument_Free(&pages[p]);
+	}
+}
+
+// copy of the byte image of page, sharing nothing with it
+BinaryDocument CopyDocumentImage(const BinaryDocument* page) {
+	BinaryDocument copy = *page;
+	copy.image = MemAllocate(sizeof(unsigned char) * page->height * page->width);
+	memcpy(copy.image, page->image, sizeof(unsigned char) * page->height * page->width);
+	copy.bits = NULL;
+	copy.words_per_row = 0;
+	copy.glyphs = NULL;
+	copy.glyph_count = 0;
+	return copy;
+}
+
+// segments (by its projection profiles) and classifies a page, as OCRPage does once it is deskewed
+OCRResult* RecognizeSamplePage(DataSet* training_set, BinaryDocument* page, int k) {
+	DataSet* test_set = SegmentText(training_set, page, NULL, 0);
+	OCRResult* result = ClassifyPage(training_set, test_set, page, k);
+	FreeDataSet(test_set);
+	FreeMemory(page->glyphs);
+	page->glyphs = NULL;
+	page->glyph_count = 0;
+	return result;
+}
+
+/*****************************************************************************
+*	KNN benchmark
+*	Replicates the training set to KNN_BENCH_SIZE samples and times the
+*	classification of KNN_BENCH_QUERIES characters against it.
+*****************************************************************************/
+#define KNN_BENCH_SIZE 100000
+#define KNN_BENCH_QUERIES 200
+
+static volatile double bench_sink;		// keeps the compiler from discarding benchmark results
+
+// distance scan over the DataPoint pointer array (two dependent loads per sample)
+double ScanDataPoints(DataSet* ds, double* query, double* distances) {
+	int i, j;
+	for (i = 0; i < ds->Size; i++) {
+		double* train_vector = ds->Data[i]->FeatureVector;
+		double dist_squared = 0;
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			dist_squared += pow(query[j] - train_vector[j], 2.0);
+		}
+		distances[i] = dist_squared;
+	}
+	return distances[ds->Size - 1];
+}
+
+// distance scan over the contiguous packed feature matrix with the given kernel
+double ScanPacked(PackedDataSet* packed, DistanceKernel kernel, double* query, Feature* distances) {
+	Feature packed_query[FEATURE_VECTOR_LENGTH];
+	int j;
+	for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+		packed_query[j] = (Feature)query[j];
+	}
+	kernel(packed_query, packed->Features, packed->Size, distances);
+	return distances[packed->Size - 1];
+}
+
+static unsigned int bench_seed = 1;
+
+// deterministic uniform noise in [-amplitude / 2, amplitude / 2)
+double BenchNoise(double amplitude) {
+	bench_seed = bench_seed * 1103515245u + 12345u;
+	return amplitude * ((double)((bench_seed >> 8) & 0xffff) / 65536.0 - 0.5);
+}
+
+// copies the labeled points of ts round robin until size points exist, allocating every sample
+// the way InitTrainingSet does. jitter adds noise to each copy, so replicas act like extra fonts
+DataSet* ReplicateTrainingSet(DataSet* ts, int size, double jitter) {
+	DataSet* big = EmptyDataSet();
+	int i, j;
+	for (i = 0; i < size; i++) {
+		DataPoint* source = ts->Data[i % ts->Size];
+		double* feature_vector = MemAllocate(sizeof(double) * FEATURE_VECTOR_LENGTH);
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			feature_vector[j] = source->FeatureVector[j] + (i >= ts->Size ? BenchNoise(jitter) : 0.0);
+		}
+		AddTrainingData(big, NewDataPoint(source->ClassLabel, feature_vector));
+	}
+	return big;
+}
+
+// loads the default training set with a DataPoint for every row. a set mapped from a
+// version 1 file only has its packed rows, so they are copied back out for the benchmarks
+DataSet* LoadBenchmarkSet() {
+	DataSet* ts = InitTrainingSet();
+	PackedDataSet* packed = ts->Packed;
+	if (ts->Size > 0 || packed->Size == 0) return ts;
+
+	DataSet* unpacked = EmptyDataSet();
+	int i, j;
+	for (i = 0; i < packed->Size; i++) {
+		double* feature_vector = MemAllocate(sizeof(double) * FEATURE_VECTOR_LENGTH);
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			feature_vector[j] = (double)packed->Features[i * FEATURE_VECTOR_LENGTH + j];
+		}
+		AddTrainingData(unpacked, NewDataPoint(packed->Labels[i], feature_vector));
+	}
+	FreeDataSet(ts);
+	PackDataSet(unpacked);
+	if (unpacked->Packed->Size >= KD_TREE_MIN_SIZE) {
+		BuildKDTree(unpacked->Packed);
+	}
+	return unpacked;
+}
+
+int KNNBenchmark(int k) {
+	DataSet* ts = LoadBenchmarkSet();
+	if (ts->Size == 0) {
+		printf("training set is empty\n");
+		FreeDataSet(ts);
+		return 1;
+	}
+
+	DataSet* big = ReplicateTrainingSet(ts, KNN_BENCH_SIZE, 0.0);
+	PackDataSet(big);
+	int i, j;
+
+	double* distances = MemAllocate(sizeof(double) * KNN_BENCH_SIZE);
+	double start, elapsed;
+	printf("KNN benchmark: %d training samples, %d queries, k = %d\n", KNN_BENCH_SIZE, KNN_BENCH_QUERIES, k);
+
+	start = GetTimeSeconds();
+	for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+		bench_sink += ScanDataPoints(big, ts->Data[i % ts->Size]->FeatureVector, distances);
+	}
+	elapsed = GetTimeSeconds() - start;
+	printf("  scan, DataPoint pointers:   %8.3f ms/query\n", 1000.0 * elapsed / KNN_BENCH_QUERIES);
+
+	Feature* packed_distances = MemAllocate(sizeof(Feature) * KNN_BENCH_SIZE);
+	DistanceKernel kernels[2];
+	kernels[0] = SquaredDistancesScalar;
+	kernels[1] = SelectDistanceKernel();
+	int kernel_count = kernels[1] == kernels[0] ? 1 : 2;
+	for (j = 0; j < kernel_count; j++) {
+		start = GetTimeSeconds();
+		for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+			bench_sink += ScanPacked(big->Packed, kernels[j], ts->Data[i % ts->Size]->FeatureVector, packed_distances);
+		}
+		elapsed = GetTimeSeconds() - start;
+		printf("  scan, packed %-7s %-7s %8.3f ms/query\n", FEATURE_SINGLE_PRECISION ? "float," : "double,",
+			DistanceKernelName(kernels[j]), 1000.0 * elapsed / KNN_BENCH_QUERIES);
+	}
+	FreeMemory(packed_distances);
+
+	start = GetTimeSeconds();
+	for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+		bench_sink += ClassifyDataPoint(big, ts->Data[i % ts->Size], k);
+	}
+	elapsed = GetTimeSeconds() - start;
+	printf("  ClassifyDataPoint:          %8.3f ms/query\n", 1000.0 * elapsed / KNN_BENCH_QUERIES);
+
+	// the same queries as one unclassified test set, scored in tiles by ClassifyTestSet
+	DataSet* test_set = EmptyDataSet();
+	for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+		double* feature_vector = MemAllocate(sizeof(double) * FEATURE_VECTOR_LENGTH);
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			feature_vector[j] = ts->Data[i % ts->Size]->FeatureVector[j];
+		}
+		AddTrainingData(test_set, NewDataPoint('\0', feature_vector));
+	}
+	start = GetTimeSeconds();
+	char* output = ClassifyTestSet(big, test_set, k);
+	elapsed = GetTimeSeconds() - start;
+	printf("  ClassifyTestSet (batched):  %8.3f ms/query\n", 1000.0 * elapsed / KNN_BENCH_QUERIES);
+	FreeMemory(output);
+	FreeDataSet(test_set);
+
+	FreeMemory(distances);
+	FreeDataSet(big);
+	FreeDataSet(ts);
+	return 0;
+}
+
+/*****************************************************************************
+*	KD-tree benchmark
+*	Compares exact KD-tree search with brute force as the training set grows.
+*	The replicated samples are jittered so the larger sets behave like sets
+*	trained on more fonts rather than exact copies.
+*****************************************************************************/
+#define INDEX_BENCH_JITTER 0.05
+
+int IndexBenchmark(int k) {
+	int sizes[] = { 1000, 10000, 100000, 1000000 };
+	DataSet* ts = LoadBenchmarkSet();
+	if (ts->Size == 0) {
+		printf("training set is empty\n");
+		FreeDataSet(ts);
+		return 1;
+	}
+
+	Feature queries[KNN_BENCH_QUERIES][FEATURE_VECTOR_LENGTH];
+	int i, j, s;
+	for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			queries[i][j] = (Feature)(ts->Data[i % ts->Size]->FeatureVector[j] + BenchNoise(INDEX_BENCH_JITTER));
+		}
+	}
+
+	printf("KD-tree benchmark: %d queries, k = %d, leaf size %d\n", KNN_BENCH_QUERIES, k, KD_TREE_LEAF_SIZE);
+	printf("  %8s %12s %12s %12s %10s\n", "samples", "brute ms/q", "kd-tree ms/q", "build ms", "mismatch");
+	for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+		DataSet* big = ReplicateTrainingSet(ts, sizes[s], INDEX_BENCH_JITTER);
+		PackedDataSet* packed = PackDataSet(big);
+		NeighborHeap heap;
+		char brute_labels[KNN_BENCH_QUERIES];
+		double start, brute_time, build_time, tree_time;
+		int mismatches = 0;
+
+		// brute force runs on the tree ordered rows too, so ties resolve identically
+		start = GetTimeSeconds();
+		BuildKDTree(packed);
+		build_time = GetTimeSeconds() - start;
+
+		start = GetTimeSeconds();
+		for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+			NeighborHeap_Init(&heap, k);
+			SearchNearest(packed, queries[i], &heap);
+			brute_labels[i] = VoteNeighbors(heap.Items, NeighborHeap_Sort(&heap));
+		}
+		brute_time = GetTimeSeconds() - start;
+
+		start = GetTimeSeconds();
+		for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+			NeighborHeap_Init(&heap, k);
+			SearchKDTree(packed, queries[i], &heap);
+			if (VoteNeighbors(heap.Items, NeighborHeap_Sort(&heap)) != brute_labels[i]) mismatches++;
+		}
+		tree_time = GetTimeSeconds() - start;
+
+		printf("  %8d %12.4f %12.4f %12.1f %10d\n", sizes[s], 1000.0 * brute_time / KNN_BENCH_QUERIES,
+			1000.0 * tree_time / KNN_BENCH_QUERIES, 1000.0 * build_time, mismatches);
+		FreeDataSet(big);
+	}
+
+	FreeDataSet(ts);
+	return 0;
+}
+
+/*****************************************************************************
+*	Approximate KNN report
+*	Measures how often the IVF-PQ index agrees with exact search, first on the
+*	characters of the bundled pages and then on large jittered training sets,
+*	for a range of probe counts (the recall/speed knob) ending with every list.
+*****************************************************************************/
+int ANNBenchmark(int k) {
+	int probe_counts[] = { 1, 2, 4, 8, 16, 32, 128 };
+	int probe_settings = sizeof(probe_counts) / sizeof(probe_counts[0]);
+	int sizes[] = { 100000, 1000000 };
+	BinaryDocument pages[SAMPLE_PAGE_COUNT];
+	OCRResult* exact[SAMPLE_PAGE_COUNT];
+	int i, j, p, s;
+
+	if (!LoadSamplePages(pages, 1)) return 1;
+	DataSet* ts = LoadBenchmarkSet();
+	if (ts->Size == 0) {
+		printf("training set is empty\n");
+		FreeSamplePages(pages);
+		FreeDataSet(ts);
+		return 1;
+	}
+
+	// character agreement on the bundled pages
+	for (i = 0; i < SAMPLE_PAGE_COUNT; i++) {
+		Deskew(&pages[i]);
+		exact[i] = RecognizeSamplePage(ts, &pages[i], k);
+	}
+	ANNIndex* index = BuildANNIndex(ts->Packed, ANN_DEFAULT_PROBES);
+	printf("IVF-PQ on the bundled pages: %d training samples, %d lists, %d bytes per code, k = %d\n",
+		ts->Packed->Size, index->ListCount, ANN_SUBQUANTIZERS, k);
+	printf("  %6s %18s\n", "probes", "chars matching");
+	for (p = 0; p <= probe_settings; p++) {
+		int matching = 0, total = 0;
+		if (p < probe_settings && probe_counts[p] >= index->ListCount) continue;
+		index->Probes = p < probe_settings ? probe_counts[p] : index->ListCount;
+		for (i = 0; i < SAMPLE_PAGE_COUNT; i++) {
+			OCRResult* approximate = RecognizeSamplePage(ts, &pages[i], k);
+			for (j = 0; j < exact[i]->GlyphCount; j++) {
+				total++;
+				if (approximate->Glyphs[j].Label == exact[i]->Glyphs[j].Label) matching++;
+			}
+			FreeOCRResult(approximate);
+		}
+		printf("  %6d %9d / %-6d (%.1f%%)\n", index->Probes, matching, total, 100.0 * matching / total);
+	}
+	for (i = 0; i < SAMPLE_PAGE_COUNT; i++) {
+		FreeOCRResult(exact[i]);
+	}
+	FreeSamplePages(pages);
+
+	// label agreement and speed on large sets, against the exact KD-tree search
+	Feature queries[KNN_BENCH_QUERIES][FEATURE_VECTOR_LENGTH];
+	for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			queries[i][j] = (Feature)(ts->Data[i % ts->Size]->FeatureVector[j] + BenchNoise(INDEX_BENCH_JITTER));
+		}
+	}
+	for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+		DataSet* big = ReplicateTrainingSet(ts, sizes[s], INDEX_BENCH_JITTER);
+		PackedDataSet* packed = PackDataSet(big);
+		NeighborHeap heap;
+		char exact_labels[KNN_BENCH_QUERIES];
+		double start, elapsed;
+
+		BuildKDTree(packed);
+		start = GetTimeSeconds();
+		for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+			NeighborHeap_Init(&heap, k);
+			SearchKDTree(packed, queries[i], &heap);
+			exact_labels[i] = VoteNeighbors(heap.Items, NeighborHeap_Sort(&heap));
+		}
+		double exact_time = GetTimeSeconds() - start;
+
+		start = GetTimeSeconds();
+		index = BuildANNIndex(packed, ANN_DEFAULT_PROBES);
+		double build_time = GetTimeSeconds() - start;
+		printf("IVF-PQ on %d jittered samples: %d lists, build %.1f s, %d vs %d bytes per sample, exact %.4f ms/query\n",
+			sizes[s], index->ListCount, build_time, ANN_SUBQUANTIZERS + 1, (int)(sizeof(Feature) * FEATURE_VECTOR_LENGTH + 1),
+			1000.0 * exact_time / KNN_BENCH_QUERIES);
+		printf("  %6s %12s %16s\n", "probes", "ms/query", "labels matching");
+		for (p = 0; p <= probe_settings; p++) {
+			int matching = 0;
+			if (p < probe_settings && probe_counts[p] >= index->ListCount) continue;
+			index->Probes = p < probe_settings ? probe_counts[p] : index->ListCount;
+			start = GetTimeSeconds();
+			for (i = 0; i < KNN_BENCH_QUERIES; i++) {
+				NeighborHeap_Init(&heap, k);
+				SearchANNIndex(index, queries[i], &heap);
+				if (VoteNeighbors(heap.Items, NeighborHeap_Sort(&heap)) == exact_labels[i]) matching++;
+			}
+			elapsed = GetTimeSeconds() - start;
+			printf("  %6d %12.4f %10.1f%%\n", index->Probes, 1000.0 * elapsed / KNN_BENCH_QUERIES, 100.0 * matching / KNN_BENCH_QUERIES);
+		}
+		FreeDataSet(big);
+	}
+
+	FreeDataSet(ts);
+	return 0;
+}
+
+/*****************************************************************************
+*	Skew estimation benchmark
+*	Rotates each bundled page by a set of known angles and compares the angle
+*	error and runtime of the original Hough sweep, the coarse-to-fine Hough
+*	estimator and the projection profile estimator. The bundled pages are taken
+*	to be straight, so the correction for a page rotated by a is -a.
+*****************************************************************************/
+#define SKEW_BENCH_METHODS 3
+
+int SkewBenchmark() {
+	double angles[] = { -9.3, -4.15, -1.7, -0.35, 0.2, 0.85, 2.6, 6.45, 13.1 };
+	char* method_names[SKEW_BENCH_METHODS] = { "hough", "coarse-to-fine", "projection" };
+	BinaryDocument pages[SAMPLE_PAGE_COUNT];
+	int angle_count = sizeof(angles) / sizeof(angles[0]);
+	double times[SKEW_BENCH_METHODS] = { 0 };
+	double errors[SKEW_BENCH_METHODS] = { 0 };
+	double max_errors[SKEW_BENCH_METHODS] = { 0 };
+	int p, a, m;
+
+	if (!LoadSamplePages(pages, 0)) return 1;
+	printf("skew benchmark: %d pages x %d angles (estimated correction and its error, degrees)\n", SAMPLE_PAGE_COUNT, angle_count);
+	printf("  %-16s %7s", "page", "angle");
+	for (m = 0; m < SKEW_BENCH_METHODS; m++) {
+		printf(" %15s %6s %5s", method_names[m], "error", "conf");
+	}
+	printf("\n");
+	for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+		for (a = 0; a < angle_count; a++) {
+			BinaryDocument rotated = CopyDocumentImage(&pages[p]);
+			Rotate(&rotated, angles[a]);
+
+			printf("  %-16s %7.2f", SAMPLE_PAGES[p], angles[a]);
+			for (m = 0; m < SKEW_BENCH_METHODS; m++) {
+				double start = GetTimeSeconds();
+				SkewEstimate estimate = m == 0 ? EstimateSkewHough(&rotated)
+					: m == 1 ? EstimateSkew(&rotated) : EstimateSkewProjection(&rotated);
+				times[m] += GetTimeSeconds() - start;
+
+				double error = fabs(estimate.AngleDeg + angles[a]);
+				errors[m] += error;
+				if (error > max_errors[m]) max_errors[m] = error;
+				printf(" %15.3f %6.3f %5.2f", estimate.AngleDeg, error, estimate.Confidence);
+			}
+			printf("\n");
+			BinaryDocument_Free(&rotated);
+		}
+	}
+
+	int runs = SAMPLE_PAGE_COUNT * angle_count;
+	for (m = 0; m < SKEW_BENCH_METHODS; m++) {
+		printf("  %-15s mean error %.3f deg, max %.3f deg, %.2f ms per page\n", method_names[m],
+			errors[m] / runs, max_errors[m], 1000.0 * times[m] / runs);
+	}
+	FreeSamplePages(pages);
+	return 0;
+}
+
+/*****************************************************************************
+*	Binarization benchmark
+*	Runs every grayscale kernel the CPU supports on all 2^24 colors, out of place
+*	and in place on rows of varying width, and checks that each one matches the
+*	scalar kernel. Then binarizes each bundled page a number of times with every
+*	method, into bytes and packed, checks that the packed document unpacks to the
+*	same image (and to the same image as on a single thread) and compares their
+*	runtime. Each method is also run on the pages
+*	darkened by a left to right lighting gradient, reporting the share of pixels
+*	that differ from the clean page binarized with Otsu's method.
+*	Returns the number of mismatches.
+*****************************************************************************/
+#define BINARIZE_BENCH_ITERATIONS 10
+#define BINARIZE_BENCH_METHODS 3
+#define GRAY_BENCH_ROW 65536		// every green and blue value, one row per red value
+#define GRAY_BENCH_MAX_KERNELS 4
+
+long GrayscaleKernelCheck() {
+	GrayscaleKernel kernels[GRAY_BENCH_MAX_KERNELS];
+	int kernel_count = GetGrayscaleKernels(kernels, GRAY_BENCH_MAX_KERNELS);
+	unsigned char* bgr = MemAllocate(sizeof(unsigned char) * GRAY_BENCH_ROW * 3);
+	unsigned char* in_place = MemAllocate(sizeof(unsigned char) * GRAY_BENCH_ROW * 3);
+	unsigned char* expected = MemAllocate(sizeof(unsigned char) * GRAY_BENCH_ROW);
+	unsigned char* gray = MemAllocate(sizeof(unsigned char) * GRAY_BENCH_ROW);
+	long mismatches = 0;
+	int j, r, i;
+
+	printf("grayscale kernels (default %s):\n", GrayscaleKernelName(SelectGrayscaleKernel()));
+	for (j = 0; j < kernel_count; j++) {
+		double elapsed = 0;
+		long differing = 0;
+		for (r = 0; r < 256; r++) {
+			for (i = 0; i < GRAY_BENCH_ROW; i++) {
+				bgr[i * 3] = (unsigned char)i;
+				bgr[i * 3 + 1] = (unsigned char)(i >> 8);
+				bgr[i * 3 + 2] = (unsigned char)r;
+			}
+			GrayscaleRowScalar(bgr, GRAY_BENCH_ROW, expected);
+
+			double start = GetTimeSeconds();
+			kernels[j](bgr, GRAY_BENCH_ROW, gray);
+			elapsed += GetTimeSeconds() - start;
+			for (i = 0; i < GRAY_BENCH_ROW; i++) {
+				differing += gray[i] != expected[i];
+			}
+
+			// in place, on a width that leaves a different tail for the scalar loop every row
+			int width = GRAY_BENCH_ROW - r % 67;
+			memcpy(in_place, bgr, sizeof(unsigned char) * width * 3);
+			kernels[j](in_place, width, in_place);
+			for (i = 0; i < width; i++) {
+				differing += in_place[i] != expected[i];
+			}
+		}
+		printf("  %-7s %6.2f ms per 2^24 pixels, %ld differing\n", GrayscaleKernelName(kernels[j]), 1000.0 * elapsed, differing);
+		mismatches += differing;
+	}
+	FreeMemory(bgr);
+	FreeMemory(in_place);
+	FreeMemory(expected);
+	FreeMemory(gray);
+	return mismatches;
+}
+
+// darkens the BGR image from BINARIZE_SHADE_MIN of its brightness at the left edge to all of it at the right
+#define BINARIZE_SHADE_MIN 0.25
+
+void ShadeImage(unsigned char* image_rgb, int height, int width) {
+	int stride = BmpRowStride(width);
+	int x, y, c;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			double light = BINARIZE_SHADE_MIN + (1 - BINARIZE_SHADE_MIN) * x / width;
+			for (c = 0; c < 3; c++) {
+				unsigned char* value = image_rgb + y * stride + x * 3 + c;
+				*value = (unsigned char)(*value * light);
+			}
+		}
+	}
+}
+
+// copy of the BGR rows of a height x width page as ReadBMP() returns them, for the calls that free their input
+unsigned char* CopyImageRGB(const unsigned char* image_rgb, int height, int width) {
+	unsigned char* copy = MemAllocate(sizeof(unsigned char) * BmpRowStride(width) * height);
+	memcpy(copy, image_rgb, sizeof(unsigned char) * BmpRowStride(width) * height);
+	return copy;
+}
+
+int BinarizeBenchmark() {
+	BinarizeMethod methods[BINARIZE_BENCH_METHODS] = { BINARIZE_OTSU, BINARIZE_SAUVOLA, BINARIZE_BRADLEY };
+	char* method_names[BINARIZE_BENCH_METHODS] = { "otsu", "sauvola", "bradley" };
+	BinaryDocument references[SAMPLE_PAGE_COUNT];		// the clean pages binarized with Otsu's method
+	long mismatches;
+	int m, p, r, i;
+
+	if (!LoadSamplePages(references, 0)) return 1;
+	mismatches = GrayscaleKernelCheck();
+	printf("binarize benchmark: %d pages x %d runs, %d threads\n", SAMPLE_PAGE_COUNT, BINARIZE_BENCH_ITERATIONS, GetWorkerThreadCount());
+	for (m = 0; m < BINARIZE_BENCH_METHODS; m++) {
+		double byte_time = 0, packed_time = 0;
+		long pixels = 0, clean_differing = 0, shaded_differing = 0;
+		for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+			BinaryDocument* reference = &references[p];
+			int height, width;
+			unsigned char* source = ReadBMP(SAMPLE_PAGES[p], &height, &width);
+			if (!source) {
+				printf("could not read %s\n", SAMPLE_PAGES[p]);
+				FreeSamplePages(references);
+				return 1;
+			}
+
+			for (r = 0; r < BINARIZE_BENCH_ITERATIONS; r++) {
+				// both calls free their input, so each is given a copy of the page (outside the timed part)
+				unsigned char* image_rgb = CopyImageRGB(source, height, width);
+				double start = GetTimeSeconds();
+				BinaryDocument page = BinarizeWithMethod(image_rgb, height, width, methods[m], 0);
+				byte_time += GetTimeSeconds() - start;
+
+				image_rgb = CopyImageRGB(source, height, width);
+				start = GetTimeSeconds();
+				BinaryDocument packed = BinarizeWithMethod(image_rgb, height, width, methods[m], 1);
+				packed_time += GetTimeSeconds() - start;
+
+				BinaryDocument_Unpack(&packed);
+				int differing = packed.background_color != page.background_color;
+				for (i = 0; i < height * width; i++) {
+					differing += page.image[i] != packed.image[i];
+				}
+				if (differing && r == 0) printf("  %s, %s: %d pixels differ packed\n", method_names[m], SAMPLE_PAGES[p], differing);
+				mismatches += differing;
+				if (r == 0) {
+					for (i = 0; i < height * width; i++) {
+						clean_differing += page.image[i] != reference->image[i];
+					}
+
+					// the row bands must join without a seam: a single band gives the same image
+					int thread_count = GetWorkerThreadCount();
+					SetWorkerThreadCount(1);
+					image_rgb = CopyImageRGB(source, height, width);
+					BinaryDocument single = BinarizeWithMethod(image_rgb, height, width, methods[m], 0);
+					SetWorkerThreadCount(thread_count);
+					differing = 0;
+					for (i = 0; i < height * width; i++) {
+						differing += page.image[i] != single.image[i];
+					}
+					if (differing) printf("  %s, %s: %d pixels differ on one thread\n", method_names[m], SAMPLE_PAGES[p], differing);
+					mismatches += differing;
+					BinaryDocument_Free(&single);
+				}
+				BinaryDocument_Free(&page);
+				BinaryDocument_Free(&packed);
+			}
+
+			ShadeImage(source, height, width);		// the last use of source, which it frees
+			BinaryDocument shaded = BinarizeWithMethod(source, height, width, methods[m], 0);
+			for (i = 0; i < height * width; i++) {
+				shaded_differing += shaded.image[i] != reference->image[i];
+			}
+			pixels += height * width;
+			BinaryDocument_Free(&shaded);
+		}
+
+		int runs = SAMPLE_PAGE_COUNT * BINARIZE_BENCH_ITERATIONS;
+		printf("  %-8s bytes %5.2f ms, packed %5.2f ms per page; differs from otsu on %5.2f%% of pixels, %5.2f%% when shaded\n",
+			method_names[m], 1000.0 * byte_time / runs, 1000.0 * packed_time / runs,
+			100.0 * clean_differing / pixels, 100.0 * shaded_differing / pixels);
+	}
+	printf("  %ld mismatches\n", mismatches);
+	FreeSamplePages(references);
+	return mismatches ? 1 : 0;
+}
+
+/*****************************************************************************
+*	Rotation benchmark
+*	Rotates each bundled page by small (shear path) and large (tiled path) angles
+*	with RotateReference() and with Rotate() on the byte image and on the packed
+*	bit plane, checks that the images are identical and compares their runtime.
+*	The grayscale page is also rotated by the bilinear RotateGrayscale(), which has
+*	to stay within GRAY_ROTATE_TOLERANCE of a double precision bilinear rotation
+*	and to return the page unchanged at angle 0, as the nearest pixel mode must too.
+*	Returns 1 if any check fails.
+*****************************************************************************/
+// gray levels RotateGrayscale() may be off by: its weights are cut to 8 bits (under a level per axis)
+// and its 16.16 positions drift along a row, which moves a black to white edge by up to a level
+#define GRAY_ROTATE_TOLERANCE 3
+
+// bilinear rotation with the mapping of RotateGrayscale(), computed in double precision throughout
+unsigned char* RotateGrayscaleBilinearReference(const unsigned char* image, int height, int width, double angle_deg, unsigned char background) {
+	double angle_rad = angle_deg * PI / 180.0;
+	double cos_val = cos(angle_rad);
+	double sin_val = sin(angle_rad);
+	int x_center = width / 2;
+	int y_center = height / 2;
+	unsigned char* output_image = MemAllocate(sizeof(unsigned char) * width * height);
+	int x, y;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			double og_x = x_center - (x_center - x) * cos_val - (y_center - y) * sin_val;
+			double og_y = y_center - (y_center - y) * cos_val + (x_center - x) * sin_val;
+			int x0 = (int)floor(og_x);
+			int y0 = (int)floor(og_y);
+			if (x0 < -1 || x0 > width - 1 || y0 < -1 || y0 > height - 1) {
+				output_image[x + y * width] = background;
+				continue;
+			}
+			double fx = og_x - x0;
+			double fy = og_y - y0;
+			double p00 = (x0 >= 0 && y0 >= 0) ? image[x0 + y0 * width] : background;
+			double p10 = (x0 + 1 < width && y0 >= 0) ? image[x0 + 1 + y0 * width] : background;
+			double p01 = (x0 >= 0 && y0 + 1 < height) ? image[x0 + (y0 + 1) * width] : background;
+			double p11 = (x0 + 1 < width && y0 + 1 < height) ? image[x0 + 1 + (y0 + 1) * width] : background;
+			double value = (p00 * (1 - fx) + p10 * fx) * (1 - fy) + (p01 * (1 - fx) + p11 * fx) * fy;
+			output_image[x + y * width] = (unsigned char)floor(value + 0.5);
+		}
+	}
+	return output_image;
+}
+
+int RotateBenchmark() {
+	double angles[] = { 0.15, -0.7, 1.3, -2.9, 4.99, 5.01, -7.5, 12.0, -25.0, 29.9, 90.0, -137.0 };
+	int angle_count = sizeof(angles) / sizeof(angles[0]);
+	BinaryDocument pages[SAMPLE_PAGE_COUNT];
+	double reference_time = 0, engine_time = 0, packed_time = 0;
+	long mismatches = 0;
+	int p, a, i;
+
+	if (!LoadSamplePages(pages, 0)) return 1;
+	printf("rotate benchmark: %d pages x %d angles, %d threads\n", SAMPLE_PAGE_COUNT, angle_count, GetWorkerThreadCount());
+	for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+		int pixels = pages[p].height * pages[p].width;
+
+		for (a = 0; a < angle_count; a++) {
+			BinaryDocument reference = CopyDocumentImage(&pages[p]);
+			BinaryDocument rotated = CopyDocumentImage(&pages[p]);
+
+			double start = GetTimeSeconds();
+			RotateReference(&reference, angles[a]);
+			reference_time += GetTimeSeconds() - start;
+			start = GetTimeSeconds();
+			Rotate(&rotated, angles[a]);
+			engine_time += GetTimeSeconds() - start;
+
+			// the packed image goes through the same engine a row at a time
+			BinaryDocument packed = CopyDocumentImage(&pages[p]);
+			BinaryDocument_Pack(&packed);
+			start = GetTimeSeconds();
+			Rotate(&packed, angles[a]);
+			packed_time += GetTimeSeconds() - start;
+			BinaryDocument_Unpack(&packed);
+
+			int differing = 0;
+			for (i = 0; i < pixels; i++) {
+				differing += reference.image[i] != rotated.image[i];
+				differing += reference.image[i] != packed.image[i];
+			}
+			if (differing) printf("  %s rotated by %.2f: %d pixels differ\n", SAMPLE_PAGES[p], angles[a], differing);
+			mismatches += differing;
+			BinaryDocument_Free(&reference);
+			BinaryDocument_Free(&rotated);
+			BinaryDocument_Free(&packed);
+		}
+	}
+
+	int runs = SAMPLE_PAGE_COUNT * angle_count;
+	printf("  reference: %.2f ms per rotation\n", 1000.0 * reference_time / runs);
+	printf("  engine:    %.2f ms per rotation\n", 1000.0 * engine_time / runs);
+	printf("  packed:    %.2f ms per rotation\n", 1000.0 * packed_time / runs);
+	printf("  %ld differing pixels\n", mismatches);
+	FreeSamplePages(pages);
+
+	double gray_reference_time = 0, bilinear_time = 0;
+	long gray_pixels = 0, gray_off = 0, gray_error = 0, unchanged_failures = 0;
+	int max_error = 0;
+	for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+		int height, width;
+		unsigned char* image_rgb = ReadBMP(SAMPLE_PAGES[p], &height, &width);
+		if (image_rgb == NULL) {
+			printf("could not read %s\n", SAMPLE_PAGES[p]);
+			return 1;
+		}
+		unsigned char* gray = ConvertImageToGrayscale(image_rgb, height, width);
+		int pixels = height * width;
+
+		int bilinear;
+		for (bilinear = 0; bilinear <= 1; bilinear++) {
+			unsigned char* same = RotateGrayscale(gray, height, width, 0.0, 255, bilinear);
+			if (memcmp(same, gray, pixels) != 0) {
+				printf("  %s: %s grayscale rotation by 0 changes the page\n", SAMPLE_PAGES[p], bilinear ? "bilinear" : "nearest");
+				unchanged_failures++;
+			}
+			FreeMemory(same);
+		}
+
+		for (a = 0; a < angle_count; a++) {
+			double start = GetTimeSeconds();
+			unsigned char* reference = RotateGrayscaleBilinearReference(gray, height, width, angles[a], 255);
+			gray_reference_time += GetTimeSeconds() - start;
+			start = GetTimeSeconds();
+			unsigned char* rotated = RotateGrayscale(gray, height, width, angles[a], 255, 1);
+			bilinear_time += GetTimeSeconds() - start;
+
+			for (i = 0; i < pixels; i++) {
+				int error = abs(rotated[i] - reference[i]);
+				if (error > max_error) max_error = error;
+				gray_off += error > 0;
+				gray_error += error > GRAY_ROTATE_TOLERANCE;
+			}
+			gray_pixels += pixels;
+			FreeMemory(reference);
+			FreeMemory(rotated);
+		}
+		FreeMemory(gray);
+	}
+	printf("  grayscale bilinear: %.2f ms per rotation, double reference %.2f ms\n",
+		1000.0 * bilinear_time / runs, 1000.0 * gray_reference_time / runs);
+	printf("  %.3f%% of pixels differ from the reference, by %d gray levels at most; %ld by more than %d\n",
+		100.0 * gray_off / gray_pixels, max_error, gray_error, GRAY_ROTATE_TOLERANCE);
+	printf("  %ld pages changed by a rotation of 0\n", unchanged_failures);
+	return (mismatches || gray_error || unchanged_failures) ? 1 : 0;
+}
+
+void PrintUsage(char* program) {
+	fprintf(stderr, "usage: %s [-k neighbors] [-j threads] [-a probes] [-b otsu|sauvola|bradley] [-d hough|projection] [-s profile|components] [--virtual-deskew] [--stream] [-c confidence] <page.bmp | directory> ...\n", program);
+	fprintf(stderr, "       %s --test-segment [-j threads]\n", program);
+	fprintf(stderr, "       %s --bench-knn [-k neighbors]\n", program);
+	fprintf(stderr, "       %s --bench-index [-k neighbors]\n", program);
+	fprintf(stderr, "       %s --bench-ann [-k neighbors]\n", program);
+	fprintf(stderr, "       %s --bench-binarize [-j threads]\n", program);
+	fprintf(stderr, "       %s --bench-skew\n", program);
+	fprintf(stderr, "       %s --bench-rotate [-j threads]\n", program);
+	fprintf(stderr, "       %s --bench-virtual-deskew\n", program);
+	fprintf(stderr, "       %s --bench-stream\n", program);
+	fprintf(stderr, "       %s --bench-read\n", program);
+	fprintf(stderr, "       %s --bench-arena [-k neighbors]\n", program);
+	fprintf(stderr, "       %s --bench-components [-k neighbors] [-j threads]\n", program);
+	fprintf(stderr, "       %s --convert-training-set <legacy.bin> <output.bin>\n", program);
+	fprintf(stderr, "-k sets the neighbors each character is classified from, 1 to %d (default 3)\n", KNN_MAX_K);
+	fprintf(stderr, "-a classifies with the approximate IVF-PQ index, visiting the given number of lists (1 to all of them)\n");
+	fprintf(stderr, "-b selects the thresholding method (default otsu); sauvola and bradley adapt to uneven lighting\n");
+	fprintf(stderr, "-d selects the skew estimator (default hough)\n");
+	fprintf(stderr, "-s selects the segmentation (default profile); components copes with crowded lines\n");
+	fprintf(stderr, "--virtual-deskew segments pages through the skew angle instead of rotating them\n");
+	fprintf(stderr, "--stream reads and segments pages a strip of rows at a time, without deskewing them\n");
+	fprintf(stderr, "-c prints the confidence of each page after its text, and flags pages below it for review\n");
+	fprintf(stderr, "with no arguments, asks for a single file name under data/ interactively\n");
+}
+
+
+/*****************************************************************************
+*	Segmentation stress test
+*	Segments every bundled page once on a single thread, then segments all of
+*	them again many times on thread_count threads at once and checks that every
+*	concurrent run produces byte-for-byte the same test set.
+*****************************************************************************/
+#define STRESS_ITERATIONS 8
+
+typedef struct {
+	unsigned char* bytes;
+	int length;
+} SegmentDump;
+
+// serializes the labels and feature vectors of a segmented page
+SegmentDump DumpDataSet(DataSet* ds) {
+	SegmentDump dump;
+	int record_size = 1 + sizeof(double) * FEATURE_VECTOR_LENGTH;
+	int i;
+	dump.bytes = MemAllocate(record_size * ds->Size + 1);
+	dump.length = 0;
+	for (i = 0; i < ds->Size; i++) {
+		dump.bytes[dump.length++] = (unsigned char)ds->Data[i]->ClassLabel;
+		if (ds->Data[i]->FeatureVector) {
+			memcpy(dump.bytes + dump.length, ds->Data[i]->FeatureVector, sizeof(double) * FEATURE_VECTOR_LENGTH);
+			dump.length += sizeof(double) * FEATURE_VECTOR_LENGTH;
+		}
+	}
+	return dump;
+}
+
+typedef struct {
+	BinaryDocument* pages;		// deskewed pages, shared read-only
+	SegmentDump* expected;		// single-threaded result of each page
+	int page_count;
+	DataSet* training_set;
+	int thread_index;
+	int mismatches;
+} StressArgs;
+
+void SegmentStressWorker(void* arg) {
+	StressArgs* args = (StressArgs*)arg;
+	int iteration, p;
+	for (iteration = 0; iteration < STRESS_ITERATIONS; iteration++) {
+		for (p = 0; p < args->page_count; p++) {
+			// stagger the page order so different threads segment different pages at the same time
+			int page = (p + args->thread_index + iteration) % args->page_count;
+			BinaryDocument bd = args->pages[page];		// private copy, SegmentText writes bd.glyphs
+			DataSet* test_set = SegmentText(args->training_set, &bd, NULL, 0);
+			SegmentDump dump = DumpDataSet(test_set);
+
+			SegmentDump* expected = &args->expected[page];
+			if (dump.length != expected->length || memcmp(dump.bytes, expected->bytes, dump.length) != 0) {
+				args->mismatches++;
+			}
+
+			FreeMemory(dump.bytes);
+			FreeMemory(bd.glyphs);
+			FreeDataSet(test_set);
+		}
+	}
+}
+
+// returns the number of concurrent segmentations that differed from the single-threaded result
+int SegmentStressTest(int thread_count) {
+	BinaryDocument pages[SAMPLE_PAGE_COUNT];
+	SegmentDump expected[SAMPLE_PAGE_COUNT];
+	int i;
+
+	if (!LoadSamplePages(pages, 0)) return -1;
+	DataSet* training_set = EmptyDataSet();
+	for (i = 0; i < SAMPLE_PAGE_COUNT; i++) {
+		Deskew(&pages[i]);
+
+		DataSet* test_set = SegmentText(training_set, &pages[i], NULL, 0);
+		expected[i] = DumpDataSet(test_set);
+		FreeMemory(pages[i].glyphs);
+		pages[i].glyphs = NULL;
+		pages[i].glyph_count = 0;
+		FreeDataSet(test_set);
+	}
+
+	if (thread_count < 2) thread_count = 2;
+	StressArgs* args = MemAllocate(sizeof(StressArgs) * thread_count);
+	for (i = 0; i < thread_count; i++) {
+		args[i].pages = pages;
+		args[i].expected = expected;
+		args[i].page_count = SAMPLE_PAGE_COUNT;
+		args[i].training_set = training_set;
+		args[i].thread_index = i;
+		args[i].mismatches = 0;
+	}
+	RunParallel(SegmentStressWorker, args, sizeof(StressArgs), thread_count);
+
+	int mismatches = 0;
+	for (i = 0; i < thread_count; i++) {
+		mismatches += args[i].mismatches;
+	}
+	printf("segment stress test: %d threads x %d pages x %d iterations, %d mismatches\n",
+		thread_count, SAMPLE_PAGE_COUNT, STRESS_ITERATIONS, mismatches);
+
+	FreeMemory(args);
+	for (i = 0; i < SAMPLE_PAGE_COUNT; i++) {
+		FreeMemory(expected[i].bytes);
+	}
+	FreeSamplePages(pages);
+	FreeDataSet(training_set);
+	return mismatches;
+}
+
+
+/*****************************************************************************
+*	Virtual deskew benchmark
+*	Rotates each bundled page by a set of angles, then deskews and segments it
+*	by rotating the image (DeskewWithMethod) or through the pending rotation
+*	(DeskewVirtual), each on the byte image and on the packed bit plane. Checks
+*	that every mode produces byte-for-byte the same test set as rotating the
+*	byte image and compares their runtime. Returns the number of differing runs.
+*****************************************************************************/
+#define DESKEW_BENCH_MODES 4
+
+int VirtualDeskewBenchmark() {
+	double angles[] = { -6.2, -2.4, -0.6, 0.0, 0.45, 1.8, 3.7 };
+	char* mode_names[DESKEW_BENCH_MODES] = { "rotate", "virtual", "packed rotate", "packed virtual" };
+	int angle_count = sizeof(angles) / sizeof(angles[0]);
+	BinaryDocument pages[SAMPLE_PAGE_COUNT];
+	double times[DESKEW_BENCH_MODES] = { 0 };
+	int mismatches = 0;
+	int p, a, m;
+
+	if (!LoadSamplePages(pages, 0)) return 1;
+	DataSet* training_set = EmptyDataSet();
+	printf("virtual deskew benchmark: %d pages x %d angles\n", SAMPLE_PAGE_COUNT, angle_count);
+	for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+		for (a = 0; a < angle_count; a++) {
+			BinaryDocument rotated = CopyDocumentImage(&pages[p]);
+			Rotate(&rotated, angles[a]);
+
+			SegmentDump expected;		// segmentation of the rotated byte image (mode 0)
+			expected.bytes = NULL;
+			expected.length = 0;
+			for (m = 0; m < DESKEW_BENCH_MODES; m++) {
+				BinaryDocument doc = CopyDocumentImage(&rotated);
+				if (m >= 2) BinaryDocument_Pack(&doc);
+
+				double start = GetTimeSeconds();
+				if (m % 2 == 0) {
+					DeskewWithMethod(&doc, DESKEW_HOUGH);
+				}
+				else {
+					DeskewVirtual(&doc, DESKEW_HOUGH);
+				}
+				DataSet* test_set = SegmentText(training_set, &doc, NULL, 0);
+				times[m] += GetTimeSeconds() - start;
+
+				SegmentDump dump = DumpDataSet(test_set);
+				if (m == 0) {
+					expected = dump;
+				}
+				else {
+					if (dump.length != expected.length || memcmp(dump.bytes, expected.bytes, dump.length) != 0) {
+						printf("  %s rotated by %.2f: %s segmentation differs\n", SAMPLE_PAGES[p], angles[a], mode_names[m]);
+						mismatches++;
+					}
+					FreeMemory(dump.bytes);
+				}
+				FreeDataSet(test_set);
+				BinaryDocument_Free(&doc);
+			}
+			FreeMemory(expected.bytes);
+			BinaryDocument_Free(&rotated);
+		}
+	}
+
+	int runs = SAMPLE_PAGE_COUNT * angle_count;
+	for (m = 0; m < DESKEW_BENCH_MODES; m++) {
+		printf("  %-15s %.2f ms per page (deskew + segment)\n", mode_names[m], 1000.0 * times[m] / runs);
+	}
+	printf("  %d mismatched runs\n", mismatches);
+	FreeSamplePages(pages);
+	FreeDataSet(training_set);
+	return mismatches ? 1 : 0;
+}
+
+
+/*****************************************************************************
+*	Streaming benchmark
+*	Segments every bundled page with each thresholding method, once from the
+*	whole binarized page and once from a stream, and checks that both give the
+*	same test set. neither run deskews, since a stream cannot.
+*****************************************************************************/
+int StreamBenchmark() {
+	BinarizeMethod methods[] = { BINARIZE_OTSU, BINARIZE_SAUVOLA, BINARIZE_BRADLEY };
+	char* method_names[] = { "otsu", "sauvola", "bradley" };
+	int method_count = sizeof(methods) / sizeof(methods[0]);
+	int mismatches = 0;
+	DataSet* training_set = EmptyDataSet();
+	int p, m;
+
+	printf("streaming benchmark: %d pages\n", SAMPLE_PAGE_COUNT);
+	for (m = 0; m < method_count; m++) {
+		double page_time = 0, stream_time = 0;
+		for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+			// whole page: read, binarize to packed rows, segment
+			double start = GetTimeSeconds();
+			int height, width;
+			unsigned char* image_rgb = ReadBMP(SAMPLE_PAGES[p], &height, &width);
+			if (!image_rgb) {
+				printf("could not read %s\n", SAMPLE_PAGES[p]);
+				FreeDataSet(training_set);
+				return 1;
+			}
+			BinaryDocument page = BinarizeWithMethod(image_rgb, height, width, methods[m], 1);
+			DataSet* expected_set = SegmentText(training_set, &page, NULL, 0);
+			page_time += GetTimeSeconds() - start;
+
+			start = GetTimeSeconds();
+			BinarizeStream* stream = BinarizeStream_Open(SAMPLE_PAGES[p], methods[m]);
+			DataSet* test_set = stream ? SegmentTextStream(training_set, stream, NULL, 0, NULL) : NULL;
+			if (stream) BinarizeStream_Close(stream);
+			stream_time += GetTimeSeconds() - start;
+			BinaryDocument_Free(&page);
+			if (!test_set) {
+				printf("could not read %s\n", SAMPLE_PAGES[p]);
+				FreeDataSet(expected_set);
+				FreeDataSet(training_set);
+				return 1;
+			}
+
+			SegmentDump expected = DumpDataSet(expected_set);
+			SegmentDump dump = DumpDataSet(test_set);
+			if (dump.length != expected.length || memcmp(dump.bytes, expected.bytes, dump.length) != 0) {
+				printf("  %s (%s): streamed segmentation differs\n", SAMPLE_PAGES[p], method_names[m]);
+				mismatches++;
+			}
+			FreeMemory(expected.bytes);
+			FreeMemory(dump.bytes);
+			FreeDataSet(expected_set);
+			FreeDataSet(test_set);
+		}
+		printf("  %-8s page %.2f ms, stream %.2f ms per page (read + binarize + segment)\n", method_names[m],
+			1000.0 * page_time / SAMPLE_PAGE_COUNT, 1000.0 * stream_time / SAMPLE_PAGE_COUNT);
+	}
+	printf("  %d mismatched pages\n", mismatches);
+	FreeDataSet(training_set);
+	return mismatches ? 1 : 0;
+}
+
+
+/*****************************************************************************
+*	Page reading benchmark
+*	Binarizes every bundled page with each method both from a heap copy of the
+*	file (ReadBMP) and in place from a mapping of it (BinarizeFile), and checks
+*	that both give the same bit plane.
+*****************************************************************************/
+#define READ_BENCH_RUNS 20
+
+int ReadBenchmark() {
+	BinarizeMethod methods[] = { BINARIZE_OTSU, BINARIZE_SAUVOLA, BINARIZE_BRADLEY };
+	char* method_names[] = { "otsu", "sauvola", "bradley" };
+	int method_count = sizeof(methods) / sizeof(methods[0]);
+	int mismatches = 0;
+	int p, m, r;
+
+	printf("page reading benchmark: %d pages x %d runs\n", SAMPLE_PAGE_COUNT, READ_BENCH_RUNS);
+	for (m = 0; m < method_count; m++) {
+		double copy_time = 0, mapped_time = 0;
+		for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+			for (r = 0; r < READ_BENCH_RUNS; r++) {
+				double start = GetTimeSeconds();
+				int height, width;
+				unsigned char* image_rgb = ReadBMP(SAMPLE_PAGES[p], &height, &width);
+				if (!image_rgb) {
+					printf("could not read %s\n", SAMPLE_PAGES[p]);
+					return 1;
+				}
+				BinaryDocument copied = BinarizeWithMethod(image_rgb, height, width, methods[m], 1);
+				copy_time += GetTimeSeconds() - start;
+
+				start = GetTimeSeconds();
+				BinaryDocument mapped;
+				if (!BinarizeFile(SAMPLE_PAGES[p], methods[m], 1, &mapped)) {
+					printf("could not map %s\n", SAMPLE_PAGES[p]);
+					BinaryDocument_Free(&copied);
+					return 1;
+				}
+				mapped_time += GetTimeSeconds() - start;
+
+				if (r == 0 && (mapped.height != copied.height || mapped.width != copied.width || mapped.background_color != copied.background_color
+					|| memcmp(mapped.bits, copied.bits, sizeof(unsigned long long) * copied.words_per_row * copied.height) != 0)) {
+					printf("  %s (%s): mapped page differs\n", SAMPLE_PAGES[p], method_names[m]);
+					mismatches++;
+				}
+				BinaryDocument_Free(&copied);
+				BinaryDocument_Free(&mapped);
+			}
+		}
+		int runs = SAMPLE_PAGE_COUNT * READ_BENCH_RUNS;
+		printf("  %-8s copy %.2f ms, mapped %.2f ms per page (read + binarize)\n", method_names[m],
+			1000.0 * copy_time / runs, 1000.0 * mapped_time / runs);
+	}
+	printf("  %d mismatched pages\n", mismatches);
+	return mismatches ? 1 : 0;
+}
+
+
+/*****************************************************************************
+*	Page arena benchmark
+*	Segments and classifies every bundled page with each segmentation, its
+*	characters allocated one by one from the heap and then from an arena that
+*	is reset after each page, and checks that both give the same text.
+*****************************************************************************/
+#define ARENA_BENCH_RUNS 50
+
+int ArenaBenchmark(int k) {
+	SegmentMethod methods[] = { SEGMENT_PROFILE, SEGMENT_COMPONENTS };
+	char* method_names[] = { "profile", "components" };
+	int method_count = sizeof(methods) / sizeof(methods[0]);
+	BinaryDocument pages[SAMPLE_PAGE_COUNT];
+	int mismatches = 0;
+	int p, m, r;
+
+	if (!LoadSamplePages(pages, 1)) return 1;
+	for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+		Deskew(&pages[p]);
+	}
+	DataSet* training_set = InitTrainingSet();
+	Arena* arena = ArenaCreate(PAGE_ARENA_BLOCK);
+
+	printf("page arena benchmark: %d pages x %d runs, k = %d\n", SAMPLE_PAGE_COUNT, ARENA_BENCH_RUNS, k);
+	for (m = 0; m < method_count; m++) {
+		double heap_time = 0, arena_time = 0;
+		for (r = 0; r < ARENA_BENCH_RUNS; r++) {
+			for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+				double start = GetTimeSeconds();
+				DataSet* test_set = SegmentTextWithMethod(training_set, &pages[p], NULL, 0, methods[m], NULL);
+				OCRResult* heap_result = ClassifyPage(training_set, test_set, &pages[p], k);
+				FreeDataSet(test_set);
+				heap_time += GetTimeSeconds() - start;
+
+				start = GetTimeSeconds();
+				test_set = SegmentTextWithMethod(training_set, &pages[p], NULL, 0, methods[m], arena);
+				OCRResult* arena_result = ClassifyPage(training_set, test_set, &pages[p], k);
+				FreeDataSet(test_set);
+				ArenaReset(arena);
+				arena_time += GetTimeSeconds() - start;
+
+				if (r == 0 && strcmp(heap_result->Text, arena_result->Text) != 0) {
+					printf("  %s (%s): text differs\n", SAMPLE_PAGES[p], method_names[m]);
+					mismatches++;
+				}
+				FreeOCRResult(heap_result);
+				FreeOCRResult(arena_result);
+			}
+		}
+		int runs = SAMPLE_PAGE_COUNT * ARENA_BENCH_RUNS;
+		printf("  %-10s heap %.3f ms, arena %.3f ms per page (segment + classify)\n", method_names[m],
+			1000.0 * heap_time / runs, 1000.0 * arena_time / runs);
+	}
+	printf("  arena holds %u bytes, %d mismatched pages\n", (unsigned int)ArenaCapacity(arena), mismatches);
+
+	FreeSamplePages(pages);
+	ArenaFree(arena);
+	FreeDataSet(training_set);
+	return mismatches ? 1 : 0;
+}
+
+
+/*****************************************************************************
+*	Segmentation method benchmark
+*	Every bundled page holds the digits and the alphabet, in order. Each page is
+*	segmented and classified with both methods as it is, crowded (every blank row
+*	removed, so that consecutive lines touch) and slanted like italics, and the
+*	recognized characters (spaces and newlines aside) are counted and scored by
+*	their edit distance from that text. The classifier only knows upright
+*	characters, so on slanted pages the count of characters is what shows the
+*	segmentation. The labeling is also checked to come out the same
+*	on one thread as on thread_count row bands.
+*****************************************************************************/
+#define ITALIC_SHEAR 0.25			// columns each pixel is moved right per row above the bottom of the page
+
+static const char* BENCH_PAGE_TEXT = "1234567890ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+// edit distance between text (whitespace skipped) and expected
+int TextEditDistance(const char* text, const char* expected) {
+	int expected_length = strlen(expected);
+	int* previous = MemAllocate(sizeof(int) * (expected_length + 1));
+	int* current = MemAllocate(sizeof(int) * (expected_length + 1));
+	int i, j;
+	for (j = 0; j <= expected_length; j++) {
+		previous[j] = j;
+	}
+	for (i = 0; text[i]; i++) {
+		if (text[i] == ' ' || text[i] == '\n') continue;
+		current[0] = previous[0] + 1;
+		for (j = 1; j <= expected_length; j++) {
+			int best = previous[j - 1] + (text[i] != expected[j - 1]);
+			if (previous[j] + 1 < best) best = previous[j] + 1;
+			if (current[j - 1] + 1 < best) best = current[j - 1] + 1;
+			current[j] = best;
+		}
+		int* swap = previous;
+		previous = current;
+		current = swap;
+	}
+	int distance = previous[expected_length];
+	FreeMemory(previous);
+	FreeMemory(current);
+	return distance;
+}
+
+// the page slanted right by ITALIC_SHEAR, widened to keep every pixel
+BinaryDocument ShearDocument(const BinaryDocument* page) {
+	BinaryDocument sheared = *page;
+	int shift = (int)(ITALIC_SHEAR * page->height + 1);
+	sheared.width = page->width + shift;
+	sheared.image = MemAllocate(sizeof(unsigned char) * sheared.width * sheared.height);
+	sheared.bits = NULL;
+	sheared.words_per_row = 0;
+	sheared.glyphs = NULL;
+	sheared.glyph_count = 0;
+	int x, y;
+	for (y = 0; y < page->height; y++) {
+		int offset = (int)(ITALIC_SHEAR * (page->height - 1 - y));
+		unsigned char* row = sheared.image + y * sheared.width;
+		for (x = 0; x < sheared.width; x++) {
+			row[x] = page->background_color;
+		}
+		memcpy(row + offset, page->image + y * page->width, page->width);
+	}
+	return sheared;
+}
+
+// the page without the rows that hold no foreground pixel
+BinaryDocument CrowdDocument(const BinaryDocument* page) {
+	BinaryDocument crowded = *page;
+	crowded.image = MemAllocate(sizeof(unsigned char) * page->width * (page->height > 0 ? page->height : 1));
+	crowded.bits = NULL;
+	crowded.words_per_row = 0;
+	crowded.glyphs = NULL;
+	crowded.glyph_count = 0;
+	crowded.height = 0;
+	int x, y;
+	for (y = 0; y < page->height; y++) {
+		const unsigned char* row = page->image + y * page->width;
+		for (x = 0; x < page->width && row[x] == page->background_color; x++);
+		if (x < page->width) {
+			memcpy(crowded.image + crowded.height * page->width, row, page->width);
+			crowded.height++;
+		}
+	}
+	return crowded;
+}
+
+int ComponentBenchmark(int k, int thread_count) {
+	char* method_names[] = { "profile", "components" };
+	char* style_names[] = { "upright", "crowded", "italic" };
+	BinaryDocument pages[SAMPLE_PAGE_COUNT];
+	int mismatches = 0;
+	int p, s, m;
+
+	if (!LoadSamplePages(pages, 0)) return 1;
+	DataSet* training_set = InitTrainingSet();
+	printf("segmentation benchmark: %d pages, k = %d, edit distance from the page text (%d characters)\n",
+		SAMPLE_PAGE_COUNT, k, (int)strlen(BENCH_PAGE_TEXT));
+	for (s = 0; s < 3; s++) {
+		int distances[2] = { 0, 0 };
+		int characters[2] = { 0, 0 };
+		double times[2] = { 0, 0 };
+		for (p = 0; p < SAMPLE_PAGE_COUNT; p++) {
+			BinaryDocument doc = s == 0 ? CopyDocumentImage(&pages[p]) : s == 1 ? CrowdDocument(&pages[p]) : ShearDocument(&pages[p]);
+			BinaryDocument_Pack(&doc);
+
+			// the labeling may not depend on the row bands
+			SetWorkerThreadCount(1);
+			ComponentLabeling single = LabelComponents(&doc);
+			SetWorkerThreadCount(thread_count > 1 ? thread_count : 8);
+			ComponentLabeling banded = LabelComponents(&doc);
+			if (single.component_count != banded.component_count || single.run_count != banded.run_count
+				|| memcmp(single.components, banded.components, sizeof(Component) * single.component_count) != 0
+				|| memcmp(single.runs, banded.runs, sizeof(ComponentRun) * single.run_count) != 0) {
+				printf("  %s (%s): labeling differs between 1 and %d bands\n", SAMPLE_PAGES[p], style_names[s], GetWorkerThreadCount());
+				mismatches++;
+			}
+			ComponentLabeling_Free(&single);
+			ComponentLabeling_Free(&banded);
+			SetWorkerThreadCount(thread_count);
+
+			for (m = 0; m < 2; m++) {
+				double start = GetTimeSeconds();
+				DataSet* test_set = SegmentTextWithMethod(training_set, &doc, NULL, 0, m ? SEGMENT_COMPONENTS : SEGMENT_PROFILE, NULL);
+				times[m] += GetTimeSeconds() - start;
+				char* text = ClassifyTestSet(training_set, test_set, k);
+				distances[m] += TextEditDistance(text, BENCH_PAGE_TEXT);
+				int c;
+				for (c = 0; text[c]; c++) {
+					characters[m] += text[c] != ' ' && text[c] != '\n';
+				}
+				FreeMemory(text);
+				FreeDataSet(test_set);
+				FreeMemory(doc.glyphs);
+				doc.glyphs = NULL;
+				doc.glyph_count = 0;
+			}
+			BinaryDocument_Free(&doc);
+		}
+		for (m = 0; m < 2; m++) {
+			printf("  %-8s %-11s %3d of %d characters, edit distance %3d, %.2f ms per page (segment)\n", style_names[s], method_names[m],
+				characters[m], SAMPLE_PAGE_COUNT * (int)strlen(BENCH_PAGE_TEXT), distances[m], 1000.0 * times[m] / SAMPLE_PAGE_COUNT);
+		}
+	}
+	printf("  %d labeling mismatches\n", mismatches);
+	FreeSamplePages(pages);
+	FreeDataSet(training_set);
+	return mismatches ? 1 : 0;
+}
+
+
 void TrainFromFile(DataSet* ts, char* input_file) {
 	//convert to binary image
 	int height, width;
@@ -156,10 +1680,11 @@ void TrainFromFile(DataSet* ts, char* input_file) {
 	//fclose(fp);
 	//printf("Finished writing processed image.\n");
 
+	//unsigned char* mask = DrawGlyphBoundaries(&binary_doc);
 	//FILE* fp2;
 	//fp2 = fopen("data/mask_output.txt", "w");
 	//for (i = 0; i < height*width; i++) {
-	//	fprintf(fp2, "%d\n", (int)binary_doc.boundaries[i]);
+	//	fprintf(fp2, "%d\n", (int)mask[i]);
 	//}
 	//fclose(fp2);
 
@@ -181,6 +1706,14 @@ void TrainingTest() {
 	FreeDataSet(ts);
 }
 
+// files with room for new_count paths, keeping the first count (LCDK has no support for realloc)
+char** GrowFileList(char** files, int count, int new_count) {
+	char** grown = MemAllocate(sizeof(char*) * (new_count > 0 ? new_count : 1));
+	if (count > 0) memcpy(grown, files, sizeof(char*) * count);
+	if (files) FreeMemory(files);
+	return grown;
+}
+
 
 //*****************************************************************************
 //
@@ -188,13 +1721,199 @@ void TrainingTest() {
 //
 //*****************************************************************************
 int
-main(void)
+main(int argc, char** argv)
 {
 #if LCDK == 1
 	msc_inti();
 	mem_init();
 #endif
 
-	//TrainingTest();
-	OCRTest(3, 1);
+	if (argc <= 1) {
+		//TrainingTest();
+		OCRTest(3, 1);
+		return 0;
+	}
+
+	// batch mode: every argument that is not an option is a BMP file or a directory of them
+	int k = 3;
+	int thread_count = GetProcessorCount();
+	int test_segment = 0;
+	int bench_knn = 0;
+	int bench_index = 0;
+	int bench_ann = 0;
+	int bench_rotate = 0;
+	int bench_binarize = 0;
+	int ann_probes = 0;
+	BinarizeMethod binarize = BINARIZE_OTSU;
+	DeskewMethod deskew = DESKEW_HOUGH;
+	int virtual_deskew = 0;
+	int stream = 0;
+	int bench_components = 0;
+	int bench_arena = 0;
+	SegmentMethod segment = SEGMENT_PROFILE;
+	double review_confidence = 0;
+	char** files = NULL;
+	int file_count = 0;
+	int i, j;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--test-segment") == 0) {
+			test_segment = 1;
+		}
+		else if (strcmp(argv[i], "--bench-knn") == 0) {
+			bench_knn = 1;
+		}
+		else if (strcmp(argv[i], "--bench-index") == 0) {
+			bench_index = 1;
+		}
+		else if (strcmp(argv[i], "--bench-ann") == 0) {
+			bench_ann = 1;
+		}
+		else if (strcmp(argv[i], "--bench-binarize") == 0) {
+			bench_binarize = 1;
+		}
+		else if (strcmp(argv[i], "--bench-skew") == 0) {
+			return SkewBenchmark();
+		}
+		else if (strcmp(argv[i], "--bench-virtual-deskew") == 0) {
+			return VirtualDeskewBenchmark();
+		}
+		else if (strcmp(argv[i], "--bench-stream") == 0) {
+			return StreamBenchmark();
+		}
+		else if (strcmp(argv[i], "--bench-components") == 0) {
+			bench_components = 1;
+		}
+		else if (strcmp(argv[i], "--bench-read") == 0) {
+			return ReadBenchmark();
+		}
+		else if (strcmp(argv[i], "--bench-arena") == 0) {
+			bench_arena = 1;
+		}
+		else if (strcmp(argv[i], "--bench-rotate") == 0) {
+			bench_rotate = 1;
+		}
+		else if (strcmp(argv[i], "--convert-training-set") == 0 && i + 2 < argc) {
+			if (!ConvertTrainingSet(argv[i + 1], argv[i + 2])) {
+				fprintf(stderr, "could not convert %s to %s\n", argv[i + 1], argv[i + 2]);
+				return 1;
+			}
+			return 0;
+		}
+		else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+			ann_probes = atoi(argv[++i]);
+			if (ann_probes < 1 || ann_probes > ANN_MAX_LISTS) {		// checked against the lists once the set is loaded
+				fprintf(stderr, "-a must be between 1 and %d\n", ANN_MAX_LISTS);
+				return 2;
+			}
+		}
+		else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc && strcmp(argv[i + 1], "otsu") == 0) {
+			binarize = BINARIZE_OTSU;
+			i++;
+		}
+		else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc && strcmp(argv[i + 1], "sauvola") == 0) {
+			binarize = BINARIZE_SAUVOLA;
+			i++;
+		}
+		else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc && strcmp(argv[i + 1], "bradley") == 0) {
+			binarize = BINARIZE_BRADLEY;
+			i++;
+		}
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc && strcmp(argv[i + 1], "hough") == 0) {
+			deskew = DESKEW_HOUGH;
+			i++;
+		}
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc && strcmp(argv[i + 1], "projection") == 0) {
+			deskew = DESKEW_PROJECTION;
+			i++;
+		}
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc && strcmp(argv[i + 1], "profile") == 0) {
+			segment = SEGMENT_PROFILE;
+			i++;
+		}
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc && strcmp(argv[i + 1], "components") == 0) {
+			segment = SEGMENT_COMPONENTS;
+			i++;
+		}
+		else if (strcmp(argv[i], "--virtual-deskew") == 0) {
+			virtual_deskew = 1;
+		}
+		else if (strcmp(argv[i], "--stream") == 0) {
+			stream = 1;
+		}
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			review_confidence = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+			k = atoi(argv[++i]);
+			if (k < 1 || k > KNN_MAX_K) {
+				fprintf(stderr, "-k must be between 1 and %d\n", KNN_MAX_K);
+				return 2;
+			}
+		}
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			thread_count = atoi(argv[++i]);
+		}
+		else if (argv[i][0] == '-') {
+			PrintUsage(argv[0]);
+			return 2;
+		}
+		else if (IsDirectory(argv[i])) {
+			int dir_count;
+			char** dir_files = ListDirectory(argv[i], ".bmp", &dir_count);
+			files = GrowFileList(files, file_count, file_count + dir_count);
+			for (j = 0; j < dir_count; j++) {
+				files[file_count++] = dir_files[j];
+			}
+			if (dir_files) FreeMemory(dir_files);
+		}
+		else {
+			files = GrowFileList(files, file_count, file_count + 1);
+			files[file_count] = MemAllocate(strlen(argv[i]) + 1);
+			strcpy(files[file_count++], argv[i]);
+		}
+	}
+
+	if (test_segment) {
+		return SegmentStressTest(thread_count < 8 ? 8 : thread_count) ? 1 : 0;
+	}
+
+	if (bench_knn) {
+		return KNNBenchmark(k);
+	}
+
+	if (bench_index) {
+		return IndexBenchmark(k);
+	}
+
+	if (bench_ann) {
+		return ANNBenchmark(k);
+	}
+
+	if (bench_binarize) {
+		SetWorkerThreadCount(thread_count);
+		return BinarizeBenchmark();
+	}
+
+	if (bench_components) {
+		return ComponentBenchmark(k, thread_count);
+	}
+
+	if (bench_arena) {
+		return ArenaBenchmark(k);
+	}
+
+	if (bench_rotate) {
+		SetWorkerThreadCount(thread_count);
+		return RotateBenchmark();
+	}
+
+	if (file_count == 0) {
+		PrintUsage(argv[0]);
+		return 2;
+	}
+
+	int failures = OCRBatch(files, file_count, k, thread_count, ann_probes, binarize, deskew, virtual_deskew, stream, segment, review_confidence);
+	FreeFileList(files, file_count);
+	if (failures < 0) return 2;
+	return failures ? 1 : 0;
 }
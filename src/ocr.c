@@ -3,11 +3,16 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "preprocess.h"
 #include "segment.h"
 #include "system.h"
+#include "knn.h"
+#include "kdtree.h"
+#include "ann.h"
 
-static const int RESIZED_CHAR_DIM = 40;		// dimension of resized character image for feature extraction
+#define RESIZED_CHAR_DIM 40			// dimension of resized character image for feature extraction
+#define RESIZED_CHAR_SIZE (RESIZED_CHAR_DIM * RESIZED_CHAR_DIM)
 static const int CHAR_ZONE_COUNT = 16;
 static const char* TRAINING_SET_FILE =
 #if LCDK == 0
@@ -24,7 +29,13 @@ static const char* TRAINING_SET_FILE =
 void ReallocateDataSet(DataSet* ts) {
 	int size = ts->Size;
 	int allocated = ts->Allocated;
-	if (ts->Allocated == 0) {
+	if (ts->PointArena) {		// the old block stays in the arena until it is reset
+		DataPoint** new_block = ArenaAllocate(ts->PointArena, sizeof(DataPoint*) * (ts->Allocated + TRAINING_SET_ALLOCATE_BLOCK));
+		if (ts->Size > 0) memcpy(new_block, ts->Data, sizeof(DataPoint*) * ts->Size);
+		ts->Data = new_block;
+		ts->Allocated += TRAINING_SET_ALLOCATE_BLOCK;
+	}
+	else if (ts->Allocated == 0) {
 		ts->Allocated += TRAINING_SET_ALLOCATE_BLOCK;
 		ts->Data = MemAllocate(sizeof(DataPoint*) * TRAINING_SET_ALLOCATE_BLOCK);
 	}
@@ -48,27 +59,132 @@ void ReallocateDataSet(DataSet* ts) {
 }
 
 DataSet* InitTrainingSet() {
-	DataSet* ts = MemAllocate(sizeof(DataSet));
-	ts->Allocated = 0;
-	ts->Size = 0;
+	return LoadTrainingSet(TRAINING_SET_FILE);
+}
 
-	FILE* fp;
-	fp = fopen(TRAINING_SET_FILE, "rb");
-	if (fp) {			// parse file if it exists
-		while (!feof(fp)) {		// parse until end of file
-			// parse the file and obtain the feature vectors and class labels for each data point
-			// everything is stored contiguously and bytewise (no buffers, newlines, etc)
-			double* feature_vector = MemAllocate(sizeof(double) * FEATURE_VECTOR_LENGTH);
-			fread(feature_vector, sizeof(double), FEATURE_VECTOR_LENGTH, fp);
-			char class_label = (char)fgetc(fp);
-			
-			DataPoint* dp = NewDataPoint(class_label, feature_vector);
+// returns the header of a version 1 training set file, or NULL if the sections it describes do not fit in the file
+static const TrainingSetHeader* CheckTrainingSetHeader(const MappedFile* file) {
+	const TrainingSetHeader* header = (const TrainingSetHeader*)file->Data;
+	size_t feature_bytes = (size_t)header->Count * header->FeatureLength * header->FeatureSize;
+
+	if (header->Version != TRAINING_SET_VERSION || header->FeatureLength != FEATURE_VECTOR_LENGTH) return NULL;
+	if (header->FeatureSize != sizeof(float) && header->FeatureSize != sizeof(double)) return NULL;
+	if ((size_t)header->LabelOffset + header->Count > file->Size) return NULL;
+	if (header->FeatureOffset % FEATURE_ALIGNMENT != 0 || (size_t)header->FeatureOffset + feature_bytes > file->Size) return NULL;
+	if (header->NodeCount > 0 && (size_t)header->NodeOffset + (size_t)header->NodeCount * header->NodeSize > file->Size) return NULL;
+	return header;
+}
+
+/******************************************************
+*	loads a training set file. a version 1 file is mapped and its rows, labels and
+*	KD-tree are used in place, so startup does no parsing or copying and every process
+*	classifying against the same file shares its pages. the rows are only copied when
+*	the file was written with a different Feature precision. anything without the
+*	magic is read as the legacy format and packed as before.
+*	a missing or invalid file gives an empty set.
+*******************************************************/
+DataSet* LoadTrainingSet(const char* path) {
+	MappedFile* file = MapFile(path);
+	if (!file) {
+		DataSet* ts = EmptyDataSet();
+		PackDataSet(ts);
+		return ts;
+	}
+	if (file->Size < sizeof(TrainingSetHeader) || memcmp(file->Data, TRAINING_SET_MAGIC, sizeof(TRAINING_SET_MAGIC)) != 0) {
+		UnmapFile(file);
+		DataSet* ts = ReadLegacyTrainingSet(path);
+		if (!ts) ts = EmptyDataSet();
+		PackDataSet(ts);		// pack up front so the set can be shared read-only between threads
+		if (ts->Packed->Size >= KD_TREE_MIN_SIZE) {
+			BuildKDTree(ts->Packed);
+		}
+		return ts;
+	}
+
+	DataSet* ts = EmptyDataSet();
+	const TrainingSetHeader* header = CheckTrainingSetHeader(file);
+	if (!header) {
+		fprintf(stderr, "%s: unsupported or corrupt training set file\n", path);
+		UnmapFile(file);
+		PackDataSet(ts);
+		return ts;
+	}
+
+	int size = (int)header->Count;
+	PackedDataSet* packed = MemAllocate(sizeof(PackedDataSet));
+	packed->Size = size;
+	packed->Distances = SelectDistanceKernel();
+	packed->Tree = NULL;
+	packed->Approximate = NULL;
+	packed->Mapping = NULL;
+	ts->Packed = packed;
+
+	if (header->FeatureSize == sizeof(Feature)) {
+		packed->Features = (Feature*)(file->Data + header->FeatureOffset);
+		packed->Labels = (char*)(file->Data + header->LabelOffset);
+		packed->Mapping = file;
+
+		if (header->NodeCount > 0 && header->NodeSize == sizeof(KDNode) && header->NodeOffset % sizeof(Feature) == 0) {
+			KDTree* tree = MemAllocate(sizeof(KDTree));
+			tree->Nodes = (KDNode*)(file->Data + header->NodeOffset);
+			tree->NodeCount = (int)header->NodeCount;
+			tree->Mapped = 1;
+			if (CheckKDTree(tree, size)) {
+				packed->Tree = tree;
+			}
+			else {		// built again below rather than searched out of bounds
+				fprintf(stderr, "%s: corrupt KD-tree, rebuilding it\n", path);
+				FreeKDTree(tree);
+			}
+		}
+	}
+	else {		// written with the other precision: convert the rows into a packed copy
+		int i;
+		int count = size * FEATURE_VECTOR_LENGTH;
+		packed->Features = MemAllocateAligned(sizeof(Feature) * (count > 0 ? count : 1), FEATURE_ALIGNMENT);
+		packed->Labels = MemAllocate(sizeof(char) * (size > 0 ? size : 1));
+		if (header->FeatureSize == sizeof(float)) {
+			const float* rows = (const float*)(file->Data + header->FeatureOffset);
+			for (i = 0; i < count; i++) packed->Features[i] = (Feature)rows[i];
+		}
+		else {
+			const double* rows = (const double*)(file->Data + header->FeatureOffset);
+			for (i = 0; i < count; i++) packed->Features[i] = (Feature)rows[i];
+		}
+		memcpy(packed->Labels, file->Data + header->LabelOffset, size);
+		UnmapFile(file);
+	}
+
+	if (!packed->Tree && packed->Size >= KD_TREE_MIN_SIZE) {
+		BuildKDTree(packed);
+	}
+	return ts;
+}
 
-			if (class_label != EOF)
-				AddTrainingData(ts, dp);
+/******************************************************
+*	reads a training set in the legacy format: records of FEATURE_VECTOR_LENGTH
+*	doubles followed by the class label, stored contiguously and bytewise
+*	(no header, buffers, newlines, etc)
+*******************************************************/
+DataSet* ReadLegacyTrainingSet(const char* path) {
+	FILE* fp;
+	fp = fopen(path, "rb");
+	if (!fp) return NULL;
+
+	DataSet* ts = EmptyDataSet();
+	while (1) {		// parse until end of file
+		double* feature_vector = MemAllocate(sizeof(double) * FEATURE_VECTOR_LENGTH);
+		int class_label = EOF;
+		if (fread(feature_vector, sizeof(double), FEATURE_VECTOR_LENGTH, fp) == FEATURE_VECTOR_LENGTH) {
+			class_label = fgetc(fp);
+		}
+		if (class_label == EOF) {		// end of file, or a truncated last record
+			FreeMemory(feature_vector);
+			break;
 		}
-		fclose(fp);
+		AddTrainingData(ts, NewDataPoint((char)class_label, feature_vector));
 	}
+	fclose(fp);
 	return ts;
 }
 
@@ -77,12 +193,20 @@ DataSet* InitTrainingSet() {
 // and thus stored on the heap
 void FreeDataSet(DataSet* ds) {
 	if (!ds) return;
+	if (ds->PointArena) {		// everything else goes with the arena
+		FreePackedDataSet(ds->Packed);
+		ds->Packed = NULL;
+		return;
+	}
 
 	int i;
 	for (i = 0; i < ds->Size; i++) {			// free each individual DataPoint object
+		if (!ds->Data[i]) continue;
 		if (ds->Data[i]->FeatureVector)		FreeMemory(ds->Data[i]->FeatureVector);
-		if (ds->Data[i])					FreeMemory(ds->Data[i]);
+		FreeMemory(ds->Data[i]);
 	}
+	if (ds->Allocated)	FreeMemory(ds->Data);	// free the array of DataPoint pointers
+	FreePackedDataSet(ds->Packed);
 	FreeMemory(ds);		// free the entire DataSet at the very end
 }
 
@@ -91,7 +215,21 @@ DataSet* EmptyDataSet() {
 	DataSet* ds = (DataSet*)MemAllocate(sizeof(DataSet));
 	ds->Allocated = 0;
 	ds->Size = 0;
+	ds->Data = NULL;
+	ds->Packed = NULL;
+	ds->PointArena = NULL;
+
+	return ds;
+}
 
+DataSet* EmptyDataSetIn(Arena* arena) {
+	if (!arena) return EmptyDataSet();
+	DataSet* ds = (DataSet*)ArenaAllocate(arena, sizeof(DataSet));
+	ds->Allocated = 0;
+	ds->Size = 0;
+	ds->Data = NULL;
+	ds->Packed = NULL;
+	ds->PointArena = arena;
 	return ds;
 }
 
@@ -104,6 +242,19 @@ DataPoint* NewDataPoint(char class_label, double* feature_vector) {
 	return td;
 }
 
+DataPoint* NewDataPointIn(DataSet* ds, char class_label, double* feature_vector) {
+	if (!ds->PointArena) return NewDataPoint(class_label, feature_vector);
+	DataPoint* td = ArenaAllocate(ds->PointArena, sizeof(DataPoint));
+	td->ClassLabel = class_label;
+	td->FeatureVector = feature_vector;
+	return td;
+}
+
+double* NewFeatureVectorIn(DataSet* ds) {
+	if (ds->PointArena) return ArenaAllocate(ds->PointArena, sizeof(double) * FEATURE_VECTOR_LENGTH);
+	return MemAllocate(sizeof(double) * FEATURE_VECTOR_LENGTH);
+}
+
 void AddTrainingData(DataSet* ts, DataPoint* td) {
 	int size = ts->Size;
 	if (ts->Size == ts->Allocated) {		// if size has reached allocated limit, reallocate
@@ -112,6 +263,59 @@ void AddTrainingData(DataSet* ts, DataPoint* td) {
 	ts->Data[ts->Size] = td;
 	ts->Size++;
 	size =ts->Size;
+
+	// the packed copy no longer matches, rebuild it on the next classification
+	if (ts->Packed) {
+		FreePackedDataSet(ts->Packed);
+		ts->Packed = NULL;
+	}
+}
+
+PackedDataSet* PackDataSet(DataSet* ds) {
+	int i, j;
+	int size = 0;
+	for (i = 0; i < ds->Size; i++) {		// only points with a feature vector can be classified against
+		if (ds->Data[i]->FeatureVector) size++;
+	}
+
+	PackedDataSet* packed = MemAllocate(sizeof(PackedDataSet));
+	packed->Size = size;
+	packed->Features = MemAllocateAligned(sizeof(Feature) * FEATURE_VECTOR_LENGTH * (size > 0 ? size : 1), FEATURE_ALIGNMENT);
+	packed->Labels = MemAllocate(sizeof(char) * (size > 0 ? size : 1));
+	packed->Distances = SelectDistanceKernel();
+	packed->Tree = NULL;
+	packed->Approximate = NULL;
+	packed->Mapping = NULL;
+
+	int row = 0;
+	for (i = 0; i < ds->Size; i++) {
+		DataPoint* dp = ds->Data[i];
+		if (!dp->FeatureVector) continue;
+		Feature* dest = packed->Features + row * FEATURE_VECTOR_LENGTH;
+		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+			dest[j] = (Feature)dp->FeatureVector[j];
+		}
+		packed->Labels[row] = dp->ClassLabel;
+		row++;
+	}
+
+	FreePackedDataSet(ds->Packed);
+	ds->Packed = packed;
+	return packed;
+}
+
+void FreePackedDataSet(PackedDataSet* packed) {
+	if (!packed) return;
+	FreeKDTree(packed->Tree);
+	FreeANNIndex(packed->Approximate);
+	if (packed->Mapping) {
+		UnmapFile(packed->Mapping);
+	}
+	else {
+		FreeAligned(packed->Features);
+		FreeMemory(packed->Labels);
+	}
+	FreeMemory(packed);
 }
 
 
@@ -121,16 +325,191 @@ void TrainTrainingSet(DataSet* ts, BinaryDocument* bd, char* class_labels, int n
 	SegmentText(ts, bd, class_labels, num_labels);
 }
 
-// writes training set to a text file
+// writes training set to the default training set file
 void WriteTrainingSet(DataSet* ts) {
-	FILE* fp;
-	fp = fopen(TRAINING_SET_FILE, "wb");
+	WriteTrainingSetFile(ts, TRAINING_SET_FILE);
+}
+
+// writes count zero bytes, used to pad the sections of a training set file to their alignment
+static int WritePadding(FILE* fp, size_t count) {
+	static const unsigned char zeros[FEATURE_ALIGNMENT] = { 0 };
+	while (count > 0) {
+		size_t n = count < sizeof(zeros) ? count : sizeof(zeros);
+		if (fwrite(zeros, 1, n, fp) != n) return 0;
+		count -= n;
+	}
+	return 1;
+}
+
+static size_t AlignOffset(size_t offset) {
+	return (offset + FEATURE_ALIGNMENT - 1) / FEATURE_ALIGNMENT * FEATURE_ALIGNMENT;
+}
+
+/******************************************************
+*	writes ts in the version 1 format described in ocr.h. sets large enough for a
+*	KD-tree get one built (if they do not have one yet) and stored with the rows, so
+*	loading the file needs no build. the file is written next to path and renamed
+*	over it at the end, so a process mapping the old file never sees a partial one.
+*******************************************************/
+int WriteTrainingSetFile(DataSet* ts, const char* path) {
+	if (!ts->Packed) PackDataSet(ts);
+	PackedDataSet* packed = ts->Packed;
+	if (!packed->Tree && packed->Size >= KD_TREE_MIN_SIZE) {
+		BuildKDTree(packed);
+	}
+
+	TrainingSetHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.Magic, TRAINING_SET_MAGIC, sizeof(TRAINING_SET_MAGIC));
+	header.Version = TRAINING_SET_VERSION;
+	header.FeatureLength = FEATURE_VECTOR_LENGTH;
+	header.FeatureSize = sizeof(Feature);
+	header.Count = packed->Size;
+	header.LabelOffset = sizeof(TrainingSetHeader);
+	header.FeatureOffset = (unsigned int)AlignOffset(header.LabelOffset + header.Count);
+	size_t feature_bytes = sizeof(Feature) * FEATURE_VECTOR_LENGTH * (size_t)packed->Size;
+	header.NodeSize = sizeof(KDNode);
+	header.NodeCount = packed->Tree ? packed->Tree->NodeCount : 0;
+	header.NodeOffset = header.NodeCount > 0 ? (unsigned int)AlignOffset(header.FeatureOffset + feature_bytes) : 0;
+
+	size_t path_length = strlen(path);
+	char* temp_path = MemAllocate(path_length + 5);
+	memcpy(temp_path, path, path_length);
+	memcpy(temp_path + path_length, ".tmp", 5);
+
+	FILE* fp = fopen(temp_path, "wb");
+	if (!fp) {
+		FreeMemory(temp_path);
+		return 0;
+	}
+	int ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fwrite(packed->Labels, 1, header.Count, fp) == header.Count
+		&& WritePadding(fp, header.FeatureOffset - (header.LabelOffset + header.Count))
+		&& fwrite(packed->Features, 1, feature_bytes, fp) == feature_bytes;
+	if (ok && header.NodeCount > 0) {
+		ok = WritePadding(fp, header.NodeOffset - (header.FeatureOffset + feature_bytes))
+			&& fwrite(packed->Tree->Nodes, sizeof(KDNode), header.NodeCount, fp) == header.NodeCount;
+	}
+	if (fclose(fp) != 0) ok = 0;
+
+	if (ok) {
+		remove(path);		// rename does not replace an existing file on Windows
+		ok = rename(temp_path, path) == 0;
+	}
+	if (!ok) remove(temp_path);
+	FreeMemory(temp_path);
+	return ok;
+}
+
+// reads a legacy training set file and writes it back out in the version 1 format
+int ConvertTrainingSet(const char* legacy_path, const char* path) {
+	DataSet* ts = ReadLegacyTrainingSet(legacy_path);
+	if (!ts) return 0;
+	int ok = WriteTrainingSetFile(ts, path);
+	FreeDataSet(ts);
+	return ok;
+}
+
+
+// fills heap with the k nearest rows of ts to dp, in order (see ClassifyDataPoint), and returns their number
+static int FindNeighbors(DataSet* ts, DataPoint* dp, int k, NeighborHeap* heap) {
+	if (!ts || ! dp || k <= 0) return 0;
+	if (!ts->Packed) PackDataSet(ts);
+
+	PackedDataSet* packed = ts->Packed;
+	if (packed->Size == 0) return 0;
+
+	int j;
+	Feature query[FEATURE_VECTOR_LENGTH];		// query in the precision of the packed set
+	for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+		query[j] = (Feature)dp->FeatureVector[j];
+	}
+
+	NeighborHeap_Init(heap, k < packed->Size ? k : packed->Size);
+	if (packed->Approximate) {
+		SearchANNIndex(packed->Approximate, query, heap);
+	}
+	else if (packed->Tree) {
+		SearchKDTree(packed, query, heap);
+	}
+	else {
+		SearchNearest(packed, query, heap);
+	}
+	return NeighborHeap_Sort(heap);
+}
+
+/*
+*	Classifies the points of test with null labels into output (test->Size + 1 characters), as
+*	described for ClassifyTestSet below. When neighbors is set, the sorted nearest neighbors of
+*	point i are also kept at neighbors + i * stride, and their number in neighbor_counts[i] (0 for
+*	points that were not classified by their neighbors)
+*/
+static void ClassifyPoints(DataSet* train, DataSet* test, int k, char* output, Neighbor* neighbors, int* neighbor_counts, int stride) {
+	int test_size = test->Size;
+	output[test_size] = '\0';
 	int i, j;
-	for (i = 0; i < ts->Size; i++) {
-		fwrite(ts->Data[i]->FeatureVector, sizeof(double), FEATURE_VECTOR_LENGTH, fp);
-		fwrite(&(ts->Data[i]->ClassLabel), sizeof(char), 1, fp);
+
+	if (train && train->Size > 0 && k > 0 && !train->Packed) PackDataSet(train);
+	PackedDataSet* packed = (train && k > 0) ? train->Packed : NULL;
+	if (packed && packed->Size == 0) packed = NULL;
+
+	// unclassified points are gathered into tiles of KNN_QUERY_TILE queries that are scored
+	// together, so the training set is streamed through cache once per tile instead of once per point
+	Feature* queries = MemAllocateAligned(sizeof(Feature) * FEATURE_VECTOR_LENGTH * KNN_QUERY_TILE, FEATURE_ALIGNMENT);
+	NeighborHeap* heaps = MemAllocate(sizeof(NeighborHeap) * KNN_QUERY_TILE);
+	int tile_index[KNN_QUERY_TILE];		// test point of each query in the tile
+	int tile_count = 0;
+
+	for (i = 0; i < test_size; i++) {
+		DataPoint* test_point = test->Data[i];
+		if (neighbor_counts) neighbor_counts[i] = 0;
+		if (test_point->ClassLabel == '\0' && packed && (packed->Tree || packed->Approximate)) {	// indexed sets are searched one point at a time
+			NeighborHeap heap;
+			int count = FindNeighbors(train, test_point, k, &heap);
+			output[i] = count > 0 ? VoteNeighbors(heap.Items, count) : '\0';
+			test_point->ClassLabel = output[i];
+			if (neighbors) {
+				memcpy(neighbors + i * stride, heap.Items, sizeof(Neighbor) * count);
+				neighbor_counts[i] = count;
+			}
+		}
+		else if (test_point->ClassLabel == '\0') {		// only classify test poinnts with null labels
+			if (packed) {
+				Feature* query = queries + tile_count * FEATURE_VECTOR_LENGTH;
+				for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
+					query[j] = (Feature)test_point->FeatureVector[j];
+				}
+				tile_index[tile_count++] = i;
+			}
+			output[i] = '\0';
+		}
+		
+		else {
+			output[i] = test_point->ClassLabel;
+		}
+
+		// score a full tile, or whatever is left at the end of the test set
+		if (tile_count == KNN_QUERY_TILE || (i == test_size - 1 && tile_count > 0)) {
+			for (j = 0; j < tile_count; j++) {
+				NeighborHeap_Init(&heaps[j], k < packed->Size ? k : packed->Size);
+			}
+			SearchNearestBatch(packed, queries, tile_count, heaps);
+			for (j = 0; j < tile_count; j++) {
+				int count = NeighborHeap_Sort(&heaps[j]);
+				char output_char = VoteNeighbors(heaps[j].Items, count);
+				output[tile_index[j]] = output_char;
+				test->Data[tile_index[j]]->ClassLabel = output_char;
+				if (neighbors) {
+					memcpy(neighbors + tile_index[j] * stride, heaps[j].Items, sizeof(Neighbor) * count);
+					neighbor_counts[tile_index[j]] = count;
+				}
+			}
+			tile_count = 0;
+		}
 	}
-	fclose(fp);
+
+	FreeMemory(heaps);
+	FreeAligned(queries);
 }
 
 
@@ -144,110 +523,179 @@ void WriteTrainingSet(DataSet* ts) {
 *	test: test set
 **********************************************************************************/
 char* ClassifyTestSet(DataSet* train, DataSet* test, int k) {
+	char* output = MemAllocate(sizeof(char) * (test->Size + 1));		// leave room for null terminator
+	ClassifyPoints(train, test, k, output, NULL, NULL, 0);
+	return output;
+}
+
+// a point of a test set that is a character rather than a space or line break
+static int IsGlyph(const DataPoint* dp) {
+	return dp->FeatureVector || (dp->ClassLabel != ' ' && dp->ClassLabel != '\n');
+}
+
+// tallies the classes of count sorted neighbors into alternatives, most votes first, and returns their number
+static int TallyNeighbors(const Neighbor* sorted, int count, OCRAlternative* alternatives) {
+	int alternative_count = 0;
+	int i, a;
+	for (i = 0; i < count; i++) {
+		a = 0;
+		while (a < alternative_count && alternatives[a].Label != sorted[i].ClassLabel) a++;
+		if (a == alternative_count) {		// first, so nearest, neighbor of its class
+			alternatives[a].Label = sorted[i].ClassLabel;
+			alternatives[a].Votes = 0;
+			alternatives[a].Distance = sqrt(sorted[i].DistSquared);
+			alternative_count++;
+		}
+		alternatives[a].Votes++;
+	}
+
+	// stable insertion sort by votes, so ties stay nearest first as in VoteNeighbors
+	for (i = 1; i < alternative_count; i++) {
+		OCRAlternative alternative = alternatives[i];
+		for (a = i; a > 0 && alternatives[a - 1].Votes < alternative.Votes; a--) {
+			alternatives[a] = alternatives[a - 1];
+		}
+		alternatives[a] = alternative;
+	}
+	return alternative_count;
+}
+
+/*
+*	The neighbors of every point are kept while the test set is classified, and then tallied
+*	straight into the result: a first pass sizes the block, a second fills it in
+*/
+OCRResult* ClassifyPage(DataSet* train, DataSet* test, const BinaryDocument* bd, int k) {
 	int test_size = test->Size;
-	char* output = MemAllocate(sizeof(char) * (test_size + 1));		// leave room for null terminator
-	output[test_size] = '\0';
+	int stride = k < 1 ? 1 : k > KNN_MAX_K ? KNN_MAX_K : k;
+	Neighbor* neighbors = MemAllocate(sizeof(Neighbor) * stride * (test_size > 0 ? test_size : 1));
+	int* neighbor_counts = MemAllocate(sizeof(int) * (test_size > 0 ? test_size : 1));
+	char* text = MemAllocate(sizeof(char) * (test_size + 1));
+	ClassifyPoints(train, test, k, text, neighbors, neighbor_counts, stride);
 	int i;
+
+	// size of the block
+	int glyph_count = 0;
+	int alternative_count = 0;
+	OCRAlternative scratch[KNN_MAX_K];
 	for (i = 0; i < test_size; i++) {
-		DataPoint* test_point = test->Data[i];
-		char output_char;
-		if (test_point->ClassLabel == '\0') {		// only classify test poinnts with null labels
-			output_char = ClassifyDataPoint(train, test_point, k);
+		if (!IsGlyph(test->Data[i])) continue;
+		glyph_count++;
+		alternative_count += TallyNeighbors(neighbors + i * stride, neighbor_counts[i], scratch);
+	}
+	size_t glyphs_offset = sizeof(OCRResult);
+	size_t alternatives_offset = glyphs_offset + sizeof(OCRGlyph) * glyph_count;
+	size_t text_offset = alternatives_offset + sizeof(OCRAlternative) * alternative_count;
+	char* block = MemAllocate(text_offset + test_size + 1);
+	OCRResult* result = (OCRResult*)block;
+	result->Glyphs = (OCRGlyph*)(block + glyphs_offset);
+	result->Text = block + text_offset;
+	memcpy(result->Text, text, test_size + 1);
+	result->GlyphCount = glyph_count;
+	result->K = 0;
+
+	// boxes of the points, from the segmentation
+	int* box_of = MemAllocate(sizeof(int) * (test_size > 0 ? test_size : 1));
+	for (i = 0; i < test_size; i++) {
+		box_of[i] = -1;
+	}
+	if (bd) {
+		for (i = 0; i < bd->glyph_count; i++) {
+			int point = bd->glyphs[i].point;
+			if (point >= 0 && point < test_size) box_of[point] = i;
+		}
+	}
+
+	OCRAlternative* alternatives = (OCRAlternative*)(block + alternatives_offset);
+	int line = 0;
+	int word = -1;
+	int in_word = 0;
+	int classified = 0;
+	double total_confidence = 0;
+	OCRGlyph* glyph = result->Glyphs;
+	for (i = 0; i < test_size; i++) {
+		DataPoint* dp = test->Data[i];
+		if (!IsGlyph(dp)) {
+			in_word = 0;
+			if (dp->ClassLabel == '\n') line++;
+			continue;
+		}
+		if (!in_word) {
+			word++;
+			in_word = 1;
+		}
+		glyph->Label = text[i];
+		if (box_of[i] >= 0) {
+			const GlyphBox* box = &bd->glyphs[box_of[i]];
+			glyph->X = box->x;
+			glyph->Y = box->y;
+			glyph->Width = box->width;
+			glyph->Height = box->height;
+		}
+		else {
+			glyph->X = -1;
+			glyph->Y = -1;
+			glyph->Width = 0;
+			glyph->Height = 0;
+		}
+		glyph->Line = line;
+		glyph->Word = word;
+		glyph->Alternatives = alternatives;
+		glyph->AlternativeCount = TallyNeighbors(neighbors + i * stride, neighbor_counts[i], alternatives);
+		if (neighbor_counts[i] > 0) {
+			glyph->Confidence = (double)alternatives[0].Votes / neighbor_counts[i];
+			if (neighbor_counts[i] > result->K) result->K = neighbor_counts[i];
 		}
-		
 		else {
-			output_char = test_point->ClassLabel;
+			glyph->Confidence = dp->FeatureVector ? 0 : 1;		// left unclassified, or punctuation
+		}
+		if (dp->FeatureVector) {
+			total_confidence += glyph->Confidence;
+			classified++;
 		}
-		output[i] = output_char;
-		test_point->ClassLabel = output_char;
+		alternatives += glyph->AlternativeCount;
+		glyph++;
 	}
-	return output;
+	result->LineCount = line;
+	result->WordCount = word + 1;
+	result->Confidence = classified > 0 ? total_confidence / classified : 1;
+
+	FreeMemory(box_of);
+	FreeMemory(text);
+	FreeMemory(neighbor_counts);
+	FreeMemory(neighbors);
+	return result;
 }
 
-
-/*****************************************************************************
-*	Neighbor struct and accompanying functions are only used for the purposes
-*	of function ClassifyDataPoint()
-*****************************************************************************/
-typedef struct {
-	double DistSquared;
-	char ClassLabel;
-} Neighbor;			// struct containing a neighbor's distance squared and class label
-
-int CompareNeighbor(Neighbor* a, Neighbor* b) {			// for qsort (increasing order)
-	if (a->DistSquared < b->DistSquared) {
-		return -1;
-	}
-	else if (a->DistSquared > b->DistSquared) {
-		return 1;
-	}
-	else return 0;
+void FreeOCRResult(OCRResult* result) {
+	FreeMemory(result);
 }
 
+
 /******************************************************************************
 *	classifies data point using the K-nearest neighbors algorithm and 
 *	returns the label of the resulting class
 *
 *	ts: pointer to the training set to classify from
 *	dp: pointer to data point object
-*	k: parameter for K-nearest neighbors classification
+*	k: parameter for K-nearest neighbors classification (at most KNN_MAX_K)
+*	The search keeps only the k nearest rows in a bounded heap. It goes through the
+*	approximate index of the set if one was built (which allocates its ranking of
+*	the lists), else through its KD-tree if it has one (exact search), and otherwise
+*	scans every row. It runs over the packed copy of ts, which is built here if the
+*	set has not been packed yet (InitTrainingSet packs up front, so shared sets are
+*	never modified by this call).
 *******************************************************************************/
 char ClassifyDataPoint(DataSet* ts, DataPoint* dp, int k) {
-	if (!ts || ! dp || ts->Size == 0 || k <= 0) return '\0';
-
-	int i;
-	Neighbor* neighbor_vector;			// vector of neighbor structs for ALL datapoints in ts
-	neighbor_vector = MemAllocate(sizeof(Neighbor) * ts->Size);
-	for (i = 0; i < ts->Size; i++) {	// iterate through all datapoints in training set
-		DataPoint* train_point = ts->Data[i];
-
-		double dist_squared = 0;
-		int j;
-		for (j = 0; j < FEATURE_VECTOR_LENGTH; j++) {
-			dist_squared += pow(dp->FeatureVector[j] - train_point->FeatureVector[j], 2.0);
-		}
-		Neighbor neighbor;
-		neighbor.ClassLabel = train_point->ClassLabel;
-		neighbor.DistSquared = dist_squared;
-		neighbor_vector[i] = neighbor;
-	}
-
-	// sort neighbor vector in order of increasing distance squared
-	qsort(neighbor_vector, ts->Size, sizeof(Neighbor), CompareNeighbor);
+	NeighborHeap heap;					// the k nearest rows
+	int count = FindNeighbors(ts, dp, k, &heap);
+	if (count == 0) return '\0';
 
 	// find the most frequent class of the K-nearest ones
-	int votes[255];				// contains vote count for the class of the K-nearest neighbors
-	for (i = 0; i < 255; i++) {
-		votes[i] = 0;
-	}
-	for (i = 0; i < k; i++) {
-		char class_label = neighbor_vector[i].ClassLabel;
-		votes[(int)class_label]++;
-	}
-	int max = votes[0];
-	char max_char = neighbor_vector[0].ClassLabel;		// most frequent class in K-nearest neighbors
-	for (i = 0; i < k; i++) {		// get character with the most frequent votes
-		char class_label = neighbor_vector[i].ClassLabel;
-		int votes_i = votes[(int)class_label];
-		if (votes_i > max) {
-			max = votes_i;
-			max_char = class_label;
-		}
-	}
-	
-	FreeMemory(neighbor_vector);
-	return max_char;
+	return VoteNeighbors(heap.Items, count);
 }
 
-/*	takes in a GRAYSCALE (8 bpp) image of a character and computes the feature vector
-*	feature vector is determined by dividing the resized image into 16 zones
-*	and computing the average pixel value in those zones
-*/
-double* GetFeatureVector(unsigned char* char_pixels, int height, int width, int doc_width) {
-	if (height == 0 || width == 0) return;
-	unsigned char* resized_image = ResizeCharacter(char_pixels, height, width, RESIZED_CHAR_DIM, RESIZED_CHAR_DIM, doc_width);
-	//WriteToFile("data/resized_char.txt", resized_image, 40, 40);
-	double* feature_vector = (double*)MemAllocate(sizeof(double) * CHAR_ZONE_COUNT);
+// computes the zone densities of a RESIZED_CHAR_DIM square character image into feature_vector
+static void ZoneFeatures(const unsigned char* resized_image, double* feature_vector) {
 	int i;
 	for (i = 0; i < CHAR_ZONE_COUNT; i++) {
 		feature_vector[i] = 0.0;
@@ -269,6 +717,18 @@ double* GetFeatureVector(unsigned char* char_pixels, int height, int width, int
 			}
 		}
 	}
+}
+
+/*	takes in a GRAYSCALE (8 bpp) image of a character and computes the feature vector
+*	feature vector is determined by dividing the resized image into 16 zones
+*	and computing the average pixel value in those zones
+*/
+double* GetFeatureVector(unsigned char* char_pixels, int height, int width, int doc_width) {
+	if (height == 0 || width == 0) return;
+	unsigned char* resized_image = ResizeCharacter(char_pixels, height, width, RESIZED_CHAR_DIM, RESIZED_CHAR_DIM, doc_width);
+	//WriteToFile("data/resized_char.txt", resized_image, 40, 40);
+	double* feature_vector = (double*)MemAllocate(sizeof(double) * CHAR_ZONE_COUNT);
+	ZoneFeatures(resized_image, feature_vector);
 
 	// free allocated memory
 	FreeMemory(resized_image);
@@ -276,6 +736,43 @@ double* GetFeatureVector(unsigned char* char_pixels, int height, int width, int
 	return feature_vector;
 }
 
+// ResizePackedCharacter into output_image (out_height * out_width pixels)
+static void ResizePackedInto(const unsigned long long* rows, int words_per_row, int char_x, int char_y, int height, int width,
+	int out_height, int out_width, int fg_color, int background_color, unsigned char* output_image) {
+	int x, y;
+	for (y = 0; y < out_height; y++) {
+		for (x = 0; x < out_width; x++) {
+			// same nearest pixel as ResizeCharacter()
+			float x_interp = ((float)x / out_width) * width;
+			float y_interp = ((float)y / out_height) * height;
+			int x_source = round(x_interp);
+			int y_source = round(y_interp);
+			if (x_source >= width) x_source = width - 1;
+			if (y_source >= height) y_source = height - 1;
+
+			int source_x = char_x + x_source;
+			const unsigned long long* row = rows + (size_t)(char_y + y_source) * words_per_row;
+			int foreground = (row[source_x / PACKED_WORD_BITS] >> (source_x % PACKED_WORD_BITS)) & 1;
+			output_image[x + y * out_width] = foreground ? fg_color : background_color;
+		}
+	}
+}
+
+double* GetPackedFeatureVector(const unsigned long long* rows, int words_per_row, int x, int y, int height, int width, int fg_color, int background_color) {
+	if (height == 0 || width == 0) return NULL;
+	double* feature_vector = (double*)MemAllocate(sizeof(double) * CHAR_ZONE_COUNT);
+	ComputePackedFeatureVector(rows, words_per_row, x, y, height, width, fg_color, background_color, feature_vector);
+	return feature_vector;
+}
+
+// the resized character is only needed while its zones are counted, so it is kept on the stack
+void ComputePackedFeatureVector(const unsigned long long* rows, int words_per_row, int x, int y, int height, int width, int fg_color,
+	int background_color, double* feature_vector) {
+	unsigned char resized_image[RESIZED_CHAR_SIZE];
+	ResizePackedInto(rows, words_per_row, x, y, height, width, RESIZED_CHAR_DIM, RESIZED_CHAR_DIM, fg_color, background_color, resized_image);
+	ZoneFeatures(resized_image, feature_vector);
+}
+
 // interpolates points from a 2-D grid (used to resize a character image to a standard size)
 // qij: value of pixel at x_i, y_j
 float BilinearInterpolation(float q11, float q12, float q21, float q22, float x1, float x2, float y1, float y2, float x, float y) {
@@ -327,3 +824,13 @@ unsigned char* ResizeCharacter(unsigned char* image, int height, int width, int
 	}
 	return output_image;
 }
+
+unsigned char* ResizePackedCharacter(const unsigned long long* rows, int words_per_row, int char_x, int char_y, int height, int width,
+	int out_height, int out_width, int fg_color, int background_color) {
+	if (out_height == 0 || out_width == 0) return NULL;
+
+	unsigned char* output_image = MemAllocate(sizeof(unsigned char) * out_height * out_width);
+	ResizePackedInto(rows, words_per_row, char_x, char_y, height, width, out_height, out_width, fg_color, background_color, output_image);
+	return output_image;
+}
+
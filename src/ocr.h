@@ -4,43 +4,192 @@
 #define CHAR_COUNT 64			// number of characters in each training set
 #define FEATURE_VECTOR_LENGTH 16
 #define TRAINING_SET_ALLOCATE_BLOCK 200
+#define FEATURE_ALIGNMENT 64			// byte alignment of packed feature matrices (one cache line)
+#define FEATURE_SINGLE_PRECISION 0		// set to 1 to store packed features as float (16 floats = one 512-bit register)
+
+#if FEATURE_SINGLE_PRECISION
+typedef float Feature;
+#else
+typedef double Feature;
+#endif
 
 #include "preprocess.h"
+#include "system.h"
+
+/*
+*	Training set file, version 1. All fields are in native byte order (little endian on
+*	every supported target), and the file is laid out so it can be memory mapped and used
+*	in place:
+*		header				64 bytes
+*		labels				Count bytes at LabelOffset, the class label of each row
+*		features			Count rows of FeatureLength features of FeatureSize bytes each,
+*							at FeatureOffset (a multiple of FEATURE_ALIGNMENT)
+*		KD-tree nodes		NodeCount nodes of NodeSize bytes at NodeOffset (NodeCount may be 0).
+*							rows are stored in the order of the tree's leaves
+*	Files without the magic are read as the legacy format: records of 16 doubles and one
+*	label byte, with no header.
+*/
+#define TRAINING_SET_MAGIC "OCRTSET"		// 8 bytes including the terminator
+#define TRAINING_SET_VERSION 1
+
+typedef struct _TrainingSetHeader {
+	char Magic[8];
+	unsigned int Version;
+	unsigned int FeatureLength;		// features per row (FEATURE_VECTOR_LENGTH)
+	unsigned int FeatureSize;		// bytes per feature: 4 (float) or 8 (double)
+	unsigned int Count;				// number of rows
+	unsigned int LabelOffset;		// byte offsets from the start of the file
+	unsigned int FeatureOffset;
+	unsigned int NodeSize;			// bytes per KD-tree node
+	unsigned int NodeCount;
+	unsigned int NodeOffset;
+	unsigned int Reserved[5];
+} TrainingSetHeader;
 
 typedef struct _DataPoint {
 	char ClassLabel;
 	double* FeatureVector;
 } DataPoint;
 
+/*
+*	Packed copy of a DataSet for classification: all feature vectors in one contiguous,
+*	aligned matrix (one row of FEATURE_VECTOR_LENGTH features per sample) and the class
+*	labels in a parallel array, so a KNN scan is a single linear pass over memory.
+*/
+typedef struct _PackedDataSet PackedDataSet;
+typedef struct _KDTree KDTree;
+typedef struct _ANNIndex ANNIndex;
+
+// computes the squared distance from query to each of the count rows starting at rows
+typedef void (*DistanceKernel)(const Feature* query, const Feature* rows, int count, Feature* distances);
+
+struct _PackedDataSet {
+	int Size;
+	Feature* Features;		// Size * FEATURE_VECTOR_LENGTH features, FEATURE_ALIGNMENT aligned
+	char* Labels;			// class label of each row
+	DistanceKernel Distances;	// fastest distance kernel for this CPU, chosen when the set is packed
+	KDTree* Tree;			// spatial index over the rows (NULL to search by brute force)
+	ANNIndex* Approximate;	// optional approximate index, used instead of exact search when set
+	MappedFile* Mapping;	// when set, Features and Labels point into this mapped training set file
+};
+
+/*
+*	A set loaded from a version 1 file only has its Packed form: Size is 0 and Data is empty,
+*	since the classifier never needs the individual DataPoints.
+*	A set made with EmptyDataSetIn keeps itself, Data, its points and their feature vectors in
+*	an arena; they are released when the arena is reset, and FreeDataSet only frees Packed.
+*/
 typedef struct _DataSet {
 	int Allocated;
 	int Size;
 	DataPoint** Data;		// array of TrainingData pointers
+	PackedDataSet* Packed;	// packed copy used by the classifier (NULL until PackDataSet is called)
+	Arena* PointArena;		// arena the points are allocated from, or NULL for the heap
 } DataSet;
 
+// loads the default training set file
 DataSet* InitTrainingSet();
 
+// loads a training set file of either format. version 1 files are memory mapped and used in place
+DataSet* LoadTrainingSet(const char* path);
+
+// reads a file in the legacy format into DataPoints. returns NULL if it cannot be opened
+DataSet* ReadLegacyTrainingSet(const char* path);
+
 DataSet* EmptyDataSet();
 
+// an empty set allocated from arena, for points that only live as long as the arena is not reset
+DataSet* EmptyDataSetIn(Arena* arena);
+
 void FreeDataSet(DataSet* ds);
 
 DataPoint* NewDataPoint(char class_label, double* feature_vector);
 
+// NewDataPoint allocated from ds's arena (or the heap) to be added to ds
+DataPoint* NewDataPointIn(DataSet* ds, char class_label, double* feature_vector);
+
+// room for a feature vector of a point of ds (FEATURE_VECTOR_LENGTH doubles), from its arena or the heap
+double* NewFeatureVectorIn(DataSet* ds);
+
 void TrainTrainingSet(DataSet* ts, BinaryDocument* bd, char* class_labels, int num_labels);
 
+// writes ts to the default training set file
 void WriteTrainingSet(DataSet* ts);
 
+// writes ts in the version 1 format (packing it and building its KD-tree if needed). returns 1 on success
+int WriteTrainingSetFile(DataSet* ts, const char* path);
+
+// rewrites a legacy training set file in the version 1 format. returns 1 on success
+int ConvertTrainingSet(const char* legacy_path, const char* path);
+
 void AddTrainingData(DataSet* ts, DataPoint* td);
 
+// builds ds->Packed from the labeled data points of ds (replacing any previous packed copy)
+PackedDataSet* PackDataSet(DataSet* ds);
+
+void FreePackedDataSet(PackedDataSet* packed);
+
 double* GetFeatureVector(unsigned char* char_start, int height, int width, int doc_width);		// returns the feature vector for a character
 
+// feature vector of the height x width character at (x, y) of an image of packed rows (see BinaryDocument)
+double* GetPackedFeatureVector(const unsigned long long* rows, int words_per_row, int x, int y, int height, int width, int fg_color, int background_color);
+
+// GetPackedFeatureVector into feature_vector, for a character whose height and width are not 0. allocates nothing
+void ComputePackedFeatureVector(const unsigned long long* rows, int words_per_row, int x, int y, int height, int width, int fg_color,
+	int background_color, double* feature_vector);
+
 char* ClassifyTestSet(DataSet* train, DataSet* test, int k);
 
+/*
+*	Result of recognizing a page (see ClassifyPage). The whole result is a single allocation:
+*	the OCRResult itself, then its Glyphs, then the Alternatives they point into, then Text,
+*	so it is freed at once with FreeOCRResult and can be handed between threads as one block.
+*/
+typedef struct _OCRAlternative {
+	char Label;
+	int Votes;				// neighbors of this class among the k nearest
+	double Distance;		// distance to the nearest of them
+} OCRAlternative;
+
+typedef struct _OCRGlyph {
+	char Label;				// recognized character
+	int X;					// box of the character on the page (see GlyphBox), or -1 and 0 by 0 if the
+	int Y;					// segmentation kept no boxes
+	int Width;
+	int Height;
+	int Line;				// line and word of the page it belongs to, both from 0
+	int Word;
+	double Confidence;		// fraction of the neighbors that voted for Label (0 if it could not be
+							// classified). punctuation told apart by its shape has a confidence of 1
+	OCRAlternative* Alternatives;	// every class among the neighbors, most votes first (ties nearest
+	int AlternativeCount;			// first), so Alternatives[0] is Label
+} OCRGlyph;
+
+typedef struct _OCRResult {
+	char* Text;				// the text ClassifyTestSet returns, with spaces and newlines
+	OCRGlyph* Glyphs;		// every character of Text that is not a space or newline, in order
+	int GlyphCount;
+	int LineCount;
+	int WordCount;
+	double Confidence;		// mean confidence of the glyphs meant for the classifier (not punctuation), 1 if none
+	int K;					// neighbors each glyph was classified from (0 if none were)
+} OCRResult;
+
+// classifies test (as ClassifyTestSet does) into a structured result. bd is the document test was
+// segmented from, for the boxes of its glyphs, and may be NULL
+OCRResult* ClassifyPage(DataSet* train, DataSet* test, const BinaryDocument* bd, int k);
+
+void FreeOCRResult(OCRResult* result);
+
 char ClassifyDataPoint(DataSet* ts, DataPoint* dp, int k);
 
 float BilinearInterpolation(float q11, float q12, float q21, float q22, float x1, float x2, float y1, float y2, float x, float y);
 
 unsigned char* ResizeCharacter(unsigned char* image, int height, int width, int output_height, int output_width, int doc_width);
 
+// ResizeCharacter() of the character at (char_x, char_y) of an image of packed rows
+unsigned char* ResizePackedCharacter(const unsigned long long* rows, int words_per_row, int char_x, int char_y, int height, int width,
+	int output_height, int output_width, int fg_color, int background_color);
+
 
 #endif
@@ -1,62 +1,77 @@
 #include "preprocess.h"
+#include "grayscale.h"
 #include "qdbmp.h"
 #include "system.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 
 #define THETA_DELTA_DEG 0.5		//accuracy of the deskew algorithm
 #define MAX_R_BINS 2000
 #define MAX_SKEW_ANGLE_DEG 30		// maximum angle to consider. for practical purposes, this is far less than 180 degrees
+#define HOUGH_MIN_BAND_ROWS 64		// fewest rows worth giving a Deskew thread
+#define SKEW_COARSE_SCALE 4			// reduction of the image for the coarse skew sweep
+#define SKEW_COARSE_STEP_DEG 0.5	// theta bins of the coarse sweep
+#define SKEW_FINE_STEP_DEG 0.05		// theta bins of the fine sweep
+#define SKEW_FINE_BIN_COUNT 31		// fine bins, covering a coarse bin and a half on either side of the coarse angle
+#define PROFILE_COARSE_BLOCK 16		// block width (pixels) of the sheared row sums of the coarse projection sweep
+#define PROFILE_FINE_BLOCK 8		// block width of the fine projection sweep
+
+#define HISTOGRAM_COPIES 4			// interleaved copies of the intensity histogram filled while binarizing
+#define ADAPTIVE_WINDOW_DIVISOR 8	// local threshold windows are this fraction of the shorter side of the page
+#define ADAPTIVE_MIN_WINDOW 15		// but at least this many pixels square
+#define ADAPTIVE_MAX_WINDOW 255		// and at most this many (window sums must fit in 32 bits)
+#define ADAPTIVE_MIN_BAND_ROWS 64	// fewest rows worth giving a thresholding thread
+#define SAUVOLA_K 0.34				// weight of the local deviation in Sauvola's threshold
+#define SAUVOLA_R 128.0				// dynamic range of the deviation
+#define BRADLEY_PERCENT 15			// pixels this much (percent) darker than their local mean are black
+#define STREAM_STRIP_ROWS 16		// rows read from the file at a time by a BinarizeStream
+#define PACK_BYTES_MAGIC 0x0102040810204080ULL	// moves bit 0 of byte i of a word to bit 56 + i
 
 static const double PI = 3.1415927;
 
+int BmpRowStride(int width) {
+#if LCDK == 0
+	return (width * 3 + 3) / 4 * 4;
+#else
+	return width * 3;
+#endif
+}
+
+/*
+*	Adds the intensities of a row to HISTOGRAM_COPIES interleaved histograms of 256 bins (pixel x
+*	goes to copy x % HISTOGRAM_COPIES). a page is mostly one intensity, and consecutive
+*	increments of a single bin would each wait for the previous one
+*/
+static void AddRowHistogram(const unsigned char* row, int width, int* histograms) {
+	int x = 0;
+	for (; x + HISTOGRAM_COPIES <= width; x += HISTOGRAM_COPIES) {
+		histograms[row[x]]++;
+		histograms[256 + row[x + 1]]++;
+		histograms[512 + row[x + 2]]++;
+		histograms[768 + row[x + 3]]++;
+	}
+	for (; x < width; x++) {
+		histograms[row[x]]++;
+	}
+}
+
 // input_bmp: 24 BPP bitmap
 unsigned char* ConvertImageToGrayscale(unsigned char* input_bmp, int height, int width) {
 	//allocate memory for output grayscale bitmap (1 byte per pixel)
 	unsigned char* bitmap_grayscale = MemAllocate(sizeof(unsigned char) * height * width);
 
-	//convert RGB bmp image to grayscale using the luminosity 
-	int x, y;
-	//for (x = 0; x < width; x++) {
-	//	for (y = 0; y < height; y++) {
-	//		UCHAR pixel_value = 0;
-	//		UCHAR r, g, b;
-	//		BMP_GetPixelRGB(input_bmp, x, y, &r, &g, &b);
-
-	//		if (BMP_GetBitsPerPixel(input_bmp) == 8) {
-	//			pixel_value = b;
-	//		}
-	//		else {
-	//			pixel_value = (UCHAR)(0.21*r + 0.72*g + 0.07*b);
-	//		}
-
-	//		bitmap_grayscale[x + y * width] = pixel_value;
-	//	}
-	//}
-
-
+	//convert RGB bmp image to grayscale using the luminosity, a row at a time
+	int y;
 	// using using LCDK's usb_imread, image starts in bottom left. we want to store starting from the top left
-	int bytes_per_row = 4.0 * ceil(width * 3.0 / 4.0);
-	for (y = 0; y < height; y++)
-	{
-		for (x = 0; x < width; x++) {
-#if LCDK == 0
-			int col_index = (x * 3 + y * bytes_per_row);
-#else
-			int col_index = (x + y * width) * 3;
-#endif
-			// info stored in BGR order
-			unsigned char r = input_bmp[col_index + 2];
-			unsigned char g = input_bmp[col_index + 1];
-			unsigned char b = input_bmp[col_index];
-			unsigned char pixel_value = (unsigned char)(0.21*r + 0.72*g + 0.07*b);
-
-			bitmap_grayscale[x + (height - y - 1) * width] = pixel_value;
-		}
-	}		
+	int stride = BmpRowStride(width);
+	GrayscaleKernel grayscale_row = SelectGrayscaleKernel();
+	for (y = 0; y < height; y++) {
+		grayscale_row(input_bmp + y * stride, width, bitmap_grayscale + (height - y - 1) * width);
+	}
 
 	//free input color image
 	FreeMemory(input_bmp);
@@ -69,32 +84,77 @@ unsigned char* ConvertImageToGrayscale(unsigned char* input_bmp, int height, int
 //frees the members of a BinaryDocument struct
 void BinaryDocument_Free(BinaryDocument* doc) {
 	FreeMemory(doc->image);
-	FreeMemory(doc->boundaries);
+	FreeMemory(doc->bits);
+	FreeMemory(doc->glyphs);
 }
 
-// Takes in a grayscale image and binarizes it (makes it black and white)
-// Uses Otsu's method, a global thresholding algorithm
-BinaryDocument Binarize(unsigned char* bmp_rgb, int height, int width) {
-	unsigned char* image;
-	int i;
-	image = ConvertImageToGrayscale(bmp_rgb, height, width);
+/*
+*	Bit plane kernels
+*/
+void PackRow(const unsigned char* row, int width, int fg_color, unsigned long long* words) {
+	// pixels are 0 or 1, so xoring with flip makes the foreground bytes 1 and the rest 0. eight such bytes
+	// (read little endian) multiplied by PACK_BYTES_MAGIC gather into the top byte as bits 0 to 7
+	unsigned long long flip = fg_color ? 0 : 0x0101010101010101ULL;
+	int word_count = PACKED_WORDS(width);
+	int w, i;
+	for (w = 0; w < word_count; w++) {
+		const unsigned char* pixels = row + w * PACKED_WORD_BITS;
+		int count = width - w * PACKED_WORD_BITS < PACKED_WORD_BITS ? width - w * PACKED_WORD_BITS : PACKED_WORD_BITS;
+		unsigned long long word = 0;
+		for (i = 0; i + 8 <= count; i += 8) {
+			unsigned long long bytes;
+			memcpy(&bytes, pixels + i, sizeof(bytes));
+			word |= (((bytes ^ flip) * PACK_BYTES_MAGIC) >> 56) << i;
+		}
+		for (; i < count; i++) {
+			word |= (unsigned long long)(pixels[i] == fg_color) << i;
+		}
+		words[w] = word;
+	}
+}
 
-	int total_pixels = height * width;		// total number of pixels in the grayscale image
-	int background_color;					// 0 for black, 1 for white background
-	int black_pixel_count = 0;				// count of black pixels in imgae
-	double total_intensity = 0; 			// sum of intensities of each pixel in the image
-	int histogram[256]; 					// histogram of the intensities of the pixels
+void UnpackRow(const unsigned long long* words, int width, int fg_color, int background_color, unsigned char* row) {
+	int x;
+	for (x = 0; x < width; x++) {
+		row[x] = (words[x / PACKED_WORD_BITS] >> (x % PACKED_WORD_BITS)) & 1 ? fg_color : background_color;
+	}
+}
 
+int CountRowForeground(const unsigned long long* words, int x_start, int x_end) {
+	if (x_start >= x_end) return 0;
+	int first = x_start / PACKED_WORD_BITS;
+	int last = (x_end - 1) / PACKED_WORD_BITS;
+	unsigned long long first_mask = ~0ULL << (x_start % PACKED_WORD_BITS);
+	unsigned long long last_mask = ~0ULL >> (PACKED_WORD_BITS - 1 - (x_end - 1) % PACKED_WORD_BITS);
+	if (first == last) return PopCount64(words[first] & first_mask & last_mask);
 
-	for (i = 0; i < 256; i++) {				// set histogram array to zeros
-		histogram[i] = 0;
+	int count = PopCount64(words[first] & first_mask) + PopCount64(words[last] & last_mask);
+	int w;
+	for (w = first + 1; w < last; w++) {
+		count += PopCount64(words[w]);
 	}
+	return count;
+}
 
-	int t;
-	for (i = 0; i<total_pixels; i++) {
-		histogram[(int)image[i]]++; 		// populate the color histogram
+void AddColumnCounts(const unsigned long long* words, int words_per_row, int* counts) {
+	int w;
+	for (w = 0; w < words_per_row; w++) {
+		unsigned long long word = words[w];
+		int* word_counts = counts + w * PACKED_WORD_BITS;
+		while (word) {		// visit the set bits only, lowest first
+			word_counts[LowestSetBit64(word)]++;
+			word &= word - 1;
+		}
 	}
+}
 
+/*
+*	Otsu's method: returns the threshold that maximizes the between-class variance of the
+*	intensity histogram of total_pixels pixels. intensities >= threshold are white
+*/
+static int OtsuThreshold(const int* histogram, int total_pixels) {
+	double total_intensity = 0; 			// sum of intensities of each pixel in the image
+	int i, t;
 	for (i = 0; i < 256; i++) {
 		total_intensity += histogram[i] * i;
 	}
@@ -126,43 +186,1087 @@ BinaryDocument Binarize(unsigned char* bmp_rgb, int height, int width) {
 			optimal_threshold = t;
 		}
 	}
+	return optimal_threshold;
+}
 
-	//apply global threshold to newly allocated output image
-	unsigned char* output_image = MemAllocate(sizeof(unsigned char) * total_pixels);
-	for (i = 0; i<height*width; i++) {
-		int intens = image[i];
-		if (intens >= optimal_threshold) {
-			output_image[i] = WHITE_PIXEL; 			// set to white pixel (1 for binary image of 1 BPP)	
+/*
+*	Local thresholds (BINARIZE_SAUVOLA, BINARIZE_BRADLEY) compare each pixel with the mean
+*	(and, for Sauvola, the standard deviation) of the window of (2 * radius + 1)^2 pixels
+*	centered on it, clipped to the page. The window sums come from the integral image of the
+*	gray values and of their squares, one row at a time: the difference of the integral image
+*	rows at the bottom and top of the window is the prefix sum of the column sums of the rows
+*	in the window, which are updated by one row in and one row out per row. so each pixel costs
+*	O(1) whatever the window size, and each band only needs a few rows of width sums.
+*	sums of gray values and of their squares are kept in 32 bits and may wrap; a window sum is
+*	still exact since every window is at most ADAPTIVE_MAX_WINDOW pixels square
+*/
+typedef struct _ThresholdBand {
+	const unsigned char* gray;		// grayscale rows, bottom-up: row y of the page is row height - 1 - y
+	int height;
+	int width;
+	BinarizeMethod method;
+	int radius;
+	unsigned char* output;			// byte image to write, or NULL
+	unsigned long long* output_bits;	// bit plane to write (bits set on black pixels), or NULL
+	int words_per_row;
+	int y_start;					// rows [y_start, y_end) of the page
+	int y_end;
+	long black_pixel_count;			// black pixels written, set by the worker
+} ThresholdBand;
+
+// running sums of the windows of one row at a time
+typedef struct _LocalWindow {
+	int width;
+	int radius;
+	BinarizeMethod method;
+	unsigned int* column_sums;		// sums of the gray values (and their squares) of each column over the window rows
+	unsigned int* column_squares;
+	unsigned int* sums;				// prefix sums of the column sums
+	unsigned int* squares;
+	double* column_inverse;			// 1 / the number of columns in the window of each column
+} LocalWindow;
+
+// thresholding windows for a page of the given size: an eighth of the shorter side, within bounds. returns the radius
+static int LocalWindowRadius(int height, int width) {
+	int shorter_side = height < width ? height : width;
+	int window = shorter_side / ADAPTIVE_WINDOW_DIVISOR;
+	if (window < ADAPTIVE_MIN_WINDOW) window = ADAPTIVE_MIN_WINDOW;
+	if (window > ADAPTIVE_MAX_WINDOW) window = ADAPTIVE_MAX_WINDOW;
+	return window / 2;
+}
+
+// an empty window (no rows) for rows of width pixels
+static void LocalWindow_Init(LocalWindow* window, int width, int radius, BinarizeMethod method) {
+	int x;
+	window->width = width;
+	window->radius = radius;
+	window->method = method;
+	window->column_sums = MemAllocate(sizeof(unsigned int) * (width > 0 ? width : 1));
+	window->column_squares = MemAllocate(sizeof(unsigned int) * (width > 0 ? width : 1));
+	window->sums = MemAllocate(sizeof(unsigned int) * (width + 1));
+	window->squares = MemAllocate(sizeof(unsigned int) * (width + 1));
+	window->column_inverse = MemAllocate(sizeof(double) * (width > 0 ? width : 1));
+	for (x = 0; x < width; x++) {
+		window->column_sums[x] = 0;
+		window->column_squares[x] = 0;
+		int x_start = x - radius > 0 ? x - radius : 0;
+		int x_end = x + radius < width ? x + radius + 1 : width;
+		window->column_inverse[x] = 1.0 / (x_end - x_start);
+	}
+}
+
+static void LocalWindow_Free(LocalWindow* window) {
+	FreeMemory(window->column_sums);
+	FreeMemory(window->column_squares);
+	FreeMemory(window->sums);
+	FreeMemory(window->squares);
+	FreeMemory(window->column_inverse);
+}
+
+// moves the window: adds the gray values of row in and removes those of row out (either may be NULL)
+static void LocalWindow_Slide(LocalWindow* window, const unsigned char* in, const unsigned char* out) {
+	unsigned int* column_sums = window->column_sums;
+	unsigned int* column_squares = window->column_squares;
+	int width = window->width;
+	int x;
+	if (in && out) {
+		for (x = 0; x < width; x++) {
+			column_sums[x] += in[x] - out[x];
+			column_squares[x] += in[x] * in[x] - out[x] * out[x];
 		}
-		else {
-			output_image[i] = BLACK_PIXEL;			// set to black pixel (0 for binary image of 1 BPP)
-			black_pixel_count++;
+	}
+	else if (in) {
+		for (x = 0; x < width; x++) {
+			column_sums[x] += in[x];
+			column_squares[x] += in[x] * in[x];
+		}
+	}
+	else if (out) {
+		for (x = 0; x < width; x++) {
+			column_sums[x] -= out[x];
+			column_squares[x] -= out[x] * out[x];
 		}
 	}
+}
 
-	// set background color to the majority color count
-	int white_pixel_count = total_pixels - black_pixel_count;
+/*
+*	Threshold a row whose windows span window_rows rows, given the prefix sums of the column sums
+*	(sums[x] is the sum over the columns before x). write BLACK_PIXEL / WHITE_PIXEL to out_row
+*	and return the number of black pixels
+*/
+static int ThresholdRowBradley(const unsigned char* row, int width, int radius, int window_rows, const unsigned int* sums, unsigned char* out_row) {
+	int black_pixel_count = 0;
+	int x;
+	for (x = 0; x < width; x++) {
+		int x_start = x - radius > 0 ? x - radius : 0;
+		int x_end = x + radius < width ? x + radius + 1 : width;
+		long long count = (long long)window_rows * (x_end - x_start);
+		unsigned int sum = sums[x_end] - sums[x_start];
+		// pixel <= mean * (1 - BRADLEY_PERCENT / 100), in integers
+		int black = row[x] * count * 100 <= (long long)sum * (100 - BRADLEY_PERCENT);
+		out_row[x] = black ? BLACK_PIXEL : WHITE_PIXEL;
+		black_pixel_count += black;
+	}
+	return black_pixel_count;
+}
 
-	if (white_pixel_count > black_pixel_count) {
-		background_color = WHITE_PIXEL;
+// column_inverse[x] is 1 / the number of columns in the window of column x
+static int ThresholdRowSauvola(const unsigned char* row, int width, int radius, int window_rows, const unsigned int* sums,
+	const unsigned int* squares, const double* column_inverse, unsigned char* out_row) {
+	const double deviation_scale = SAUVOLA_K / SAUVOLA_R;
+	double row_inverse = 1.0 / window_rows;
+	int black_pixel_count = 0;
+	int x;
+	for (x = 0; x < width; x++) {
+		int x_start = x - radius > 0 ? x - radius : 0;
+		int x_end = x + radius < width ? x + radius + 1 : width;
+		double inverse = row_inverse * column_inverse[x];
+		double mean = (unsigned int)(sums[x_end] - sums[x_start]) * inverse;
+		double variance = (unsigned int)(squares[x_end] - squares[x_start]) * inverse - mean * mean;
+		// pixel < mean * (1 + k * (deviation / R - 1)), i.e. pixel - mean * (1 - k) < mean * k / R * deviation,
+		// compared squared to avoid the square root
+		double excess = row[x] - mean * (1 - SAUVOLA_K);
+		double scale = mean * deviation_scale;
+		int black = excess < 0 || excess * excess < scale * scale * variance;
+		out_row[x] = black ? BLACK_PIXEL : WHITE_PIXEL;
+		black_pixel_count += black;
 	}
-	else background_color = BLACK_PIXEL;
+	return black_pixel_count;
+}
+
+/*
+*	thresholds row y of a page of height rows, once the window holds the rows around it, writing
+*	BLACK_PIXEL / WHITE_PIXEL to out_row. returns the number of black pixels
+*/
+static int LocalWindow_Threshold(LocalWindow* window, const unsigned char* row, int y, int height, unsigned char* out_row) {
+	int radius = window->radius;
+	int width = window->width;
+	int window_rows = (y + radius < height ? y + radius : height - 1) - (y - radius > 0 ? y - radius : 0) + 1;
+	int x;
+	window->sums[0] = 0;
+	window->squares[0] = 0;
+	for (x = 0; x < width; x++) {
+		window->sums[x + 1] = window->sums[x] + window->column_sums[x];
+		window->squares[x + 1] = window->squares[x] + window->column_squares[x];
+	}
+
+	if (window->method == BINARIZE_BRADLEY) {
+		return ThresholdRowBradley(row, width, radius, window_rows, window->sums, out_row);
+	}
+	return ThresholdRowSauvola(row, width, radius, window_rows, window->sums, window->squares, window->column_inverse, out_row);
+}
+
+static void ThresholdBandWorker(void* arg) {
+	ThresholdBand* band = (ThresholdBand*)arg;
+	int height = band->height;
+	int width = band->width;
+	int radius = band->radius;
+	LocalWindow window;
+	LocalWindow_Init(&window, width, radius, band->method);
+	unsigned char* scratch = MemAllocate(sizeof(unsigned char) * width);		// thresholded row to pack
+	long black_pixel_count = 0;
+	int y;
+
+	int first = band->y_start - radius - 1 > 0 ? band->y_start - radius - 1 : 0;
+	int last = band->y_start + radius < height ? band->y_start + radius : height;
+	for (y = first; y < last; y++) {		// the window of the row above y_start
+		LocalWindow_Slide(&window, band->gray + (height - 1 - y) * width, NULL);
+	}
+
+	for (y = band->y_start; y < band->y_end; y++) {
+		const unsigned char* in = y + radius < height ? band->gray + (height - 1 - (y + radius)) * width : NULL;
+		const unsigned char* out = y - radius - 1 >= 0 ? band->gray + (height - 1 - (y - radius - 1)) * width : NULL;
+		LocalWindow_Slide(&window, in, out);
+
+		unsigned char* out_row = band->output ? band->output + y * width : scratch;
+		black_pixel_count += LocalWindow_Threshold(&window, band->gray + (height - 1 - y) * width, y, height, out_row);
+		if (band->output_bits) PackRow(scratch, width, BLACK_PIXEL, band->output_bits + y * band->words_per_row);
+	}
+	band->black_pixel_count = black_pixel_count;
+
+	LocalWindow_Free(&window);
+	FreeMemory(scratch);
+}
+
+// thresholds the gray rows (bottom-up) into doc with a local method, on row bands in parallel. returns the black pixel count
+static long ThresholdLocal(const unsigned char* gray, BinaryDocument* doc, BinarizeMethod method) {
+	int height = doc->height;
+	int width = doc->width;
+	int radius = LocalWindowRadius(height, width);
+
+	int thread_count = GetWorkerThreadCount();
+	if (thread_count > height / ADAPTIVE_MIN_BAND_ROWS) thread_count = height / ADAPTIVE_MIN_BAND_ROWS;
+	if (thread_count < 1) thread_count = 1;
+	ThresholdBand* bands = MemAllocate(sizeof(ThresholdBand) * thread_count);
+	int i;
+	for (i = 0; i < thread_count; i++) {
+		bands[i].gray = gray;
+		bands[i].height = height;
+		bands[i].width = width;
+		bands[i].method = method;
+		bands[i].radius = radius;
+		bands[i].output = doc->image;
+		bands[i].output_bits = doc->bits;
+		bands[i].words_per_row = doc->words_per_row;
+		bands[i].y_start = (int)((long long)height * i / thread_count);
+		bands[i].y_end = (int)((long long)height * (i + 1) / thread_count);
+		bands[i].black_pixel_count = 0;
+	}
+	RunParallel(ThresholdBandWorker, bands, sizeof(ThresholdBand), thread_count);
+
+	long black_pixel_count = 0;
+	for (i = 0; i < thread_count; i++) {
+		black_pixel_count += bands[i].black_pixel_count;
+	}
+	FreeMemory(bands);
+	return black_pixel_count;
+}
+
+/*
+*	Thresholds a gray image (rows bottom-up) into a new document: bytes, or when packed is set,
+*	the bit plane of a packed document. histograms holds the HISTOGRAM_COPIES histograms of the
+*	image, which only Otsu's method reads
+*/
+static BinaryDocument ThresholdGray(const unsigned char* gray, const int* histograms, int height, int width, BinarizeMethod method, int packed) {
+	int total_pixels = height * width;		// total number of pixels in the grayscale image
+	int histogram[256]; 					// histogram of the intensities of the pixels
+	int i, x, y;
 
 	//define output struct
 	BinaryDocument output_doc;
-	output_doc.background_color = background_color;
 	output_doc.height = height;
 	output_doc.width = width;
-	output_doc.image = output_image;
+	output_doc.image = NULL;
+	output_doc.bits = NULL;
+	output_doc.words_per_row = 0;
+	output_doc.glyphs = NULL;			// filled in by segmentation
+	output_doc.glyph_count = 0;
+	output_doc.rotation_deg = 0;
+	output_doc.rotation_cos = 1;
+	output_doc.rotation_sin = 0;
+	if (packed) {
+		output_doc.words_per_row = PACKED_WORDS(width);
+		output_doc.bits = (unsigned long long*)MemAllocate(sizeof(unsigned long long) * output_doc.words_per_row * (height > 0 ? height : 1));
+	}
+	else {
+		output_doc.image = MemAllocate(sizeof(unsigned char) * total_pixels);
+	}
+
+	if (method != BINARIZE_OTSU) {
+		long black_pixel_count = ThresholdLocal(gray, &output_doc, method);
+		output_doc.background_color = total_pixels - black_pixel_count > black_pixel_count ? WHITE_PIXEL : BLACK_PIXEL;
+
+		// the bits were set on black pixels, but they have to mark the foreground
+		if (packed && output_doc.background_color == BLACK_PIXEL) {
+			int words_per_row = output_doc.words_per_row;
+			unsigned long long last_mask = ~0ULL >> (words_per_row * PACKED_WORD_BITS - width);
+			for (y = 0; y < height; y++) {
+				unsigned long long* words = output_doc.bits + y * words_per_row;
+				for (i = 0; i < words_per_row; i++) {
+					words[i] = ~words[i];
+				}
+				words[words_per_row - 1] &= last_mask;
+			}
+		}
+		return output_doc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		histogram[i] = histograms[i] + histograms[256 + i] + histograms[512 + i] + histograms[768 + i];
+	}
+	int optimal_threshold = OtsuThreshold(histogram, total_pixels);
+
+	// set background color to the majority color count
+	int black_pixel_count = 0;				// count of black pixels in imgae
+	for (i = 0; i < optimal_threshold; i++) {
+		black_pixel_count += histogram[i];
+	}
+	int white_pixel_count = total_pixels - black_pixel_count;
+	int background_color;					// 0 for black, 1 for white background
+	if (white_pixel_count > black_pixel_count) {
+		background_color = WHITE_PIXEL;
+	}
+	else background_color = BLACK_PIXEL;
+	output_doc.background_color = background_color;
 
-	//free the grayscale image
-	FreeMemory(image);
+	//apply global threshold to the output image
+	if (packed) {
+		int words_per_row = output_doc.words_per_row;
+		unsigned char* scratch = MemAllocate(sizeof(unsigned char) * (width > 0 ? width : 1));		// thresholded row
+		for (y = 0; y < height; y++) {
+			const unsigned char* row = gray + (height - y - 1) * width;
+			for (x = 0; x < width; x++) {
+				scratch[x] = row[x] >= optimal_threshold ? WHITE_PIXEL : BLACK_PIXEL;
+			}
+			PackRow(scratch, width, !background_color, output_doc.bits + y * words_per_row);
+		}
+		FreeMemory(scratch);
+	}
+	else {
+		for (y = 0; y < height; y++) {
+			const unsigned char* row = gray + (height - y - 1) * width;
+			unsigned char* out_row = output_doc.image + y * width;
+			for (x = 0; x < width; x++) {
+				// white pixel (1 for binary image of 1 BPP) at or above the threshold, black (0) below
+				out_row[x] = row[x] >= optimal_threshold ? WHITE_PIXEL : BLACK_PIXEL;
+			}
+		}
+	}
 
 	return output_doc;
 }
 
+/*
+*	Binarizes the image in two passes over the page. The first converts each BGR row to
+*	grayscale in place, at the start of bmp_rgb (the rows stay bottom-up), and for Otsu's
+*	method builds the histogram as it goes. The second thresholds the gray rows top-down into
+*	the output: bytes, or when packed is set, the bit plane of a packed document. bmp_rgb is freed
+*/
+BinaryDocument BinarizeWithMethod(unsigned char* bmp_rgb, int height, int width, BinarizeMethod method, int packed) {
+	int histograms[HISTOGRAM_COPIES * 256];
+	int i, y;
+	for (i = 0; i < HISTOGRAM_COPIES * 256; i++) {		// set histogram arrays to zeros
+		histograms[i] = 0;
+	}
+
+	int stride = BmpRowStride(width);
+	unsigned char* gray = bmp_rgb;			// row y of the gray image overwrites the start of row y of bmp_rgb
+	GrayscaleKernel grayscale_row = SelectGrayscaleKernel();
+	for (y = 0; y < height; y++) {
+		grayscale_row(bmp_rgb + y * stride, width, gray + y * width);
+		if (method == BINARIZE_OTSU) AddRowHistogram(gray + y * width, width, histograms);		// while the row is still in cache
+	}
+
+	BinaryDocument output_doc = ThresholdGray(gray, histograms, height, width, method, packed);
+
+	//free the input image, which now holds the grayscale image
+	FreeMemory(bmp_rgb);
+
+	return output_doc;
+}
+
+BinaryDocument BinarizePixels(const unsigned char* bottom_row, long stride, int height, int width, BinarizeMethod method, int packed) {
+	int histograms[HISTOGRAM_COPIES * 256];
+	int i, y;
+	for (i = 0; i < HISTOGRAM_COPIES * 256; i++) {
+		histograms[i] = 0;
+	}
+
+	// the pixels are only read, so the gray image needs a buffer of its own (a third of the BGR image)
+	unsigned char* gray = MemAllocate(sizeof(unsigned char) * (height * width > 0 ? height * width : 1));
+	GrayscaleKernel grayscale_row = SelectGrayscaleKernel();
+	for (y = 0; y < height; y++) {
+		grayscale_row(bottom_row + y * stride, width, gray + y * width);
+		if (method == BINARIZE_OTSU) AddRowHistogram(gray + y * width, width, histograms);
+	}
+
+	BinaryDocument output_doc = ThresholdGray(gray, histograms, height, width, method, packed);
+	FreeMemory(gray);
+	return output_doc;
+}
+
+// Takes in a grayscale image and binarizes it (makes it black and white)
+// Uses Otsu's method, a global thresholding algorithm
+BinaryDocument Binarize(unsigned char* bmp_rgb, int height, int width) {
+	return BinarizeWithMethod(bmp_rgb, height, width, BINARIZE_OTSU, 0);
+}
+
+BinaryDocument BinarizePacked(unsigned char* bmp_rgb, int height, int width) {
+	return BinarizeWithMethod(bmp_rgb, height, width, BINARIZE_OTSU, 1);
+}
+
+/*
+*	Streaming binarization. The page is read from its file STREAM_STRIP_ROWS rows at a time,
+*	twice: the first pass only builds the histogram, which gives Otsu's threshold and the
+*	background color (for the local methods too, as there is no other way to know it before the
+*	last row), and the second converts and thresholds the rows in order from the top. a local
+*	threshold keeps the gray rows of the window of the current row in a ring, so memory is a
+*	strip, a window and a few rows whatever the size of the page.
+*/
+struct _BinarizeStream {
+	BMP* bmp;
+	BinaryDocument document;		// size and background color, no pixels
+	int threshold;					// Otsu's threshold
+	int row_size;					// bytes per row in the file
+	unsigned char* strip;			// file rows [strip_first, strip_first + strip_rows)
+	int strip_first;
+	int strip_rows;
+	GrayscaleKernel grayscale_row;
+	int next_row;					// page row NextRow() returns next
+	unsigned char* gray;			// gray row being thresholded (Otsu), or the ring of gray rows of a local window
+	int ring_rows;					// row y of the page is row y % ring_rows of the ring (0 for Otsu)
+	int ring_next;					// next page row to convert into the ring
+	LocalWindow window;
+	unsigned char* thresholded;		// thresholded row, to pack
+	unsigned long long* words;		// packed row handed out
+	int failed;						// set once a row could not be read
+};
+
+// reads file rows up to and including file_row into the strip, if it does not hold it. returns the row or NULL
+static const unsigned char* StreamFileRow(BinarizeStream* stream, int file_row) {
+	if (file_row < stream->strip_first || file_row >= stream->strip_first + stream->strip_rows) {
+		// rows are wanted from the top of the page, which is the end of the file
+		int first = file_row - STREAM_STRIP_ROWS + 1 > 0 ? file_row - STREAM_STRIP_ROWS + 1 : 0;
+		BMP_ReadRows(stream->bmp, first, file_row - first + 1, stream->strip);
+		if (BMP_GetError() != BMP_OK) return NULL;
+		stream->strip_first = first;
+		stream->strip_rows = file_row - first + 1;
+	}
+	return stream->strip + (file_row - stream->strip_first) * stream->row_size;
+}
+
+// converts page row y into the ring of gray rows. returns 0 if it could not be read
+static int StreamRingRow(BinarizeStream* stream, int y) {
+	const unsigned char* bgr = StreamFileRow(stream, stream->document.height - 1 - y);
+	if (!bgr) return 0;
+	stream->grayscale_row(bgr, stream->document.width, stream->gray + (y % stream->ring_rows) * stream->document.width);
+	return 1;
+}
+
+BinarizeStream* BinarizeStream_Open(const char* file_name, BinarizeMethod method) {
+	BMP* bmp = BMP_OpenFile(file_name);
+	if (bmp == NULL) return NULL;
+	if (BMP_GetDepth(bmp) != 24) {
+		BMP_Free(bmp);
+		return NULL;
+	}
+
+	BinarizeStream* stream = (BinarizeStream*)MemAllocate(sizeof(BinarizeStream));
+	int height = (int)BMP_GetHeight(bmp);
+	int width = (int)BMP_GetWidth(bmp);
+	int histograms[HISTOGRAM_COPIES * 256];
+	int histogram[256];
+	int i, y;
+	stream->bmp = bmp;
+	stream->row_size = (int)BMP_GetRowSize(bmp);
+	stream->strip = MemAllocate(sizeof(unsigned char) * stream->row_size * STREAM_STRIP_ROWS);
+	stream->strip_first = 0;
+	stream->strip_rows = 0;
+	stream->grayscale_row = SelectGrayscaleKernel();
+	stream->next_row = 0;
+	stream->ring_rows = 0;
+	stream->ring_next = 0;
+	stream->failed = 0;
+	stream->thresholded = MemAllocate(sizeof(unsigned char) * (width > 0 ? width : 1));
+	stream->words = MemAllocate(sizeof(unsigned long long) * (PACKED_WORDS(width) > 0 ? PACKED_WORDS(width) : 1));
+
+	// first pass: the histogram, a strip at a time in file order
+	for (i = 0; i < HISTOGRAM_COPIES * 256; i++) {
+		histograms[i] = 0;
+	}
+	int first;
+	for (first = 0; first < height; first += STREAM_STRIP_ROWS) {
+		int rows = height - first < STREAM_STRIP_ROWS ? height - first : STREAM_STRIP_ROWS;
+		BMP_ReadRows(bmp, first, rows, stream->strip);
+		if (BMP_GetError() != BMP_OK) {
+			stream->gray = NULL;
+			BinarizeStream_Close(stream);
+			return NULL;
+		}
+		for (y = 0; y < rows; y++) {
+			// the start of each strip row becomes its gray row, as in BinarizeWithMethod()
+			unsigned char* row = stream->strip + y * stream->row_size;
+			stream->grayscale_row(row, width, row);
+			AddRowHistogram(row, width, histograms);
+		}
+	}
+	for (i = 0; i < 256; i++) {
+		histogram[i] = histograms[i] + histograms[256 + i] + histograms[512 + i] + histograms[768 + i];
+	}
+	stream->threshold = OtsuThreshold(histogram, height * width);
+	int black_pixel_count = 0;
+	for (i = 0; i < stream->threshold; i++) {
+		black_pixel_count += histogram[i];
+	}
+
+	BinaryDocument* document = &stream->document;
+	document->background_color = height * width - black_pixel_count > black_pixel_count ? WHITE_PIXEL : BLACK_PIXEL;
+	document->height = height;
+	document->width = width;
+	document->image = NULL;
+	document->bits = NULL;
+	document->words_per_row = 0;
+	document->glyphs = NULL;
+	document->glyph_count = 0;
+	document->rotation_deg = 0;
+	document->rotation_cos = 1;
+	document->rotation_sin = 0;
+
+	if (method == BINARIZE_OTSU) {
+		stream->gray = MemAllocate(sizeof(unsigned char) * (width > 0 ? width : 1));
+		return stream;
+	}
+
+	// second pass, local threshold: the window of the row above the first one
+	int radius = LocalWindowRadius(height, width);
+	LocalWindow_Init(&stream->window, width, radius, method);
+	stream->ring_rows = 2 * radius + 2;		// rows y - radius - 1 (leaving the window) to y + radius (entering it)
+	stream->gray = MemAllocate(sizeof(unsigned char) * stream->ring_rows * (width > 0 ? width : 1));
+	for (y = 0; y < radius && y < height; y++) {
+		if (!StreamRingRow(stream, y)) {
+			BinarizeStream_Close(stream);
+			return NULL;
+		}
+		LocalWindow_Slide(&stream->window, stream->gray + (y % stream->ring_rows) * width, NULL);
+	}
+	stream->ring_next = y;
+	return stream;
+}
+
+const BinaryDocument* BinarizeStream_Document(const BinarizeStream* stream) {
+	return &stream->document;
+}
+
+const unsigned long long* BinarizeStream_NextRow(BinarizeStream* stream) {
+	int height = stream->document.height;
+	int width = stream->document.width;
+	int y = stream->next_row;
+	int x;
+	if (y >= height) return NULL;
+
+	if (stream->ring_rows == 0) {
+		const unsigned char* bgr = StreamFileRow(stream, height - 1 - y);
+		if (!bgr) {
+			stream->failed = 1;
+			return NULL;
+		}
+		stream->grayscale_row(bgr, width, stream->gray);
+		for (x = 0; x < width; x++) {
+			stream->thresholded[x] = stream->gray[x] >= stream->threshold ? WHITE_PIXEL : BLACK_PIXEL;
+		}
+	}
+	else {
+		int radius = stream->window.radius;
+		const unsigned char* in = NULL;
+		const unsigned char* out = NULL;
+		if (y + radius < height) {
+			if (!StreamRingRow(stream, y + radius)) {
+				stream->failed = 1;
+				return NULL;
+			}
+			in = stream->gray + ((y + radius) % stream->ring_rows) * width;
+		}
+		if (y - radius - 1 >= 0) out = stream->gray + ((y - radius - 1) % stream->ring_rows) * width;
+		LocalWindow_Slide(&stream->window, in, out);
+		LocalWindow_Threshold(&stream->window, stream->gray + (y % stream->ring_rows) * width, y, height, stream->thresholded);
+	}
+
+	PackRow(stream->thresholded, width, !stream->document.background_color, stream->words);
+	stream->next_row++;
+	return stream->words;
+}
+
+int BinarizeStream_Failed(const BinarizeStream* stream) {
+	return stream->failed;
+}
+
+void BinarizeStream_Close(BinarizeStream* stream) {
+	if (!stream) return;
+	if (stream->ring_rows) LocalWindow_Free(&stream->window);
+	BMP_Free(stream->bmp);
+	FreeMemory(stream->strip);
+	FreeMemory(stream->gray);
+	FreeMemory(stream->thresholded);
+	FreeMemory(stream->words);
+	FreeMemory(stream);
+}
+
+/*
+*	Rotation engine. Rotate() gives exactly the result of RotateReference(): every destination
+*	pixel (x, y) is taken from the source pixel
+*		og_x = x_center + (int)(-x_dif * cos - y_dif * sin)
+*		og_y = y_center + (int)(-y_dif * cos + x_dif * sin)
+*	but the coordinates are stepped along each row in 32.32 fixed point instead of being
+*	recomputed in floating point. Where a stepped coordinate comes within ROTATE_EXACT_MARGIN
+*	of an integer, truncation could go either way, so that pixel is recomputed with the
+*	reference expression.
+*	The destination is processed in ROTATE_TILE square tiles, so the source pixels read for
+*	a tile (a rotated square) stay in cache, and in bands of rows, one per worker thread.
+*	For angles up to ROTATE_SHEAR_MAX_DEG each row instead splits into runs over which both
+*	og_y and og_x - x are constant, i.e. the rotation is a vertical shear of horizontal runs
+*	followed by a horizontal shift, and every run is a straight copy from one source row. The
+*	ends of each run are found with the reference expression, which is monotonic in x, so
+*	the runs are exact too.
+*/
+#define ROTATE_TILE 64
+#define ROTATE_BLOCK 16				// size of the source blocks whose foreground is tracked
+#define ROTATE_SHEAR_MAX_DEG 2.0
+#define FIXED_ONE 4294967296.0				// 1.0 in 32.32 fixed point
+#define ROTATE_EXACT_MARGIN (1LL << 12)		// 2^-20 in 32.32 fixed point
+
+typedef struct {
+	const unsigned char* source;
+	const unsigned long long* source_bits;	// packed source, read instead of source when set
+	int words_per_row;
+	unsigned char* output;
+	unsigned long long* output_bits;		// packed output, written instead of output when set
+	int width, height;
+	int x_center, y_center;
+	double cos_val, sin_val;
+	int fg_color;
+	int background_color;
+	int shear_runs;					// 1 to rotate rows as shear runs (small angles), 0 to step every pixel
+	const unsigned char* occupied;	// 1 for each ROTATE_BLOCK square source block with a foreground pixel
+	int block_columns;				// (NULL to rotate whole rows instead of tiles)
+	int y_start, y_end;				// band of destination rows [y_start, y_end)
+} RotateBand;
+
+// source pixel of destination pixel (x, y), computed exactly as RotateReference() does
+static void RotateSourcePixel(const RotateBand* band, int x, int y, int* og_x, int* og_y) {
+	int x_dif = band->x_center - x;
+	int y_dif = band->y_center - y;
+	double cos_val = band->cos_val;
+	double sin_val = band->sin_val;
+	*og_x = band->x_center + (int)(-x_dif * cos_val - y_dif * sin_val);
+	*og_y = band->y_center + (int)(-y_dif * cos_val + x_dif * sin_val);
+}
+
+static long long ToFixed(double value) {
+	return (long long)floor(value * FIXED_ONE + 0.5);
+}
+
+// 1 if the value is too close to an integer for its truncation to be trusted. the distance
+// to the nearest integer is the same for value and -value, so no sign test is needed
+static int NearInteger(long long value) {
+	return (((unsigned long long)value + ROTATE_EXACT_MARGIN) & 0xffffffffULL) < 2 * ROTATE_EXACT_MARGIN;
+}
+
+// truncates a 32.32 value toward zero, as a cast from double to int does. only valid for
+// values that are not integers: the truncation of a negative one is its floor plus one
+static int TruncateFixed(long long value) {
+	return (int)(value >> 32) + (value < 0);
+}
+
+// flags the ROTATE_BLOCK square blocks of the image that may contain a foreground pixel.
+// rows are compared against the background 8 pixels at a time, so a flag can be set
+// by any pixel that is not background, which only costs a tile that could have been skipped
+static unsigned char* FindOccupiedBlocks(const BinaryDocument* bd, int* block_columns) {
+	int width = bd->width;
+	int columns = (width + ROTATE_BLOCK - 1) / ROTATE_BLOCK;
+	int rows = (bd->height + ROTATE_BLOCK - 1) / ROTATE_BLOCK;
+	unsigned char* occupied = (unsigned char*)calloc(columns * rows > 0 ? columns * rows : 1, 1);
+	unsigned long long background = 0x0101010101010101ULL * (unsigned char)bd->background_color;
+	int x, y, i;
+	for (y = 0; y < bd->height; y++) {
+		const unsigned char* row = bd->image + y * width;
+		unsigned char* flags = occupied + (y / ROTATE_BLOCK) * columns;
+		for (x = 0; x + ROTATE_BLOCK <= width; x += ROTATE_BLOCK) {
+			unsigned long long words[ROTATE_BLOCK / 8];
+			unsigned long long differs = 0;
+			memcpy(words, row + x, ROTATE_BLOCK);
+			for (i = 0; i < ROTATE_BLOCK / 8; i++) {
+				differs |= words[i] ^ background;
+			}
+			flags[x / ROTATE_BLOCK] |= differs != 0;
+		}
+		for (; x < width; x++) {		// partial block at the end of the row
+			flags[x / ROTATE_BLOCK] |= row[x] != bd->background_color;
+		}
+	}
+	*block_columns = columns;
+	return occupied;
+}
+
+// 1 if any source pixel of the destination tile could be foreground. the mapping is affine, so
+// the tile's source pixels lie in the box around its four mapped corners (plus one for truncation)
+static int TileHasForeground(const RotateBand* band, int tile_x, int tile_y, int tile_x_end, int tile_y_end) {
+	int corners_x[4] = { tile_x, tile_x_end - 1, tile_x, tile_x_end - 1 };
+	int corners_y[4] = { tile_y, tile_y, tile_y_end - 1, tile_y_end - 1 };
+	int min_x = band->width, max_x = -1, min_y = band->height, max_y = -1;
+	int i, bx, by;
+	for (i = 0; i < 4; i++) {
+		int og_x, og_y;
+		RotateSourcePixel(band, corners_x[i], corners_y[i], &og_x, &og_y);
+		if (og_x < min_x) min_x = og_x;
+		if (og_x > max_x) max_x = og_x;
+		if (og_y < min_y) min_y = og_y;
+		if (og_y > max_y) max_y = og_y;
+	}
+	min_x = min_x - 1 > 0 ? min_x - 1 : 0;
+	min_y = min_y - 1 > 0 ? min_y - 1 : 0;
+	max_x = max_x + 1 < band->width - 1 ? max_x + 1 : band->width - 1;
+	max_y = max_y + 1 < band->height - 1 ? max_y + 1 : band->height - 1;
+	for (by = min_y / ROTATE_BLOCK; by <= max_y / ROTATE_BLOCK; by++) {
+		for (bx = min_x / ROTATE_BLOCK; bx <= max_x / ROTATE_BLOCK; bx++) {
+			if (band->occupied[bx + by * band->block_columns]) return 1;
+		}
+	}
+	return 0;
+}
+
+// maps destination pixels [x_start, x_end) of row y onto out_row, stepping the source coordinates
+// in fixed point. only foreground is written: out_row must already hold the background
+static void RotateRowSpan(const RotateBand* band, int y, int x_start, int x_end, unsigned char* out_row) {
+	// everything the inner loop reads is copied to locals: the byte stores to the output may
+	// alias the band, which would otherwise force a reload of each member after every store
+	const unsigned char* source = band->source;
+	const unsigned long long* source_bits = band->source_bits;
+	int words_per_row = band->words_per_row;
+	int width = band->width;
+	int height = band->height;
+	int x_center = band->x_center;
+	int y_center = band->y_center;
+	double cos_val = band->cos_val;
+	double sin_val = band->sin_val;
+	unsigned char fg_color = (unsigned char)band->fg_color;
+	long long step_x = ToFixed(cos_val);			// change of the source coordinates per destination column
+	long long step_y = -ToFixed(sin_val);
+
+	int x_dif = x_center - x_start;
+	int y_dif = y_center - y;
+	long long fixed_x = ToFixed(-x_dif * cos_val - y_dif * sin_val);
+	long long fixed_y = ToFixed(-y_dif * cos_val + x_dif * sin_val);
+	int x;
+	for (x = x_start; x < x_end; x++, fixed_x += step_x, fixed_y += step_y) {
+		int og_x, og_y;
+		if (NearInteger(fixed_x) | NearInteger(fixed_y)) {
+			RotateSourcePixel(band, x, y, &og_x, &og_y);
+		}
+		else {
+			og_x = x_center + TruncateFixed(fixed_x);
+			og_y = y_center + TruncateFixed(fixed_y);
+		}
+		if ((unsigned)og_x < (unsigned)width && (unsigned)og_y < (unsigned)height) {
+			int foreground = source_bits
+				? (int)(source_bits[og_y * words_per_row + og_x / PACKED_WORD_BITS] >> (og_x % PACKED_WORD_BITS)) & 1
+				: source[og_x + og_y * width] == fg_color;
+			if (foreground) out_row[x] = fg_color;
+		}
+	}
+}
+
+// rotates the rows of one band tile by tile. tiles that only map onto background are left as they are
+static void RotateTiles(const RotateBand* band) {
+	unsigned char* output = band->output;
+	int width = band->width;
+	int tile_x, tile_y, y;
+	for (tile_y = band->y_start; tile_y < band->y_end; tile_y += ROTATE_TILE) {
+		int tile_y_end = tile_y + ROTATE_TILE < band->y_end ? tile_y + ROTATE_TILE : band->y_end;
+		for (tile_x = 0; tile_x < width; tile_x += ROTATE_TILE) {
+			int tile_x_end = tile_x + ROTATE_TILE < width ? tile_x + ROTATE_TILE : width;
+			if (!TileHasForeground(band, tile_x, tile_y, tile_x_end, tile_y_end)) continue;
+			for (y = tile_y; y < tile_y_end; y++) {
+				RotateRowSpan(band, y, tile_x, tile_x_end, output + y * width);
+			}
+		}
+	}
+}
+
+// 1 if destination pixel x of row y has the source row og_y and the column offset shift
+static int InRotateRun(const RotateBand* band, int x, int y, int shift, int og_y) {
+	int run_x, run_y;
+	RotateSourcePixel(band, x, y, &run_x, &run_y);
+	return run_x - x == shift && run_y == og_y;
+}
+
+// number of steps of size step (nonzero, inverse_step = 1 / step) from value until its integer part changes
+static double StepsToNextInteger(double value, double step, double inverse_step) {
+	double boundary = step > 0 ? floor(value) + 1 : ceil(value) - 1;
+	return (boundary - value) * inverse_step;
+}
+
+// rotates row y as runs copied from single source rows (small angles only). out_row must
+// already hold the background
+static void RotateShearRow(const RotateBand* band, int y, unsigned char* out_row) {
+	int width = band->width;
+	int height = band->height;
+	int fg_color = band->fg_color;
+	int background_color = band->background_color;
+	double cos_val = band->cos_val;
+	double sin_val = band->sin_val;
+	double inverse_step_x = 1.0 / (cos_val - 1.0);		// cos_val < 1 and sin_val != 0, since Rotate() skips tiny angles
+	double inverse_step_y = -1.0 / sin_val;
+
+	int x, i;
+	int og_x, og_y;
+	RotateSourcePixel(band, 0, y, &og_x, &og_y);
+	x = 0;
+	while (x < width) {
+		int shift = og_x - x;
+
+		// predict where the run ends from the real valued coordinates, then pin the end
+		// down with the exact expression: lo is the last pixel known to be in the run
+		// and hi the first known not to be
+		int x_dif = band->x_center - x;
+		int y_dif = band->y_center - y;
+		double real_x = -x_dif * cos_val - y_dif * sin_val - x;
+		double real_y = -y_dif * cos_val + x_dif * sin_val;
+		double predicted = StepsToNextInteger(real_x, cos_val - 1.0, inverse_step_x);
+		double steps_y = StepsToNextInteger(real_y, -sin_val, inverse_step_y);
+		if (steps_y < predicted) predicted = steps_y;
+
+		int lo = x;
+		int hi = width;
+		int probe = predicted < width ? x + (int)ceil(predicted) - 1 : width - 1;
+		if (probe > lo && probe < hi) {
+			if (InRotateRun(band, probe, y, shift, og_y)) lo = probe;
+			else hi = probe;
+		}
+		if (lo + 1 < hi) {
+			if (InRotateRun(band, lo + 1, y, shift, og_y)) lo = lo + 1;
+			else hi = lo + 1;
+		}
+		while (hi - lo > 1) {
+			int mid = lo + (hi - lo) / 2;
+			if (InRotateRun(band, mid, y, shift, og_y)) lo = mid;
+			else hi = mid;
+		}
+
+		// copy the part of the run whose source pixels are inside the image
+		if (og_y >= 0 && og_y <= height - 1) {
+			int start = x + shift < 0 ? -shift : x;
+			int end = lo + shift > width - 1 ? width - 1 - shift : lo;
+			if (band->source_bits) {
+				const unsigned long long* source_words = band->source_bits + og_y * band->words_per_row;
+				for (i = start; i <= end; i++) {
+					int source_x = i + shift;
+					out_row[i] = (source_words[source_x / PACKED_WORD_BITS] >> (source_x % PACKED_WORD_BITS)) & 1 ? fg_color : background_color;
+				}
+			}
+			else {
+				const unsigned char* source_row = band->source + og_y * width + shift;
+				for (i = start; i <= end; i++) {
+					out_row[i] = source_row[i] == fg_color ? fg_color : background_color;
+				}
+			}
+		}
+		x = lo + 1;
+		if (x < width) RotateSourcePixel(band, x, y, &og_x, &og_y);
+	}
+}
+
+// 1 if a rotation by angle_rad is done as shear runs rather than tiles
+static int UseShearRuns(double angle_rad) {
+	return fabs(sin(angle_rad)) <= sin(ROTATE_SHEAR_MAX_DEG * PI / 180.0) && cos(angle_rad) > 0;
+}
+
+// rotates row y into out_row (width pixels), background included
+static void RotateRow(const RotateBand* band, int y, unsigned char* out_row) {
+	memset(out_row, band->background_color, band->width);
+	if (band->shear_runs) {
+		RotateShearRow(band, y, out_row);
+	}
+	else {
+		RotateRowSpan(band, y, 0, band->width, out_row);
+	}
+}
+
+// sets up the rotation of bd by angle_rad (with no output, tiles or rows yet)
+static void InitRotateBand(RotateBand* band, const BinaryDocument* bd, double angle_rad) {
+	band->source = bd->image;
+	band->source_bits = bd->bits;
+	band->words_per_row = bd->words_per_row;
+	band->output = NULL;
+	band->output_bits = NULL;
+	band->width = bd->width;
+	band->height = bd->height;
+	band->x_center = bd->width / 2;
+	band->y_center = bd->height / 2;
+	band->cos_val = cos(angle_rad);
+	band->sin_val = sin(angle_rad);
+	band->fg_color = !bd->background_color;
+	band->background_color = bd->background_color;
+	band->shear_runs = UseShearRuns(angle_rad);
+	band->occupied = NULL;
+	band->block_columns = 0;
+	band->y_start = 0;
+	band->y_end = bd->height;
+}
+
+static void RotateBandWorker(void* arg) {
+	RotateBand* band = (RotateBand*)arg;
+	int y;
+	if (band->output_bits) {		// packed image: rotate one row at a time and pack it
+		unsigned char* row = MemAllocate(sizeof(unsigned char) * (band->width > 0 ? band->width : 1));
+		for (y = band->y_start; y < band->y_end; y++) {
+			RotateRow(band, y, row);
+			PackRow(row, band->width, band->fg_color, band->output_bits + (size_t)y * band->words_per_row);
+		}
+		FreeMemory(row);
+		return;
+	}
+
+	if (!band->occupied) {
+		for (y = band->y_start; y < band->y_end; y++) {
+			RotateRow(band, y, band->output + y * band->width);
+		}
+	}
+	else {
+		// fill the band with the background color
+		memset(band->output + band->y_start * band->width, band->background_color, (size_t)(band->y_end - band->y_start) * band->width);
+		RotateTiles(band);
+	}
+}
+
 /************************************************************
 *	-BINARYROTATE-
+*	Rotates the image counterclockwise at an angle specified as an input, with the same
+*	nearest neighbor result as RotateReference() (see the rotation engine above).
+*	Like the reference, it maps every DESTINATION pixel back to the SOURCE image,
+*	so the result has no gaps due to aliasing
+*	binary_doc: pointer to BinaryDocument object to modify
+*	angle_deg: rotation angle in degrees
+*************************************************************/
+void Rotate(BinaryDocument* bd, double angle_deg) {
+	BinaryDocument_Materialize(bd);		// rotations only compose on a real image
+
+	//for very small rotation angles, no need to modify image
+	if (fabs(angle_deg) < 0.1) {
+		return;
+	}
+
+	double angle_rad = angle_deg * PI / 180.0;
+	int height = bd->height;
+	unsigned char* output_image = NULL;
+	unsigned long long* output_bits = NULL;
+	if (bd->bits) {
+		output_bits = MemAllocate(sizeof(unsigned long long) * (bd->words_per_row * height > 0 ? bd->words_per_row * height : 1));
+	}
+	else {
+		output_image = MemAllocate(sizeof(unsigned char) * bd->width * height);
+	}
+
+	// a band per processor at most: more bands than processors only add thread startup to a
+	// pass that is bound by memory bandwidth
+	int thread_count = GetWorkerThreadCount();
+	if (thread_count > GetProcessorCount()) thread_count = GetProcessorCount();
+	if (thread_count > height / ROTATE_TILE) thread_count = height / ROTATE_TILE;
+	if (thread_count < 1) thread_count = 1;
+	// small angles are copied as runs; otherwise the tiles need to know where the foreground is.
+	// a packed image is rotated a row at a time
+	RotateBand rotation;
+	InitRotateBand(&rotation, bd, angle_rad);
+	unsigned char* occupied = NULL;
+	if (!rotation.shear_runs && !bd->bits) {
+		occupied = FindOccupiedBlocks(bd, &rotation.block_columns);
+	}
+	rotation.occupied = occupied;
+	rotation.output = output_image;
+	rotation.output_bits = output_bits;
+
+	RotateBand* bands = MemAllocate(sizeof(RotateBand) * thread_count);
+	int i;
+	for (i = 0; i < thread_count; i++) {
+		bands[i] = rotation;
+		bands[i].y_start = (int)((long long)height * i / thread_count);
+		bands[i].y_end = (int)((long long)height * (i + 1) / thread_count);
+	}
+	RunParallel(RotateBandWorker, bands, sizeof(RotateBand), thread_count);
+	FreeMemory(bands);
+	free(occupied);
+
+	//set new image and deallocate original image
+	if (bd->bits) {
+		FreeMemory(bd->bits);
+		bd->bits = output_bits;
+	}
+	else {
+		FreeMemory(bd->image);
+		bd->image = output_image;
+	}
+}
+
+/*
+*	band of a grayscale rotation, run on its own thread by RotateGrayscale().
+*	bilinear sampling steps the real valued source coordinates in 16.16 fixed point and
+*	treats pixels outside the image as background
+*/
+typedef struct {
+	const unsigned char* source;
+	unsigned char* output;
+	int width, height;
+	double cos_val, sin_val;
+	unsigned char background;
+	int bilinear;
+	int y_start, y_end;
+} GrayRotateBand;
+
+static void RotateGrayscaleBand(void* arg) {
+	GrayRotateBand* band = (GrayRotateBand*)arg;
+	const unsigned char* source = band->source;
+	int width = band->width;
+	int height = band->height;
+	int x_center = width / 2;
+	int y_center = height / 2;
+	int x, y;
+
+	if (!band->bilinear) {		// nearest neighbor, with the same mapping as Rotate()
+		RotateBand mapping;		// only the members RotateSourcePixel() reads
+		mapping.x_center = x_center;
+		mapping.y_center = y_center;
+		mapping.cos_val = band->cos_val;
+		mapping.sin_val = band->sin_val;
+		for (y = band->y_start; y < band->y_end; y++) {
+			for (x = 0; x < width; x++) {
+				int og_x, og_y;
+				RotateSourcePixel(&mapping, x, y, &og_x, &og_y);
+				band->output[x + y * width] = (og_x < 0 || og_x > width - 1 || og_y < 0 || og_y > height - 1)
+					? band->background : source[og_x + og_y * width];
+			}
+		}
+		return;
+	}
+
+	int step_x = (int)floor(band->cos_val * 65536.0 + 0.5);
+	int step_y = (int)floor(-band->sin_val * 65536.0 + 0.5);
+	for (y = band->y_start; y < band->y_end; y++) {
+		unsigned char* out_row = band->output + y * width;
+		int x_dif = x_center;
+		int y_dif = y_center - y;
+		// source position of the first pixel of the row, in 16.16 fixed point
+		int fixed_x = (int)floor((x_center - x_dif * band->cos_val - y_dif * band->sin_val) * 65536.0 + 0.5);
+		int fixed_y = (int)floor((y_center - y_dif * band->cos_val + x_dif * band->sin_val) * 65536.0 + 0.5);
+		for (x = 0; x < width; x++, fixed_x += step_x, fixed_y += step_y) {
+			int x0 = fixed_x >> 16;			// arithmetic shift: floor, also for negative positions
+			int y0 = fixed_y >> 16;
+			if (x0 < -1 || x0 > width - 1 || y0 < -1 || y0 > height - 1) {
+				out_row[x] = band->background;
+				continue;
+			}
+			int fx = (fixed_x & 0xffff) >> 8;		// 8-bit interpolation weights
+			int fy = (fixed_y & 0xffff) >> 8;
+			int p00 = (x0 >= 0 && y0 >= 0) ? source[x0 + y0 * width] : band->background;
+			int p10 = (x0 + 1 < width && y0 >= 0) ? source[x0 + 1 + y0 * width] : band->background;
+			int p01 = (x0 >= 0 && y0 + 1 < height) ? source[x0 + (y0 + 1) * width] : band->background;
+			int p11 = (x0 + 1 < width && y0 + 1 < height) ? source[x0 + 1 + (y0 + 1) * width] : band->background;
+			int top = p00 * (256 - fx) + p10 * fx;
+			int bottom = p01 * (256 - fx) + p11 * fx;
+			out_row[x] = (unsigned char)((top * (256 - fy) + bottom * fy + (1 << 15)) >> 16);
+		}
+	}
+}
+
+unsigned char* RotateGrayscale(const unsigned char* image, int height, int width, double angle_deg, unsigned char background, int bilinear) {
+	double angle_rad = angle_deg * PI / 180.0;
+	unsigned char* output_image = MemAllocate(sizeof(unsigned char) * width * height);
+
+	int thread_count = GetWorkerThreadCount();
+	if (thread_count > GetProcessorCount()) thread_count = GetProcessorCount();		// as in Rotate()
+	if (thread_count > height / ROTATE_TILE) thread_count = height / ROTATE_TILE;
+	if (thread_count < 1) thread_count = 1;
+	GrayRotateBand* bands = MemAllocate(sizeof(GrayRotateBand) * thread_count);
+	int i;
+	for (i = 0; i < thread_count; i++) {
+		bands[i].source = image;
+		bands[i].output = output_image;
+		bands[i].width = width;
+		bands[i].height = height;
+		bands[i].cos_val = cos(angle_rad);
+		bands[i].sin_val = sin(angle_rad);
+		bands[i].background = background;
+		bands[i].bilinear = bilinear;
+		bands[i].y_start = (int)((long long)height * i / thread_count);
+		bands[i].y_end = (int)((long long)height * (i + 1) / thread_count);
+	}
+	RunParallel(RotateGrayscaleBand, bands, sizeof(GrayRotateBand), thread_count);
+	FreeMemory(bands);
+	return output_image;
+}
+
+/************************************************************
+*	-BINARYROTATE- (reference)
+*	Original per-pixel implementation, kept as the reference the tiled engine in
+*	Rotate() is checked against.
 *	This algorithm rotates the image counterclockwise at an angle (radians) specified as an input.
 *	It iterates through the DESTINATION image and computes the inverse rotation for each index to find
 *	the corresponding index at the SOURCE image.
@@ -170,7 +1274,7 @@ BinaryDocument Binarize(unsigned char* bmp_rgb, int height, int width) {
 *	binary_doc: pointer to BinaryDocument object to modify
 *	angle_deg: rotation angle in degrees
 *************************************************************/
-void Rotate(BinaryDocument* bd, double angle_deg) {
+void RotateReference(BinaryDocument* bd, double angle_deg) {
 	//for very small rotation angles, no need to modify image
 	if (fabs(angle_deg) < 0.1) {
 		return;
@@ -242,48 +1346,192 @@ void WriteToFile(char* file_path, unsigned char* image, int height, int width) {
 *	rotates the image to "fix" the skew
 *	bd: pointer to a BinaryDocument object
 **************************************************************/
-void Deskew(BinaryDocument* bd) {
-	int max_theta_deg = 90 + MAX_SKEW_ANGLE_DEG;
-	int min_theta_deg = 90 - MAX_SKEW_ANGLE_DEG;
-	int height = bd->height;
-	unsigned char* og_image = bd->image;							// original image
-	int width = bd->width;
-	int fg_color = !bd->background_color;							// foreground color
-	int max_r = sqrt(pow(bd->height, 2) + pow(bd->width, 2));		// maximum possible value of r
-	int r_bin_count = MAX_R_BINS;
-	double r_delta = 2.0 * (double)max_r / r_bin_count;				// bin size for r
-	int theta_bin_count = 2 * MAX_SKEW_ANGLE_DEG / THETA_DELTA_DEG + 1;	// number of bins for the theta dimension
+/*
+*	Hough accumulation over one band of rows, run on its own thread by HoughTransform().
+*	Each band votes into a private histogram, so the threads never share a counter.
+*/
+typedef struct {
+	const unsigned long long* bits;	// packed image (see BinaryDocument)
+	int words_per_row;
+	int edges_only;					// only foreground pixels whose neighbour in the previous row is background vote
+	int y_start, y_end;				// band of rows [y_start, y_end)
+	const double* cos_table;		// cos and sin of each theta bin
+	const double* sin_table;
+	int theta_bin_count;
+	double r_delta;
+	int r_bin_count;
+	int* votes;						// r_bin_count * theta_bin_count histogram of this band
+} HoughBand;
 
-	int* hough_votes = (int)calloc(r_bin_count * theta_bin_count, sizeof(int));	// stores votes for the Hough transform
+static void AccumulateHoughVotes(void* arg) {
+	HoughBand* band = (HoughBand*)arg;
+	int words_per_row = band->words_per_row;
+	int theta_bin_count = band->theta_bin_count;
+	int r_bin_count = band->r_bin_count;
+	double r_delta = band->r_delta;
+	double* row_offsets = MemAllocate(sizeof(double) * theta_bin_count);		// y * sin(theta) for the current row
 
-																				// iterate through image, transforming all foreground pixels into their huff version
-	int x, y;
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			int pix_index = x + y * width;				// 1D index of the pixel
-			if (og_image[pix_index] == fg_color) {		// check for a foreground pixel
-				int theta_index;						// index for theta in the vote matrix
+	int w, y, theta_index;
+	for (y = band->y_start; y < band->y_end; y++) {
+		const unsigned long long* row = band->bits + (size_t)y * words_per_row;
+		const unsigned long long* previous_row = y > 0 ? row - words_per_row : NULL;
+		for (theta_index = 0; theta_index < theta_bin_count; theta_index++) {
+			row_offsets[theta_index] = y * band->sin_table[theta_index];
+		}
+		for (w = 0; w < words_per_row; w++) {
+			unsigned long long voters = row[w];		// only foreground pixels vote
+			if (band->edges_only && previous_row) voters &= ~previous_row[w];
+			while (voters) {
+				int x = w * PACKED_WORD_BITS + LowestSetBit64(voters);
+				voters &= voters - 1;
 				for (theta_index = 0; theta_index < theta_bin_count; theta_index++) {
-					double theta_deg = (theta_index - theta_bin_count / 2) * THETA_DELTA_DEG + 90;		// sweeps from 90-SKEW_MAX to 90+SKEW_MAX
-					double r = x * cos(theta_deg * PI / 180.0) + y * sin(theta_deg * PI / 180.0);
+					double r = x * band->cos_table[theta_index] + row_offsets[theta_index];
 					int r_index = (int)floor(r / r_delta) + r_bin_count / 2;	// index for the r dimension of the histogram
-
-																				//update vote count
-					hough_votes[theta_index + r_index * theta_bin_count]++;
+					if ((unsigned)r_index < (unsigned)r_bin_count) {
+						band->votes[theta_index + r_index * theta_bin_count]++;
+					}
 				}
 			}
 		}
 	}
+	FreeMemory(row_offsets);
+}
+
+// fills the cos and sin tables of count theta bins step_deg apart, centered on center_deg
+static void FillThetaTables(double center_deg, double step_deg, int count, double* cos_table, double* sin_table) {
+	int theta_index;
+	for (theta_index = 0; theta_index < count; theta_index++) {
+		double theta_deg = (theta_index - count / 2) * step_deg + center_deg;
+		cos_table[theta_index] = cos(theta_deg * PI / 180.0);
+		sin_table[theta_index] = sin(theta_deg * PI / 180.0);
+	}
+}
+
+/*
+*	Hough transform of the foreground pixels of the packed image bits (or only the top edge
+*	pixel of each vertical run when edges_only is set), enumerated a word at a time, for the theta bins in cos_table/sin_table.
+*	Returns a calloc'd histogram of r_bin_count r bins (of width r_delta, centered on r = 0)
+*	for each theta bin, indexed [theta + r * theta_bin_count].
+*	Rows are split into one band per worker thread. every band has its own histogram, and the
+*	histograms are summed afterwards, so the votes are the same for any thread count.
+*/
+static int* HoughTransform(const unsigned long long* bits, int words_per_row, int height, int edges_only,
+	const double* cos_table, const double* sin_table, int theta_bin_count, double r_delta, int r_bin_count) {
+	int vote_count = r_bin_count * theta_bin_count;
+	int thread_count = GetWorkerThreadCount();
+	if (thread_count > height / HOUGH_MIN_BAND_ROWS) thread_count = height / HOUGH_MIN_BAND_ROWS;
+	if (thread_count < 1) thread_count = 1;
+
+	HoughBand* bands = MemAllocate(sizeof(HoughBand) * thread_count);
+	int i, j;
+	for (i = 0; i < thread_count; i++) {
+		bands[i].bits = bits;
+		bands[i].words_per_row = words_per_row;
+		bands[i].edges_only = edges_only;
+		bands[i].y_start = (int)((long long)height * i / thread_count);
+		bands[i].y_end = (int)((long long)height * (i + 1) / thread_count);
+		bands[i].cos_table = cos_table;
+		bands[i].sin_table = sin_table;
+		bands[i].theta_bin_count = theta_bin_count;
+		bands[i].r_delta = r_delta;
+		bands[i].r_bin_count = r_bin_count;
+		bands[i].votes = (int*)calloc(vote_count, sizeof(int));
+	}
+	RunParallel(AccumulateHoughVotes, bands, sizeof(HoughBand), thread_count);
+
+	int* votes = bands[0].votes;
+	for (i = 1; i < thread_count; i++) {
+		for (j = 0; j < vote_count; j++) {
+			votes[j] += bands[i].votes[j];
+		}
+		free(bands[i].votes);
+	}
+	FreeMemory(bands);
+	return votes;
+}
+
+// how far the best of count theta scores stands out from their mean, from 0 (flat) to 1
+static double ScoreConfidence(const double* scores, int count, int best) {
+	if (count == 0 || scores[best] <= 0) return 0.0;
+	double mean = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		mean += scores[i];
+	}
+	mean /= count;
+	return (scores[best] - mean) / scores[best];
+}
+
+// fits a parabola through the best score and its neighbours and returns the offset of its
+// vertex from best, in bins (0 at either end of the sweep)
+static double InterpolatePeak(const double* scores, int count, int best) {
+	if (best <= 0 || best >= count - 1) return 0.0;
+	double left = scores[best - 1];
+	double center = scores[best];
+	double right = scores[best + 1];
+	double curvature = left - 2 * center + right;
+	return curvature < 0 ? 0.5 * (left - right) / curvature : 0.0;
+}
+
+// bit plane of the document as the estimators see it: bd->bits itself, or a packed copy that
+// is returned in copy as well, for the caller to free
+static const unsigned long long* DocumentBits(const BinaryDocument* bd, unsigned long long** copy) {
+	*copy = NULL;
+	if (bd->bits && bd->rotation_deg == 0) return bd->bits;
+
+	int words_per_row = PACKED_WORDS(bd->width);
+	unsigned long long* bits = MemAllocate(sizeof(unsigned long long) * (words_per_row * bd->height > 0 ? words_per_row * bd->height : 1));
+	unsigned char* scratch = MemAllocate(sizeof(unsigned char) * (bd->width > 0 ? bd->width : 1));
+	int y;
+	for (y = 0; y < bd->height; y++) {
+		unsigned long long* row = bits + (size_t)y * words_per_row;
+		const unsigned long long* packed = BinaryDocument_GetPackedRow(bd, y, scratch, row);
+		if (packed != row) memcpy(row, packed, sizeof(unsigned long long) * words_per_row);
+	}
+	FreeMemory(scratch);
+	*copy = bits;
+	return bits;
+}
+
+/**************************************************************
+*	original estimator: one Hough sweep over every foreground pixel at full resolution,
+*	taking the theta of the single most voted line
+***************************************************************/
+SkewEstimate EstimateSkewHough(const BinaryDocument* bd) {
+	int height = bd->height;
+	int width = bd->width;
+	int max_r = sqrt(pow(bd->height, 2) + pow(bd->width, 2));		// maximum possible value of r
+	int r_bin_count = MAX_R_BINS;
+	double r_delta = 2.0 * (double)max_r / r_bin_count;				// bin size for r
+	int theta_bin_count = 2 * MAX_SKEW_ANGLE_DEG / THETA_DELTA_DEG + 1;	// number of bins for the theta dimension
+
+	// cos and sin of every theta bin, computed once instead of once per pixel
+	double* cos_table = MemAllocate(sizeof(double) * theta_bin_count);
+	double* sin_table = MemAllocate(sizeof(double) * theta_bin_count);
+	FillThetaTables(90, THETA_DELTA_DEG, theta_bin_count, cos_table, sin_table);		// sweeps from 90-SKEW_MAX to 90+SKEW_MAX
+
+	unsigned long long* bits_copy;
+	const unsigned long long* bits = DocumentBits(bd, &bits_copy);
+	int* hough_votes = HoughTransform(bits, PACKED_WORDS(width), height, 0,
+		cos_table, sin_table, theta_bin_count, r_delta, r_bin_count);		// stores votes for the Hough transform
+	FreeMemory(bits_copy);
+	FreeMemory(cos_table);
+	FreeMemory(sin_table);
 
 	// find the skew angle by locating the theta with the maximum vote value
+	double* peaks = MemAllocate(sizeof(double) * theta_bin_count);		// highest vote of each theta
 	int theta_i, r_i;			// indices for the vote matrix
+	int best_theta = 0;
 	double skew_deg = 0;		// detected skew angle in degrees
 	int max_vote = 0;			// keeps track of the highest observed vote count
 	for (theta_i = 0; theta_i < theta_bin_count; theta_i++) {
+		peaks[theta_i] = 0;
 		for (r_i = 0; r_i < r_bin_count; r_i++) {
 			int vote_value = hough_votes[theta_i + r_i * theta_bin_count];
+			if (vote_value > peaks[theta_i]) peaks[theta_i] = vote_value;
 			if (vote_value > max_vote) {
 				max_vote = vote_value;
+				best_theta = theta_i;
 
 				// convert from theta index to degrees
 				skew_deg = (theta_i - theta_bin_count / 2) * THETA_DELTA_DEG + 90;		//degrees are in hough space, so horizontal lines have 90 degree skew
@@ -292,6 +1540,303 @@ void Deskew(BinaryDocument* bd) {
 		}
 	}
 
-	// rotate image in the opposite direction of the skew
-	Rotate(bd, 90 - skew_deg);
+	SkewEstimate estimate;
+	estimate.AngleDeg = 90 - skew_deg;		// rotate in the opposite direction of the skew
+	estimate.Confidence = ScoreConfidence(peaks, theta_bin_count, best_theta);
+	FreeMemory(peaks);
+	free(hough_votes);
+	return estimate;
+}
+
+/*
+*	sweeps the Hough transform of the packed image bits over count theta bins around center_deg and scores each
+*	theta by the sum of its squared votes, which is largest when the lines of text fall into the
+*	fewest r bins. writes the score of each theta to scores and returns the index of the best one
+*/
+static int ScoreSkewSweep(const unsigned long long* bits, int height, int width, int edges_only,
+	double center_deg, double step_deg, int count, double* scores) {
+	double* cos_table = MemAllocate(sizeof(double) * count);
+	double* sin_table = MemAllocate(sizeof(double) * count);
+	FillThetaTables(center_deg, step_deg, count, cos_table, sin_table);
+
+	int max_r = (int)ceil(sqrt((double)height * height + (double)width * width));
+	int r_bin_count = 2 * max_r + 2;		// one pixel wide r bins
+	int* votes = HoughTransform(bits, PACKED_WORDS(width), height, edges_only, cos_table, sin_table, count, 1.0, r_bin_count);
+
+	int theta_index, r_index;
+	for (theta_index = 0; theta_index < count; theta_index++) {
+		scores[theta_index] = 0;
+	}
+	for (r_index = 0; r_index < r_bin_count; r_index++) {		// row by row through the histogram
+		const int* row = votes + r_index * count;
+		for (theta_index = 0; theta_index < count; theta_index++) {
+			scores[theta_index] += (double)row[theta_index] * row[theta_index];
+		}
+	}
+
+	int best = 0;
+	for (theta_index = 1; theta_index < count; theta_index++) {
+		if (scores[theta_index] > scores[best]) best = theta_index;
+	}
+
+	free(votes);
+	FreeMemory(cos_table);
+	FreeMemory(sin_table);
+	return best;
+}
+
+/**************************************************************
+*	coarse-to-fine estimator. the full +-MAX_SKEW_ANGLE_DEG range is swept on a copy of the
+*	image reduced SKEW_COARSE_SCALE times in each direction (a reduced pixel is foreground
+*	if any of its pixels is), which finds the angle to within a bin. that angle is then
+*	refined with a narrow sweep of fine bins at full resolution, voting only with the top
+*	edge pixel of each vertical run, and the peak is interpolated between bins.
+*	The confidence is how far the best coarse angle stands out from the others.
+***************************************************************/
+SkewEstimate EstimateSkew(const BinaryDocument* bd) {
+	int height = bd->height;
+	int width = bd->width;
+	SkewEstimate estimate;
+	estimate.AngleDeg = 0;
+	estimate.Confidence = 0;
+
+	unsigned long long* bits_copy;
+	const unsigned long long* bits = DocumentBits(bd, &bits_copy);
+	int words_per_row = PACKED_WORDS(width);
+
+	// OR-reduce the image for the coarse sweep
+	int coarse_height = (height + SKEW_COARSE_SCALE - 1) / SKEW_COARSE_SCALE;
+	int coarse_width = (width + SKEW_COARSE_SCALE - 1) / SKEW_COARSE_SCALE;
+	int coarse_words = PACKED_WORDS(coarse_width);
+	unsigned long long* coarse_bits = (unsigned long long*)calloc(coarse_height * coarse_words > 0 ? coarse_height * coarse_words : 1, sizeof(unsigned long long));
+	int w, y;
+	int foreground = 0;
+	for (y = 0; y < height; y++) {
+		const unsigned long long* row = bits + (size_t)y * words_per_row;
+		unsigned long long* coarse_row = coarse_bits + (y / SKEW_COARSE_SCALE) * coarse_words;
+		for (w = 0; w < words_per_row; w++) {
+			unsigned long long word = row[w];
+			while (word) {
+				int coarse_x = (w * PACKED_WORD_BITS + LowestSetBit64(word)) / SKEW_COARSE_SCALE;
+				coarse_row[coarse_x / PACKED_WORD_BITS] |= 1ULL << (coarse_x % PACKED_WORD_BITS);
+				word &= word - 1;
+				foreground = 1;
+			}
+		}
+	}
+	if (!foreground) {		// nothing to line up
+		free(coarse_bits);
+		FreeMemory(bits_copy);
+		return estimate;
+	}
+
+	int coarse_count = 2 * MAX_SKEW_ANGLE_DEG / SKEW_COARSE_STEP_DEG + 1;
+	double* coarse_scores = MemAllocate(sizeof(double) * coarse_count);
+	int coarse_best = ScoreSkewSweep(coarse_bits, coarse_height, coarse_width, 0,
+		90, SKEW_COARSE_STEP_DEG, coarse_count, coarse_scores);
+	double coarse_deg = (coarse_best - coarse_count / 2) * SKEW_COARSE_STEP_DEG + 90;
+	estimate.Confidence = ScoreConfidence(coarse_scores, coarse_count, coarse_best);
+	FreeMemory(coarse_scores);
+	free(coarse_bits);
+
+	// refine within a coarse bin and a half on either side
+	int fine_count = SKEW_FINE_BIN_COUNT;
+	double* fine_scores = MemAllocate(sizeof(double) * fine_count);
+	int fine_best = ScoreSkewSweep(bits, height, width, 1,
+		coarse_deg, SKEW_FINE_STEP_DEG, fine_count, fine_scores);
+	double skew_deg = (fine_best - fine_count / 2 + InterpolatePeak(fine_scores, fine_count, fine_best)) * SKEW_FINE_STEP_DEG + coarse_deg;
+	FreeMemory(fine_scores);
+	FreeMemory(bits_copy);
+
+	estimate.AngleDeg = 90 - skew_deg;		// rotate in the opposite direction of the skew
+	return estimate;
+}
+
+/*
+*	foreground pixel count of every block_width wide, row_scale tall block of the page,
+*	indexed [block + row * block_count]. a sheared row sum only needs these counts: all the
+*	pixels of a block are moved by the shift of the block's center column
+*/
+static int* CountRowBlocks(const unsigned long long* bits, int height, int width, int block_width, int row_scale, int* block_count, int* row_count) {
+	int words_per_row = PACKED_WORDS(width);
+	int blocks = (width + block_width - 1) / block_width;
+	int rows = (height + row_scale - 1) / row_scale;
+	int* counts = (int*)calloc(blocks * rows > 0 ? blocks * rows : 1, sizeof(int));
+	int y, b;
+	for (y = 0; y < height; y++) {
+		const unsigned long long* row = bits + (size_t)y * words_per_row;
+		int* row_counts = counts + (y / row_scale) * blocks;
+		for (b = 0; b < blocks; b++) {
+			int x_end = (b + 1) * block_width < width ? (b + 1) * block_width : width;
+			row_counts[b] += CountRowForeground(row, b * block_width, x_end);
+		}
+	}
+	*block_count = blocks;
+	*row_count = rows;
+	return counts;
+}
+
+/*
+*	scores count candidate skews (degrees from horizontal) step_deg apart around center_deg
+*	by the sum of squares of the horizontal projection profile of the page sheared by each
+*	skew. the profile of a sheared page is sharpest, and the sum largest, when the shear lines
+*	the text rows up with the profile bins. returns the index of the best skew
+*/
+static int ScoreProjectionSweep(const int* counts, int rows, int block_count, int block_width, int row_scale,
+	double center_deg, double step_deg, int count, double* scores) {
+	int max_shift = (int)ceil(block_count * block_width * tan(MAX_SKEW_ANGLE_DEG * 1.2 * PI / 180.0) / row_scale) + 1;
+	int profile_length = rows + 2 * max_shift;
+	int* profile = MemAllocate(sizeof(int) * profile_length);
+	int* shifts = MemAllocate(sizeof(int) * block_count);		// profile shift of each block
+
+	int angle_index, b, y, i;
+	int best = 0;
+	for (angle_index = 0; angle_index < count; angle_index++) {
+		double skew_deg = (angle_index - count / 2) * step_deg + center_deg;
+		double slope = tan(skew_deg * PI / 180.0) / row_scale;
+		for (b = 0; b < block_count; b++) {
+			shifts[b] = max_shift - (int)floor((b + 0.5) * block_width * slope + 0.5);
+		}
+		for (i = 0; i < profile_length; i++) {
+			profile[i] = 0;
+		}
+		for (y = 0; y < rows; y++) {
+			const int* row_counts = counts + y * block_count;
+			for (b = 0; b < block_count; b++) {
+				profile[y + shifts[b]] += row_counts[b];
+			}
+		}
+
+		double sum = 0;
+		for (i = 0; i < profile_length; i++) {
+			sum += (double)profile[i] * profile[i];
+		}
+		scores[angle_index] = sum;
+		if (sum > scores[best]) best = angle_index;
+	}
+
+	FreeMemory(shifts);
+	FreeMemory(profile);
+	return best;
+}
+
+/**************************************************************
+*	projection profile estimator. instead of rotating the page for every candidate angle,
+*	each row is split into blocks whose foreground counts are added to the profile bin of
+*	the row after shearing. a coarse sweep over +-MAX_SKEW_ANGLE_DEG with wide blocks, on
+*	rows reduced SKEW_COARSE_SCALE times, is refined by a full resolution sweep with narrow blocks, and the peak is interpolated between bins.
+*	needs no accumulator beyond one profile, and works best on pages of plain text lines.
+***************************************************************/
+SkewEstimate EstimateSkewProjection(const BinaryDocument* bd) {
+	SkewEstimate estimate;
+	estimate.AngleDeg = 0;
+	estimate.Confidence = 0;
+	if (bd->height == 0 || bd->width == 0) return estimate;
+
+	unsigned long long* bits_copy;
+	const unsigned long long* bits = DocumentBits(bd, &bits_copy);
+	int block_count, row_count;
+	int coarse_count = 2 * MAX_SKEW_ANGLE_DEG / SKEW_COARSE_STEP_DEG + 1;
+	double* coarse_scores = MemAllocate(sizeof(double) * coarse_count);
+	int* counts = CountRowBlocks(bits, bd->height, bd->width, PROFILE_COARSE_BLOCK, SKEW_COARSE_SCALE, &block_count, &row_count);
+	int coarse_best = ScoreProjectionSweep(counts, row_count, block_count, PROFILE_COARSE_BLOCK, SKEW_COARSE_SCALE,
+		0, SKEW_COARSE_STEP_DEG, coarse_count, coarse_scores);
+	double coarse_deg = (coarse_best - coarse_count / 2) * SKEW_COARSE_STEP_DEG;
+	estimate.Confidence = ScoreConfidence(coarse_scores, coarse_count, coarse_best);
+	FreeMemory(coarse_scores);
+	free(counts);
+
+	int fine_count = SKEW_FINE_BIN_COUNT;
+	double* fine_scores = MemAllocate(sizeof(double) * fine_count);
+	counts = CountRowBlocks(bits, bd->height, bd->width, PROFILE_FINE_BLOCK, 1, &block_count, &row_count);
+	int fine_best = ScoreProjectionSweep(counts, row_count, block_count, PROFILE_FINE_BLOCK, 1,
+		coarse_deg, SKEW_FINE_STEP_DEG, fine_count, fine_scores);
+	double skew_deg = (fine_best - fine_count / 2 + InterpolatePeak(fine_scores, fine_count, fine_best)) * SKEW_FINE_STEP_DEG + coarse_deg;
+	FreeMemory(fine_scores);
+	free(counts);
+	FreeMemory(bits_copy);
+
+	estimate.AngleDeg = -skew_deg;		// rotate in the opposite direction of the skew
+	return estimate;
+}
+
+void Deskew(BinaryDocument* bd) {
+	DeskewWithMethod(bd, DESKEW_HOUGH);
+}
+
+void DeskewWithMethod(BinaryDocument* bd, DeskewMethod method) {
+	SkewEstimate estimate = method == DESKEW_PROJECTION ? EstimateSkewProjection(bd) : EstimateSkew(bd);
+	Rotate(bd, estimate.AngleDeg);
+}
+
+void DeskewVirtual(BinaryDocument* bd, DeskewMethod method) {
+	BinaryDocument_Materialize(bd);		// the estimators read the image directly
+	SkewEstimate estimate = method == DESKEW_PROJECTION ? EstimateSkewProjection(bd) : EstimateSkew(bd);
+	if (fabs(estimate.AngleDeg) < 0.1) return;		// Rotate() would leave the image as it is
+
+	double angle_rad = estimate.AngleDeg * PI / 180.0;
+	bd->rotation_deg = estimate.AngleDeg;
+	bd->rotation_cos = cos(angle_rad);
+	bd->rotation_sin = sin(angle_rad);
+}
+
+void BinaryDocument_Materialize(BinaryDocument* bd) {
+	if (bd->rotation_deg == 0) return;
+	double angle_deg = bd->rotation_deg;
+	bd->rotation_deg = 0;
+	bd->rotation_cos = 1;
+	bd->rotation_sin = 0;
+	Rotate(bd, angle_deg);
+}
+
+const unsigned char* BinaryDocument_GetRow(const BinaryDocument* bd, int y, unsigned char* buffer) {
+	if (bd->rotation_deg == 0) {
+		if (!bd->bits) return bd->image + y * bd->width;
+		UnpackRow(bd->bits + (size_t)y * bd->words_per_row, bd->width, !bd->background_color, bd->background_color, buffer);
+		return buffer;
+	}
+
+	// a one row band of the rotation engine
+	RotateBand band;
+	InitRotateBand(&band, bd, bd->rotation_deg * PI / 180.0);
+	band.cos_val = bd->rotation_cos;
+	band.sin_val = bd->rotation_sin;
+	RotateRow(&band, y, buffer);
+	return buffer;
+}
+
+const unsigned long long* BinaryDocument_GetPackedRow(const BinaryDocument* bd, int y, unsigned char* scratch, unsigned long long* buffer) {
+	if (bd->bits && bd->rotation_deg == 0) {
+		return bd->bits + (size_t)y * bd->words_per_row;
+	}
+	PackRow(BinaryDocument_GetRow(bd, y, scratch), bd->width, !bd->background_color, buffer);
+	return buffer;
+}
+
+void BinaryDocument_Pack(BinaryDocument* bd) {
+	if (bd->bits) return;
+	BinaryDocument_Materialize(bd);
+	int words_per_row = PACKED_WORDS(bd->width);
+	unsigned long long* bits = MemAllocate(sizeof(unsigned long long) * (words_per_row * bd->height > 0 ? words_per_row * bd->height : 1));
+	int y;
+	for (y = 0; y < bd->height; y++) {
+		PackRow(bd->image + y * bd->width, bd->width, !bd->background_color, bits + (size_t)y * words_per_row);
+	}
+	FreeMemory(bd->image);
+	bd->image = NULL;
+	bd->bits = bits;
+	bd->words_per_row = words_per_row;
+}
+
+void BinaryDocument_Unpack(BinaryDocument* bd) {
+	if (!bd->bits) return;
+	unsigned char* image = MemAllocate(sizeof(unsigned char) * (bd->width * bd->height > 0 ? bd->width * bd->height : 1));
+	int y;
+	for (y = 0; y < bd->height; y++) {
+		UnpackRow(bd->bits + (size_t)y * bd->words_per_row, bd->width, !bd->background_color, bd->background_color, image + y * bd->width);
+	}
+	FreeMemory(bd->bits);
+	bd->bits = NULL;
+	bd->words_per_row = 0;
+	bd->image = image;
 }
@@ -11,14 +11,76 @@
 #include <stdlib.h>
 #include "qdbmp.h"
 
+#define PACKED_WORD_BITS 64
+
+// number of 64 bit words in a packed row of width pixels
+#define PACKED_WORDS(width) (((width) + PACKED_WORD_BITS - 1) / PACKED_WORD_BITS)
+
+// bounding box of a character found by segmentation
+typedef struct _GlyphBox {
+	int x;					// the character is columns x to x + width - 1 of rows y to y + height - 1
+	int y;
+	int width;
+	int height;
+	int line;				// line of text it belongs to, from 0 at the top of the page
+	int point;				// index of its point in the data set segmentation returned, -1 if it was used for training
+} GlyphBox;
+
+/*
+*	A document holds its pixels either as bytes in image, or once packed (BinaryDocument_Pack)
+*	as a bit plane in bits: bit x % 64 of word x / 64 of a row is 1 where pixel x is foreground,
+*	and every row is padded with 0 bits to words_per_row words. the other one is NULL.
+*	Anything that reads rows through BinaryDocument_GetRow / BinaryDocument_GetPackedRow works on both
+*/
 typedef struct _BinaryDocument {
 	unsigned char* image;			// each element corresponds to one pixel for computation
-	unsigned char* boundaries;	
+	unsigned long long* bits;		// 1 bpp bit plane (NULL unless packed)
+	int words_per_row;				// words in each row of bits
+	GlyphBox* glyphs;				// boxes of the characters found by the last segmentation (NULL before), see DrawGlyphBoundaries()
+	int glyph_count;
 	int background_color;	// 0 for white background, 1 for black background
 	int height;				// height of the image in pixels
 	int width;				// width of the image in pixels
+	double rotation_deg;	// rotation still to be applied to image (0 if none). see DeskewVirtual()
+	double rotation_cos;	// cos and sin of rotation_deg, as Rotate() computes them
+	double rotation_sin;
 } BinaryDocument;
 
+// applies a pending rotation to the image, so that image can be read directly again
+void BinaryDocument_Materialize(BinaryDocument* bd);
+
+// returns row y of the document (0 <= y < height): the image row itself, or with a pending rotation
+// or a packed document, buffer (width pixels) filled with the row that Rotate() would produce
+const unsigned char* BinaryDocument_GetRow(const BinaryDocument* bd, int y, unsigned char* buffer);
+
+// returns row y of the document as words_per_row packed words: the row of bits itself, or buffer
+// filled from the row in scratch (width pixels) that BinaryDocument_GetRow() produces
+const unsigned long long* BinaryDocument_GetPackedRow(const BinaryDocument* bd, int y, unsigned char* scratch, unsigned long long* buffer);
+
+// replaces the byte image with the bit plane (applying a pending rotation first), an eighth of the memory
+void BinaryDocument_Pack(BinaryDocument* bd);
+
+// replaces the bit plane with the byte image again
+void BinaryDocument_Unpack(BinaryDocument* bd);
+
+/*
+*	Bit plane kernels. rows are arrays of packed words as described above
+*/
+// packs a row of width pixels (each 0 or 1), setting the bits of the pixels equal to fg_color
+void PackRow(const unsigned char* row, int width, int fg_color, unsigned long long* words);
+
+// unpacks width pixels of a packed row to fg_color / background_color bytes
+void UnpackRow(const unsigned long long* words, int width, int fg_color, int background_color, unsigned char* row);
+
+// number of foreground pixels in [x_start, x_end) of a packed row
+int CountRowForeground(const unsigned long long* words, int x_start, int x_end);
+
+// adds 1 to counts[x] for every foreground pixel x of a packed row of words_per_row words
+void AddColumnCounts(const unsigned long long* words, int words_per_row, int* counts);
+
+// bytes in each row of the BGR input image: BMP rows are padded to 4 bytes, usb_imread's are not
+int BmpRowStride(int width);
+
 unsigned char* ConvertImageToGrayscale(unsigned char* input_bmp, int height, int width);
 
 //frees the members of a BinaryDocument struct
@@ -27,25 +89,106 @@ void BinaryDocument_Free(BinaryDocument* doc);
 // binarizes an an RGB image with file name as a parameter
 BinaryDocument Binarize(unsigned char* bmp_rgb, int height, int width);
 
+// Binarize() straight into a packed document, without ever allocating the byte image
+BinaryDocument BinarizePacked(unsigned char* bmp_rgb, int height, int width);
+
+typedef enum _BinarizeMethod {
+	BINARIZE_OTSU,			// Binarize(): one global threshold, chosen with Otsu's method
+	BINARIZE_SAUVOLA,		// local threshold from the mean and deviation of a window around each pixel
+	BINARIZE_BRADLEY		// pixels a fixed fraction darker than the mean of a window around them are black
+} BinarizeMethod;
+
+// binarizes with the given method, into a packed document if packed is set. the local methods
+// suit unevenly lit pages and photographs, and run on row bands in parallel
+BinaryDocument BinarizeWithMethod(unsigned char* bmp_rgb, int height, int width, BinarizeMethod method, int packed);
+
+// as BinarizeWithMethod, but reads the BGR pixels where they are (a mapped file, for instance) and
+// leaves them untouched. bottom_row is the bottom row of the image and stride the distance in bytes
+// from a row to the row above it (negative for top-down images)
+BinaryDocument BinarizePixels(const unsigned char* bottom_row, long stride, int height, int width, BinarizeMethod method, int packed);
+
+/**************************************************************
+*	Binarizes a 24 bpp BMP file a row at a time, reading it from disk in strips, so that
+*	pages of any size take a few rows of memory. the rows come out packed, from the top,
+*	exactly as BinarizeWithMethod() would produce them; except that the background color
+*	of the local methods is always the one Otsu's threshold gives
+***************************************************************/
+typedef struct _BinarizeStream BinarizeStream;
+
+// reads the file once for the threshold. NULL if it cannot be read
+BinarizeStream* BinarizeStream_Open(const char* file_name, BinarizeMethod method);
+
+// size and background color of the page, as a document without pixels
+const BinaryDocument* BinarizeStream_Document(const BinarizeStream* stream);
+
+// the next row (PACKED_WORDS(width) words), valid until the next call. NULL after the last row,
+// or if the row could not be read (see BinarizeStream_Failed)
+const unsigned long long* BinarizeStream_NextRow(BinarizeStream* stream);
+
+// 1 if NextRow returned NULL because the file could not be read rather than at the end of the page
+int BinarizeStream_Failed(const BinarizeStream* stream);
+
+void BinarizeStream_Close(BinarizeStream* stream);
+
 /************************************************************
 *	-BINARYROTATE-
-*	This algorithm rotates the image clockwise at an angle (radians) specified as an input.
-*	It iterates through the DESTINATION image and computes the inverse rotation for each index to find
-*	the corresponding index at the SOURCE image.
-*	By looping through the DESTINATION image, the result will no longer have gaps due to aliasing
+*	This algorithm rotates the image counterclockwise at an angle specified as an input.
+*	It maps every pixel of the DESTINATION image back to the SOURCE image (nearest
+*	neighbor), so the result has no gaps due to aliasing.
+*	The work is done in cache sized tiles with fixed-point coordinate stepping (or, for
+*	small angles, as run copies along the two shears of the rotation) on row bands that
+*	run in parallel; the output is identical to RotateReference().
 *	binary_doc: pointer to BinaryDocument object to modify
 *	angle_deg: rotation angle in degrees
 *************************************************************/
 void Rotate(BinaryDocument* bd, double angle_deg);
 
+// original per-pixel floating point implementation of Rotate()
+void RotateReference(BinaryDocument* bd, double angle_deg);
+
+// rotates an 8 bpp grayscale image about its center and returns the new image. pixels that come
+// from outside the image get the background value. bilinear = 0 samples the nearest pixel with
+// the same mapping as Rotate(); bilinear = 1 interpolates between the four nearest (anti-aliased)
+unsigned char* RotateGrayscale(const unsigned char* image, int height, int width, double angle_deg, unsigned char background, int bilinear);
+
+
+typedef struct _SkewEstimate {
+	double AngleDeg;		// rotation (degrees) that corrects the skew, as passed to Rotate()
+	double Confidence;		// 0 to 1: how clearly the angle stands out from the other candidates
+} SkewEstimate;
+
+// original estimator: full resolution Hough sweep in THETA_DELTA_DEG steps
+SkewEstimate EstimateSkewHough(const BinaryDocument* bd);
+
+// coarse sweep on a reduced image refined by a narrow, fine sweep (sub-0.1 degree precision)
+SkewEstimate EstimateSkew(const BinaryDocument* bd);
+
+// maximizes the variance of the horizontal projection profile over sheared row sums
+SkewEstimate EstimateSkewProjection(const BinaryDocument* bd);
+
+typedef enum _DeskewMethod {
+	DESKEW_HOUGH,			// EstimateSkew(): coarse-to-fine Hough transform
+	DESKEW_PROJECTION		// EstimateSkewProjection(): cheaper, for pages of plain text lines
+} DeskewMethod;
 
 /**************************************************************
 *	de-skews the input binary document
-*	Computes a skew angle using the Hough Transform
+*	Computes a skew angle with EstimateSkew()
 *	Corrects the skew by calling the Rotate() method
 ***************************************************************/
 void Deskew(BinaryDocument* bd);
 
+// de-skews the document using the given skew estimator
+void DeskewWithMethod(BinaryDocument* bd, DeskewMethod method);
+
+/**************************************************************
+*	de-skews the document without rotating the image: the correcting rotation is only
+*	recorded in bd, and segmentation reads the document through BinaryDocument_GetRow(),
+*	which rotates one row on demand. saves allocating a second page sized image;
+*	results are identical to DeskewWithMethod()
+***************************************************************/
+void DeskewVirtual(BinaryDocument* bd, DeskewMethod method);
+
 void WriteToFile(char* file_path, unsigned char* image, int height, int width);
 
 
@@ -1,4 +1,5 @@
 #include "qdbmp.h"
+#include "system.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -31,11 +32,22 @@ struct _BMP
 	BMP_Header	Header;
 	UCHAR*		Palette;
 	UCHAR*		Data;
+	FILE*		File;				/* Open file of a bitmap opened with BMP_OpenFile, or NULL */
+	long		DataStart;			/* Offset of the first pixel row in File */
+	MappedFile*	Mapping;			/* Mapping of a bitmap opened with BMP_MapFile, or NULL */
+	int			TopDown;			/* Non-zero if the opened or mapped rows are stored top row first */
 };
 
 
-/* Holds the last error code */
-static BMP_STATUS BMP_LAST_ERROR_CODE = 0;
+/* Holds the last error code (one per thread, so concurrent readers don't race) */
+#if defined( _MSC_VER )
+	#define BMP_THREAD_LOCAL __declspec( thread )
+#elif defined( __GNUC__ )
+	#define BMP_THREAD_LOCAL __thread
+#else
+	#define BMP_THREAD_LOCAL
+#endif
+static BMP_THREAD_LOCAL BMP_STATUS BMP_LAST_ERROR_CODE = 0;
 
 
 /* Error description strings */
@@ -60,6 +72,8 @@ static const char* BMP_ERROR_STRING[] =
 
 /*********************************** Forward declarations **********************************/
 int		ReadHeader	( BMP* bmp, FILE* f );
+int		ParseHeader	( BMP* bmp, const UCHAR* data, size_t size );
+int		CheckHeader	( BMP* bmp, size_t file_size );
 int		WriteHeader	( BMP* bmp, FILE* f );
 
 int		ReadUINT	( UINT* x, FILE* f );
@@ -190,6 +204,16 @@ void BMP_Free( BMP* bmp )
 		free( bmp->Data );
 	}
 
+	if ( bmp->File != NULL )
+	{
+		fclose( bmp->File );
+	}
+
+	if ( bmp->Mapping != NULL )
+	{
+		UnmapFile( bmp->Mapping );
+	}
+
 	free( bmp );
 
 	BMP_LAST_ERROR_CODE = BMP_OK;
@@ -310,6 +334,242 @@ BMP* BMP_ReadFile( const char* filename )
 }
 
 
+/**************************************************************
+	Opens the specified BMP image file and reads its header
+	only. The pixel rows are then read a few at a time with
+	BMP_ReadRows(); the file stays open until BMP_Free().
+	GetData and the pixel access methods are not available.
+**************************************************************/
+BMP* BMP_OpenFile( const char* filename )
+{
+	BMP*		bmp;
+	FILE*		f;
+	long		file_size;
+	BMP_STATUS	status;
+
+	if ( filename == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+
+	/* Allocate */
+	bmp = calloc( 1, sizeof( BMP ) );
+	if ( bmp == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+
+	/* Open file */
+	f = fopen( filename, "rb" );
+	if ( f == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_FOUND;
+		free( bmp );
+		return NULL;
+	}
+
+
+	/* Read header, and check it against the size of the file as BMP_MapFile() does */
+	if ( ReadHeader( bmp, f ) != BMP_OK || fseek( f, 0, SEEK_END ) != 0 || ( file_size = ftell( f ) ) < 0 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_INVALID;
+		fclose( f );
+		free( bmp );
+		return NULL;
+	}
+
+	status = CheckHeader( bmp, (size_t) file_size );
+	if ( status != BMP_OK )
+	{
+		BMP_LAST_ERROR_CODE = status;
+		fclose( f );
+		free( bmp );
+		return NULL;
+	}
+
+
+	/* The pixel data starts where the header says, which need not be right after it */
+	bmp->File = f;
+	bmp->DataStart = (long) bmp->Header.DataOffset;
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+
+	return bmp;
+}
+
+
+/**************************************************************
+	Returns the size in bytes of a pixel row as it is stored
+	(padded to 4 bytes).
+**************************************************************/
+UINT BMP_GetRowSize( BMP* bmp )
+{
+	if ( bmp == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return -1;
+	}
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+
+	/* Computed in 64 bits, so that Width * BitsPerPixel cannot wrap around */
+	return (UINT) ( ( (unsigned long long) bmp->Header.Width * bmp->Header.BitsPerPixel / 8 + 3 ) / 4 * 4 );
+}
+
+
+/**************************************************************
+	Reads row_count rows, starting at row first_row counted
+	from the bottom of the image, into buffer from the bottom
+	up, BMP_GetRowSize() bytes per row, whichever order the
+	file stores them in. For bitmaps opened with BMP_OpenFile().
+**************************************************************/
+void BMP_ReadRows( BMP* bmp, UINT first_row, UINT row_count, UCHAR* buffer )
+{
+	UINT	row_size;
+	UINT	i;
+
+	if ( bmp == NULL || bmp->File == NULL || buffer == NULL || first_row + row_count > bmp->Header.Height )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return;
+	}
+
+	row_size = BMP_GetRowSize( bmp );
+	if ( bmp->TopDown )
+	{
+		/* The rows are stored top row first: read them backwards into place */
+		if ( fseek( bmp->File, bmp->DataStart + (long) ( bmp->Header.Height - first_row - row_count ) * row_size, SEEK_SET ) != 0 )
+		{
+			BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
+			return;
+		}
+		for ( i = 0 ; i < row_count ; ++i )
+		{
+			if ( fread( buffer + (size_t) ( row_count - 1 - i ) * row_size, row_size, 1, bmp->File ) != 1 )
+			{
+				BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
+				return;
+			}
+		}
+	}
+	else if ( fseek( bmp->File, bmp->DataStart + (long) first_row * row_size, SEEK_SET ) != 0
+		|| fread( buffer, row_size, row_count, bmp->File ) != row_count )
+	{
+		BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
+		return;
+	}
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+}
+
+
+/**************************************************************
+	Maps the specified BMP image file into memory and checks
+	its header. The pixels are not copied: they are read where
+	they lie in the mapping, through BMP_GetMappedPixels(), and
+	the mapping is released by BMP_Free(). Top-down bitmaps
+	(negative height) are accepted; BMP_GetHeight() returns
+	the number of rows either way. GetData and the pixel
+	access methods are not available.
+**************************************************************/
+BMP* BMP_MapFile( const char* filename )
+{
+	BMP*		bmp;
+	MappedFile*	mapping;
+	BMP_STATUS	status;
+
+	if ( filename == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+
+	/* Allocate */
+	bmp = calloc( 1, sizeof( BMP ) );
+	if ( bmp == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+
+	/* Map file */
+	mapping = MapFile( filename );
+	if ( mapping == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_FOUND;
+		free( bmp );
+		return NULL;
+	}
+
+
+	/* Read header */
+	if ( ParseHeader( bmp, mapping->Data, mapping->Size ) != BMP_OK )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_INVALID;
+		UnmapFile( mapping );
+		free( bmp );
+		return NULL;
+	}
+
+	status = CheckHeader( bmp, mapping->Size );
+	if ( status != BMP_OK )
+	{
+		BMP_LAST_ERROR_CODE = status;
+		UnmapFile( mapping );
+		free( bmp );
+		return NULL;
+	}
+
+
+	bmp->Mapping = mapping;
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+
+	return bmp;
+}
+
+
+/**************************************************************
+	Returns the bottom row of the pixels of a bitmap opened
+	with BMP_MapFile(), and in stride the distance in bytes
+	from a row to the row above it: BMP_GetRowSize() for the
+	usual bottom-up bitmaps, minus that for top-down ones.
+**************************************************************/
+const UCHAR* BMP_GetMappedPixels( BMP* bmp, int* stride )
+{
+	const UCHAR*	pixels;
+	int				row_size;
+
+	if ( bmp == NULL || bmp->Mapping == NULL || stride == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	row_size = (int) BMP_GetRowSize( bmp );
+	pixels = bmp->Mapping->Data + bmp->Header.DataOffset;
+	if ( bmp->TopDown )
+	{
+		*stride = -row_size;
+		pixels += (size_t) ( bmp->Header.Height - 1 ) * row_size;
+	}
+	else
+	{
+		*stride = row_size;
+	}
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+
+	return pixels;
+}
+
+
 /**************************************************************
 	Writes the BMP image to the specified file.
 **************************************************************/
@@ -419,6 +679,30 @@ USHORT BMP_GetDepth( BMP* bmp )
 }
 
 
+/**************************************************************
+	Returns the image's pixel data and hands its ownership to
+	the caller, who must free it with FreeMemory(). The BMP
+	itself must still be released with BMP_Free().
+**************************************************************/
+UCHAR* BMP_GetData( BMP* bmp )
+{
+	UCHAR*	data;
+
+	if ( bmp == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	data = bmp->Data;
+	bmp->Data = NULL;
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+
+	return data;
+}
+
+
 /**************************************************************
 	Populates the arguments with the specified pixel's RGB
 	values.
@@ -683,6 +967,103 @@ int	ReadHeader( BMP* bmp, FILE* f )
 }
 
 
+/**************************************************************
+	Reads the BMP header at the start of data (size bytes)
+	into the data structure, as ReadHeader() reads it from a
+	file. Returns BMP_OK on success.
+**************************************************************/
+int	ParseHeader( BMP* bmp, const UCHAR* data, size_t size )
+{
+	if ( bmp == NULL || data == NULL )
+	{
+		return BMP_INVALID_ARGUMENT;
+	}
+
+	if ( size < 54 )	/* 14 bytes of file header, 40 of info header */
+	{
+		return BMP_IO_ERROR;
+	}
+
+	/* Little endian fields at their offsets in the file */
+	#define LITTLE_USHORT( offset )	( (USHORT) ( data[ ( offset ) + 1 ] << 8 | data[ offset ] ) )
+	#define LITTLE_UINT( offset )	( (UINT) data[ ( offset ) + 3 ] << 24 | data[ ( offset ) + 2 ] << 16 | data[ ( offset ) + 1 ] << 8 | data[ offset ] )
+
+	bmp->Header.Magic				= LITTLE_USHORT( 0 );
+	bmp->Header.FileSize			= LITTLE_UINT( 2 );
+	bmp->Header.Reserved1			= LITTLE_USHORT( 6 );
+	bmp->Header.Reserved2			= LITTLE_USHORT( 8 );
+	bmp->Header.DataOffset			= LITTLE_UINT( 10 );
+	bmp->Header.HeaderSize			= LITTLE_UINT( 14 );
+	bmp->Header.Width				= LITTLE_UINT( 18 );
+	bmp->Header.Height				= LITTLE_UINT( 22 );
+	bmp->Header.Planes				= LITTLE_USHORT( 26 );
+	bmp->Header.BitsPerPixel		= LITTLE_USHORT( 28 );
+	bmp->Header.CompressionType		= LITTLE_UINT( 30 );
+	bmp->Header.ImageDataSize		= LITTLE_UINT( 34 );
+	bmp->Header.HPixelsPerMeter		= LITTLE_UINT( 38 );
+	bmp->Header.VPixelsPerMeter		= LITTLE_UINT( 42 );
+	bmp->Header.ColorsUsed			= LITTLE_UINT( 46 );
+	bmp->Header.ColorsRequired		= LITTLE_UINT( 50 );
+
+	#undef LITTLE_USHORT
+	#undef LITTLE_UINT
+
+	return BMP_OK;
+}
+
+
+/**************************************************************
+	Checks the header of a bitmap whose pixel rows are read
+	in place or a few at a time (BMP_MapFile, BMP_OpenFile)
+	against the size of its file. Only uncompressed 24 and
+	32 BPP bitmaps are supported, as their rows are read as
+	they are. A negative height marks a top-down bitmap: the
+	height is made positive and TopDown is set. Returns
+	BMP_OK, BMP_FILE_NOT_SUPPORTED, or BMP_FILE_INVALID if
+	a row would lie outside the file.
+**************************************************************/
+int	CheckHeader( BMP* bmp, size_t file_size )
+{
+	UINT	row_size;
+
+	if ( bmp->Header.Magic != 0x4D42 )
+	{
+		return BMP_FILE_INVALID;
+	}
+
+	if ( ( bmp->Header.BitsPerPixel != 32 && bmp->Header.BitsPerPixel != 24 )
+		|| bmp->Header.CompressionType != 0 || bmp->Header.HeaderSize < 40 )
+	{
+		return BMP_FILE_NOT_SUPPORTED;
+	}
+
+	if ( (int) bmp->Header.Height < 0 )
+	{
+		if ( bmp->Header.Height == 0x80000000 )
+		{
+			return BMP_FILE_INVALID;
+		}
+		bmp->Header.Height = (UINT) -(int) bmp->Header.Height;
+		bmp->TopDown = 1;
+	}
+
+	/* Every row has to lie inside the file, and its size has to fit a UINT */
+	if ( bmp->Header.Width == 0 || bmp->Header.Height == 0 || bmp->Header.Width > 0x7FFFFFFF / 4
+		|| bmp->Header.Width > 0xFFFFFFFF / bmp->Header.BitsPerPixel || bmp->Header.DataOffset > file_size )
+	{
+		return BMP_FILE_INVALID;
+	}
+
+	row_size = BMP_GetRowSize( bmp );
+	if ( ( file_size - bmp->Header.DataOffset ) / row_size < bmp->Header.Height )
+	{
+		return BMP_FILE_INVALID;
+	}
+
+	return BMP_OK;
+}
+
+
 /**************************************************************
 	Writes the BMP file's header into the data structure.
 	Returns BMP_OK on success.
@@ -735,7 +1116,7 @@ int	ReadUINT( UINT* x, FILE* f )
 		return 0;
 	}
 
-	*x = ( little[ 3 ] << 24 | little[ 2 ] << 16 | little[ 1 ] << 8 | little[ 0 ] );
+	*x = ( (UINT) little[ 3 ] << 24 | little[ 2 ] << 16 | little[ 1 ] << 8 | little[ 0 ] );
 
 	return 1;
 }
@@ -98,11 +98,21 @@ void			BMP_Free					( BMP* bmp );
 BMP*			BMP_ReadFile				( const char* filename );
 void			BMP_WriteFile				( BMP* bmp, const char* filename );
 
+/* Reading a few rows at a time */
+BMP*			BMP_OpenFile				( const char* filename );
+UINT			BMP_GetRowSize				( BMP* bmp );
+void			BMP_ReadRows				( BMP* bmp, UINT first_row, UINT row_count, UCHAR* buffer );
+
+/* Reading the pixels in place, from a memory mapping of the file */
+BMP*			BMP_MapFile					( const char* filename );
+const UCHAR*	BMP_GetMappedPixels			( BMP* bmp, int* stride );
+
 
 /* Meta info */
 UINT			BMP_GetWidth				( BMP* bmp );
 UINT			BMP_GetHeight				( BMP* bmp );
 USHORT			BMP_GetDepth				( BMP* bmp );
+UCHAR*			BMP_GetData					( BMP* bmp );
 
 
 /* Pixel access */
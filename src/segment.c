@@ -3,9 +3,11 @@
 *	After sucessful segmentation, the characters are ready to be passed into the OCR egnine
 */
 #include "segment.h"
+#include "components.h"
 #include "ocr.h"
 #include "preprocess.h"
 #include "system.h"
+#include <string.h>
 
 /*
 *	Returns an image with lines corresponding to the gaps between lines and characters
@@ -16,18 +18,144 @@ static const double HOR_THRESHOLD = 0.001;			//horizontal slice considered a spa
 static const double VERT_THRESHOLD = 0.05;
 static const double PUNCTUATION_THRESHOLD = 0.37;	//if the proportion of height of the character to the line width is below this, classify as a punctuation symbol
 static const double SPACE_THRESHOLD = 0.6;			// if gap larger than this times avg char width, classify gap as a space
+static const int COMPONENT_MIN_PIXELS = 3;			// components with fewer pixels are specks of noise
+static const double CORE_HEIGHT_FRACTION = 0.5;	// components at least this fraction of the median height define the lines
+static const double TALL_HEIGHT_FRACTION = 1.8;	// but not those this many times as tall (characters of two lines that touch)
+static const double GLYPH_OVERLAP = 0.5;			// components of a line overlapping by this fraction of the narrower one form one character
+
+static void InitContext(SegmentContext* ctx, int keep_glyphs) {
+	ctx->char_index = 0;
+	ctx->total_char_width = 0;
+	ctx->avg_char_width = 0;
+	ctx->line_index = 0;
+	ctx->glyph_count = 0;
+	ctx->glyph_capacity = keep_glyphs ? 64 : 0;
+	ctx->glyphs = keep_glyphs ? (GlyphBox*)MemAllocate(sizeof(GlyphBox) * ctx->glyph_capacity) : NULL;
+}
+
+// records the box of a character of the current line, if the boxes are kept
+static void AddGlyph(SegmentContext* ctx, int x, int y, int width, int height, int point) {
+	if (!ctx->glyphs) return;
+	if (ctx->glyph_count == ctx->glyph_capacity) {
+		GlyphBox* grown = (GlyphBox*)MemAllocate(sizeof(GlyphBox) * 2 * ctx->glyph_capacity);
+		memcpy(grown, ctx->glyphs, sizeof(GlyphBox) * ctx->glyph_count);
+		FreeMemory(ctx->glyphs);
+		ctx->glyphs = grown;
+		ctx->glyph_capacity *= 2;
+	}
+	GlyphBox* box = &ctx->glyphs[ctx->glyph_count++];
+	box->x = x;
+	box->y = y;
+	box->width = width;
+	box->height = height;
+	box->line = ctx->line_index;
+	box->point = point;
+}
+
+/*
+*	Adds the character in the box at (char_x, char_y) of rows, char_width by char_height pixels, to
+*	test_set (or to the training set ts while labels remain): small punctuation is told apart by its
+*	size and place in the line, anything else by its feature vector. char_min_y and char_max_y are
+*	the rows just above and below the character on the page, and min_y and max_y the text rows of
+*	its line. Returns the index of the point added to test_set, or -1 if it went to the training set
+*/
+static int AddCharacter(	DataSet* test_set, DataSet* ts, const BinaryDocument* bd, const unsigned long long* rows, int words_per_row,
+							int char_x, int char_y, int char_width, int char_height, int char_min_y, int char_max_y, int min_y, int max_y,
+							char* labels, int max_labels, SegmentContext* ctx) {
+	int line_height = max_y - min_y + 1;
+	int is_small_punct = 0;			// character is small punctuation (period, comma, quote, etc)
+	int line_mid = (min_y + max_y) / 2;
+	if ((double)char_height / line_height <= PUNCTUATION_THRESHOLD) {
+		if (char_min_y > 0.9 * line_mid || char_max_y < 1.1 * line_mid) {
+			is_small_punct = 1;
+		}
+	}
+
+	double* feature_vector;
+
+	/*	If the segmented character is classified as a "small" punctuation (period, comma, etc.)*/
+	if (is_small_punct) {		
+		//check if starting point is lower than midpoint. If so, classify as either period or comma (very basic implementation)
+		if (char_min_y > 0.9 * line_mid) {
+			DataPoint* punct;
+
+			// if height is sufficiently bigger than its width, classify as a comma
+			if (char_height > 1.4 * char_width) {
+				punct = NewDataPointIn(test_set, ',', NULL);
+			}
+			else {		// classify as a period
+				punct = NewDataPointIn(test_set, '.', NULL);
+			}
+			AddTrainingData(test_set, punct);
+			return test_set->Size - 1;
+		}
+		else if (char_max_y < 1.1 * line_mid) {		// classify as single quote (since it's the most common)
+			DataPoint* punct = NewDataPointIn(test_set, '\'', NULL);
+			AddTrainingData(test_set, punct);
+			return test_set->Size - 1;
+		}
+		return -1;
+	}
+
+	/*	If the segmented character is classified as a regular alphanumeric character	*/
+	else {	
+		// figure out if point is training data
+		int isTrainingData = 0;
+		int point = -1;
+		if (ctx->char_index < max_labels) {
+			isTrainingData = 1;
+		}
+		else {
+			isTrainingData = 0;
+		}
+
+		// the feature vector is allocated where the point is kept (the test set may live in an arena)
+		feature_vector = NULL;
+		if (char_height != 0 && char_width != 0) {
+			feature_vector = NewFeatureVectorIn(isTrainingData ? ts : test_set);
+			ComputePackedFeatureVector(rows, words_per_row, char_x, char_y, char_height, char_width,
+				!bd->background_color, bd->background_color, feature_vector);
+		}
+
+		// create and add a training data object if the current character is part of the training set
+		if (isTrainingData) {
+			char training_label = labels[ctx->char_index];
+			DataPoint* training_data = NewDataPoint(training_label, feature_vector);
+			int size = ts->Size;
+			int allocated = ts->Allocated;
+			AddTrainingData(ts, training_data);
+		}
+
+		// otherwise, the data object is part of the test set 
+		// store the feature vector in a dataset to perform KNN classification on later
+		else {
+			DataPoint* dp = NewDataPointIn(test_set, (char)0, feature_vector);	// use null char to signify points that have not been classified yet
+			AddTrainingData(test_set, dp);
+			point = test_set->Size - 1;
+		}
+
+		ctx->char_index++;
+
+		// get running sum of widths
+		ctx->total_char_width += char_width;
+		ctx->avg_char_width = ctx->total_char_width / ctx->char_index;
+		return point;
+	}
+}
 
-static int total_char_width = 0;	// running sum of the width of the segmented characters
-static double avg_char_width = 0;	// running average of the width of the segmented characters
 /*
 *	min_y:	lowest row that contains text pixels
 *	max_y:	highest row that contains text pixels
+*	ctx:	running state of the SegmentText call this line belongs to, which keeps the character boxes
+*	line:	packed rows min_y - 1 through max_y + 1 of the document (rows outside it are background),
+*			PACKED_WORDS(width) words each
 *	Segments characters from the line specified by parameters min_y and max_y and performs feature extraction on
 *	them
 */
-void CharSegment(	DataSet* test_set, DataSet* ts, BinaryDocument* bd, unsigned char* mask, int* vpp, int min_y,
-					int max_y, char* labels, int* char_index, int max_labels) {
+void CharSegment(	DataSet* test_set, DataSet* ts, const BinaryDocument* bd, const unsigned long long* line, int* vpp, int min_y,
+					int max_y, char* labels, int max_labels, SegmentContext* ctx) {
 	int width = bd->width;
+	int words_per_row = PACKED_WORDS(width);
 	int line_height = max_y - min_y + 1;
 	if (line_height == 0) return;
 
@@ -50,9 +178,9 @@ void CharSegment(	DataSet* test_set, DataSet* ts, BinaryDocument* bd, unsigned c
 				}
 				else {	// try to see if space between this and previous character
 					int horiz_gap = x - char_max_x;
-					if (horiz_gap >= SPACE_THRESHOLD * avg_char_width) {
+					if (horiz_gap >= SPACE_THRESHOLD * ctx->avg_char_width) {
 						// create space character
-						DataPoint* space = NewDataPoint(' ', NULL);
+						DataPoint* space = NewDataPointIn(test_set, ' ', NULL);
 						AddTrainingData(test_set, space);
 					}
 				}
@@ -79,12 +207,8 @@ void CharSegment(	DataSet* test_set, DataSet* ts, BinaryDocument* bd, unsigned c
 				// find the horizontal boundaries for the character (char_max_y and char_min_y
 				int text_encountered = 0;		// flag that sets to 1 when a horz slice containing text is encountered
 				for (y = min_y - 1; y <= max_y + 1; y++) {
-					int fg_pixel_count = 0;			// pixel count of a horizontal slice of the text region
-					for (x = char_min_x + 1; x < char_max_x; x++) {
-						if (bd->image[x + y * width] == !bd->background_color) {
-							fg_pixel_count++;
-						}
-					}
+					// pixel count of a horizontal slice of the text region
+					int fg_pixel_count = CountRowForeground(line + (y - min_y + 1) * words_per_row, char_min_x + 1, char_max_x);
 
 					if (fg_pixel_count > 0) {
 						//find lowest black pixel in the character
@@ -105,172 +229,419 @@ void CharSegment(	DataSet* test_set, DataSet* ts, BinaryDocument* bd, unsigned c
 
 				int char_height = char_max_y - char_min_y - 1;
 
-				// draw vertical lines in the mask
-				for (y = char_min_y; y <= char_max_y; y++) {
-					mask[char_min_x + y * width] = 1;
-					mask[char_max_x + y * width] = 1;
-				}
-
-				// draw horizontal lines in the mask
-				for (x = char_min_x; x <= char_max_x; x++) {
-					mask[x + char_min_y * width] = 1;
-					mask[x + char_max_y * width] = 1;
-				}
-
 				// from the character's pixels, obtain the feature vector	
-				int char_pos = (char_min_x + 1) + (char_min_y + 1) * bd->width;		// position of the beginning of the character (LLC) with respect to the entire document
+				int char_x = char_min_x + 1;		// position of the beginning of the character (LLC) with respect to the line
+				int char_y = char_min_y + 1 - (min_y - 1);
+				int point = AddCharacter(	test_set, ts, bd, line, words_per_row, char_x, char_y, char_width, char_height, char_min_y, char_max_y,
+											min_y, max_y, labels, max_labels, ctx);
+				AddGlyph(ctx, char_x, char_min_y + 1, char_width, char_height, point);
+			}
+		}
+	}
+}
 
-				int is_small_punct = 0;			// character is small punctuation (period, comma, quote, etc)
-				int line_mid = (min_y + max_y) / 2;
-				if ((double)char_height / line_height <= PUNCTUATION_THRESHOLD) {
-					if (char_min_y > 0.9 * line_mid || char_max_y < 1.1 * line_mid) {
-						is_small_punct = 1;
-					}
-				}
+/*
+*	Rows are fed in order. the rows of the current line of text (plus one of margin above it) are
+*	kept in line, so lines are found and segmented in the same pass that builds the profile
+*/
+void TextSegmenter_Init(TextSegmenter* segmenter, DataSet* ts, const BinaryDocument* bd, char* labels, int num_labels, int keep_glyphs, Arena* arena) {
+	int width = bd->width;
+	int words_per_row = PACKED_WORDS(width);
+	int i;
+	InitContext(&segmenter->ctx, keep_glyphs);
+	segmenter->output_set = EmptyDataSetIn(arena);
+	segmenter->ts = ts;
+	segmenter->labels = labels;
+	segmenter->num_labels = num_labels;
+	segmenter->bd = bd;
+
+	// vertical projection profile for a single line of text
+	// (it has room for the padding bits of the last word, which are never set)
+	segmenter->vpp = (int*)MemAllocate(sizeof(int) * (words_per_row > 0 ? words_per_row : 1) * PACKED_WORD_BITS);
+	segmenter->line_capacity = 2;
+	segmenter->line = (unsigned long long*)MemAllocate(sizeof(unsigned long long) * segmenter->line_capacity * (words_per_row > 0 ? words_per_row : 1));
+	segmenter->line_first = -1;				// document row held in the first row of line
+	for (i = 0; i < words_per_row; i++) segmenter->line[i] = 0;		// margin above the first row of the image
+	segmenter->y = 0;
+	segmenter->text_run_start = 0;
+	segmenter->in_text_run = 0;
+}
 
-				double* feature_vector;
+unsigned long long* TextSegmenter_RowBuffer(TextSegmenter* segmenter) {
+	int words_per_row = PACKED_WORDS(segmenter->bd->width);
+	if (segmenter->y - segmenter->line_first >= segmenter->line_capacity) {
+		unsigned long long* grown = (unsigned long long*)MemAllocate(sizeof(unsigned long long) * 2 * segmenter->line_capacity * words_per_row);
+		memcpy(grown, segmenter->line, sizeof(unsigned long long) * segmenter->line_capacity * words_per_row);
+		FreeMemory(segmenter->line);
+		segmenter->line = grown;
+		segmenter->line_capacity *= 2;
+	}
+	return segmenter->line + (segmenter->y - segmenter->line_first) * words_per_row;
+}
 
-				/*	If the segmented character is classified as a "small" punctuation (period, comma, etc.)*/
-				if (is_small_punct) {		
-					//check if starting point is lower than midpoint. If so, classify as either period or comma (very basic implementation)
-					if (char_min_y > 0.9 * line_mid) {
-						DataPoint* punct;
+// spaces between lines are classified as horizontal slices where the % of foreground pixels is less than HOR_THRESHOLD
+void TextSegmenter_AddRow(TextSegmenter* segmenter) {
+	const BinaryDocument* bd = segmenter->bd;
+	int width = bd->width;
+	int words_per_row = PACKED_WORDS(width);
+	int y = segmenter->y;
+	unsigned long long* line = segmenter->line;
+	const unsigned long long* words = line + (y - segmenter->line_first) * words_per_row;
+	int x;
+
+	// number of foreground pixels of the row (its value in the horizontal projection profile)
+	int fg_pixel_count = CountRowForeground(words, 0, width);
+	double pct_text = (double)fg_pixel_count / width;
+
+	// find beginning of a run of text
+	if (!segmenter->in_text_run) {
+		if (pct_text > HOR_THRESHOLD) {		// find white space in histogram
+											// signal beginning of run
+			segmenter->text_run_start = y;
+			segmenter->in_text_run = 1;
+
+			// the vertical projection profile of the line is summed as its rows arrive, while they are in cache
+			for (x = 0; x < width; x++) {
+				segmenter->vpp[x] = 0;
+			}
+			AddColumnCounts(words, words_per_row, segmenter->vpp);
+		}
+	}
 
-						// if height is sufficiently bigger than its width, classify as a comma
-						if (char_height > 1.4 * char_width) {
-							punct = NewDataPoint(',', NULL);
-						}
-						else {		// classify as a period
-							punct = NewDataPoint('.', NULL);
-						}
-						AddTrainingData(test_set, punct);
-					}
-					else if (char_max_y < 1.1 * line_mid) {		// classify as single quote (since it's the most common)
-						DataPoint* punct = NewDataPoint('\'', NULL);
-						AddTrainingData(test_set, punct);
-					}
-				}
+	// find the end of a run of text
+	else {
+		if (pct_text <= HOR_THRESHOLD) {
+			segmenter->in_text_run = 0;
+			int text_run_end = y - 1;
+
+			// do character segmentation on the row
+			CharSegment(	segmenter->output_set, segmenter->ts, bd, line, segmenter->vpp, segmenter->text_run_start,
+							text_run_end, segmenter->labels, segmenter->num_labels, &segmenter->ctx);		// segment individual characters
+			segmenter->ctx.line_index++;
+			// insert newline character 
+			DataPoint* new_line = NewDataPointIn(segmenter->output_set, '\n', NULL);
+			AddTrainingData(segmenter->output_set, new_line);
+		}
+		else {
+			AddColumnCounts(words, words_per_row, segmenter->vpp);
+		}
+	}
 
-				/*	If the segmented character is classified as a regular alphanumeric character	*/
-				else {	
-					feature_vector = GetFeatureVector(bd->image + char_pos, char_height, char_width, bd->width);
-					
-					// figure out if point is training data
-					int isTrainingData = 0;
-					if (*char_index < max_labels) {
-						isTrainingData = 1;
-					}
-					else {
-						isTrainingData = 0;
-					}
+	// outside a run of text only this row is kept, as the margin of a line that may start below it
+	if (!segmenter->in_text_run && segmenter->line_first != y) {
+		memcpy(line, line + (y - segmenter->line_first) * words_per_row, sizeof(unsigned long long) * words_per_row);
+		segmenter->line_first = y;
+	}
+	segmenter->y++;
+}
 
-					// create and add a training data object if the current character is part of the training set
-					if (isTrainingData) {
-						char training_label = labels[*char_index];
-						DataPoint* training_data = NewDataPoint(training_label, feature_vector);
-						int size = ts->Size;
-						int allocated = ts->Allocated;
-						AddTrainingData(ts, training_data);
-					}
+DataSet* TextSegmenter_Finish(TextSegmenter* segmenter, GlyphBox** glyphs, int* glyph_count) {
+	if (glyphs) {
+		*glyphs = segmenter->ctx.glyphs;
+		*glyph_count = segmenter->ctx.glyph_count;
+	}
+	else {
+		FreeMemory(segmenter->ctx.glyphs);
+	}
+	FreeMemory(segmenter->vpp);
+	FreeMemory(segmenter->line);
+	return segmenter->output_set;
+}
 
-					// otherwise, the data object is part of the test set 
-					// store the feature vector in a dataset to perform KNN classification on later
-					else {
-						DataPoint* dp = NewDataPoint((char)0, feature_vector);	// use null char to signify points that have not been classified yet
-						AddTrainingData(test_set, dp);
-					}
+/*
+*	Parses the entire document image and attempts to segment individual characters
+*	The image is read a packed row at a time through BinaryDocument_GetPackedRow, so it may be
+*	packed, and a document deskewed with DeskewVirtual() is segmented without ever being
+*	rotated: only the rows of one line of text are held rotated at a time. the projection
+*	profiles count pixels a word at a time
+*/
+static DataSet* SegmentProfiles(DataSet* training, BinaryDocument* bd, char* symbols, int num_symbols, Arena* arena) {
+	TextSegmenter segmenter;
+	TextSegmenter_Init(&segmenter, training, bd, symbols, num_symbols, 1, arena);
+	int width = bd->width;
+	unsigned char* scratch = (unsigned char*)MemAllocate(sizeof(unsigned char) * (width > 0 ? width : 1));		// unpacked row
+	int y;
+	for (y = 0; y < bd->height; y++) {
+		unsigned long long* row_buffer = TextSegmenter_RowBuffer(&segmenter);
+		const unsigned long long* row = BinaryDocument_GetPackedRow(bd, y, scratch, row_buffer);
+		if (row != row_buffer) memcpy(row_buffer, row, sizeof(unsigned long long) * PACKED_WORDS(width));
+		TextSegmenter_AddRow(&segmenter);
+	}
+	FreeMemory(scratch);
+	FreeMemory(bd->glyphs);
+	return TextSegmenter_Finish(&segmenter, &bd->glyphs, &bd->glyph_count);
+}
 
-					(*char_index)++;
+DataSet* SegmentText(DataSet* training, BinaryDocument* bd, char* symbols, int num_symbols) {
+	return SegmentProfiles(training, bd, symbols, num_symbols, NULL);
+}
 
-					// get running sum of widths
-					total_char_width += char_width;
-					avg_char_width = total_char_width / (*char_index);
-				}
-			}
-		}
+DataSet* SegmentTextStream(DataSet* training, BinarizeStream* stream, char* symbols, int num_symbols, Arena* arena) {
+	const BinaryDocument* bd = BinarizeStream_Document(stream);
+	TextSegmenter segmenter;
+	TextSegmenter_Init(&segmenter, training, bd, symbols, num_symbols, 0, arena);
+	const unsigned long long* row;
+	while ((row = BinarizeStream_NextRow(stream)) != NULL) {
+		memcpy(TextSegmenter_RowBuffer(&segmenter), row, sizeof(unsigned long long) * PACKED_WORDS(bd->width));
+		TextSegmenter_AddRow(&segmenter);
+	}
+	DataSet* test_set = TextSegmenter_Finish(&segmenter, NULL, NULL);
+	if (BinarizeStream_Failed(stream)) {		// a partial page is no page
+		FreeDataSet(test_set);
+		return NULL;
 	}
+	return test_set;
 }
 
+
 /*
-*	Parses the entire document image and attempts to segment individual characters
+*	Connected component segmentation
 */
-DataSet* SegmentText(DataSet* training, BinaryDocument* bd, char* symbols, int num_symbols) {
-	avg_char_width = 0;
-	total_char_width = 0;
+typedef struct {
+	int key;					// sort key, then tie
+	int tie;
+	int component;
+} ComponentKey;
+
+static int CompareComponentKeys(const void* a, const void* b) {
+	const ComponentKey* first = (const ComponentKey*)a;
+	const ComponentKey* second = (const ComponentKey*)b;
+	if (first->key != second->key) return first->key < second->key ? -1 : 1;
+	if (first->tie != second->tie) return first->tie < second->tie ? -1 : 1;
+	return first->component - second->component;
+}
 
-	DataSet* output_set = EmptyDataSet();
-	int foo = training->Size;
-	int char_index = 0;
+static int CompareInts(const void* a, const void* b) {
+	return *(const int*)a - *(const int*)b;
+}
 
-	int height = bd->height;
-	int width = bd->width;
-	int* hpp = (int*)MemAllocate(sizeof(int)*height);		// horizontal projection profile for the entire image
-	int* vpp = (int*)MemAllocate(sizeof(int)*width);			// vertical projection profile for a single line of text
-	int i;
-	for (i = 0; i < height; i++) hpp[i] = 0;
-	for (i = 0; i < width; i++) vpp[i] = 0;
+// sets the bits of the pixels of the component, relative to (min_x, min_y), in rows
+static void DrawComponent(const ComponentLabeling* labeling, const Component* component, int min_x, int min_y, unsigned long long* rows, int words_per_row) {
+	int r, x;
+	for (r = 0; r < component->run_count; r++) {
+		const ComponentRun* run = &labeling->runs[component->first_run + r];
+		unsigned long long* row = rows + (run->y - min_y) * words_per_row;
+		for (x = run->x_start - min_x; x < run->x_end - min_x; x++) {
+			row[x / PACKED_WORD_BITS] |= 1ULL << (x % PACKED_WORD_BITS);
+		}
+	}
+}
 
-	//allocate space for mask image
-	unsigned char* mask = (unsigned char*)MemAllocate(sizeof(unsigned char) * height * width);
-	for (i = 0; i < height*width; i++) {
-		mask[i] = 0;
+DataSet* SegmentTextComponents(DataSet* training, BinaryDocument* bd, char* symbols, int num_symbols, Arena* arena) {
+	SegmentContext ctx;
+	InitContext(&ctx, 1);
+	DataSet* output_set = EmptyDataSetIn(arena);
+	int i, j, l;
+
+	ComponentLabeling labeling = LabelComponents(bd);
+	Component* components = labeling.components;
+	int count = labeling.component_count;
+	int allocated = count > 0 ? count : 1;
+
+	// typical character height: the median height of the components that are not noise
+	int* heights = MemAllocate(sizeof(int) * allocated);
+	int kept = 0;
+	for (i = 0; i < count; i++) {
+		if (components[i].pixel_count >= COMPONENT_MIN_PIXELS) {
+			heights[kept++] = components[i].max_y - components[i].min_y + 1;
+		}
+	}
+	qsort(heights, kept, sizeof(int), CompareInts);
+	int median_height = kept > 0 ? heights[kept / 2] : 0;
+	FreeMemory(heights);
+
+	// lines are grown top to bottom from the components of full height, taken by their middle row:
+	// a component whose middle is below every row of the current line starts the next one
+	ComponentKey* keys = MemAllocate(sizeof(ComponentKey) * allocated);
+	int key_count = 0;
+	for (i = 0; i < count; i++) {
+		int component_height = components[i].max_y - components[i].min_y + 1;
+		if (components[i].pixel_count >= COMPONENT_MIN_PIXELS && component_height >= CORE_HEIGHT_FRACTION * median_height
+			&& component_height <= TALL_HEIGHT_FRACTION * median_height) {
+			keys[key_count].key = components[i].min_y + components[i].max_y;
+			keys[key_count].tie = components[i].min_x;
+			keys[key_count].component = i;
+			key_count++;
+		}
+	}
+	qsort(keys, key_count, sizeof(ComponentKey), CompareComponentKeys);
+
+	int* line_of = MemAllocate(sizeof(int) * allocated);		// line of each component, -1 for noise
+	int* core_min_y = MemAllocate(sizeof(int) * (key_count > 0 ? key_count : 1));
+	int* core_max_y = MemAllocate(sizeof(int) * (key_count > 0 ? key_count : 1));
+	int line_count = 0;
+	for (i = 0; i < count; i++) {
+		line_of[i] = -1;
+	}
+	for (i = 0; i < key_count; i++) {
+		Component* component = &components[keys[i].component];
+		int middle = (component->min_y + component->max_y) / 2;
+		if (line_count == 0 || middle > core_max_y[line_count - 1]) {
+			core_min_y[line_count] = component->min_y;
+			core_max_y[line_count] = component->max_y;
+			line_count++;
+		}
+		else {
+			if (component->min_y < core_min_y[line_count - 1]) core_min_y[line_count - 1] = component->min_y;
+			if (component->max_y > core_max_y[line_count - 1]) core_max_y[line_count - 1] = component->max_y;
+		}
+		line_of[keys[i].component] = line_count - 1;
 	}
 
-	// populate horizontal projection profile with number of foreground pixels
-	int x, y;
-	for (y = 0; y < height;	y++) {
-		for (x = 0; x < width; x++) {
-			if (bd->image[x + y * width] != bd->background_color) {
-				hpp[y]++;
+	// the other components join the line nearest to their middle row
+	for (i = 0; i < count; i++) {
+		if (line_of[i] >= 0 || components[i].pixel_count < COMPONENT_MIN_PIXELS) continue;
+		int middle = (components[i].min_y + components[i].max_y) / 2;
+		int best_distance = 0;
+		for (l = 0; l < line_count; l++) {
+			int distance = middle < core_min_y[l] ? core_min_y[l] - middle : middle > core_max_y[l] ? middle - core_max_y[l] : 0;
+			if (line_of[i] < 0 || distance < best_distance) {
+				line_of[i] = l;
+				best_distance = distance;
 			}
 		}
 	}
 
-	// determine horizontal lines the in the mask
-	// spaces between lines are classified as horizontal slices where the % of foreground pixels is less than HOR_THRESHOLD
-	//int horz_text_encountered = 0;		// during row analysis, set to one once the program finds an image row that crosses through text
-	int text_run_start = 0;					// beginning of run of rows including text
-	int text_run_end = 0;
-	int in_text_run = 0;					// signals whether in the middle of a current run
-	for (y = 0; y < bd->height; y++) {
-		double pct_text = (double)hpp[y] / bd->width;
+	// text rows of each line, over all of its components, and the components grouped by line
+	int* line_min_y = MemAllocate(sizeof(int) * (line_count > 0 ? line_count : 1));
+	int* line_max_y = MemAllocate(sizeof(int) * (line_count > 0 ? line_count : 1));
+	int* line_start = MemAllocate(sizeof(int) * (line_count + 1));
+	for (l = 0; l < line_count; l++) {
+		line_min_y[l] = core_min_y[l];
+		line_max_y[l] = core_max_y[l];
+		line_start[l] = 0;
+	}
+	line_start[line_count] = 0;
+	for (i = 0; i < count; i++) {
+		l = line_of[i];
+		if (l < 0) continue;
+		if (components[i].min_y < line_min_y[l]) line_min_y[l] = components[i].min_y;
+		if (components[i].max_y > line_max_y[l]) line_max_y[l] = components[i].max_y;
+		line_start[l + 1]++;
+	}
+	for (l = 0; l < line_count; l++) {
+		line_start[l + 1] += line_start[l];
+	}
+	int* line_fill = MemAllocate(sizeof(int) * (line_count > 0 ? line_count : 1));
+	for (l = 0; l < line_count; l++) {
+		line_fill[l] = line_start[l];
+	}
+	for (i = 0; i < count; i++) {
+		l = line_of[i];
+		if (l < 0) continue;
+		keys[line_fill[l]].key = components[i].min_x;
+		keys[line_fill[l]].tie = components[i].min_y;
+		keys[line_fill[l]].component = i;
+		line_fill[l]++;
+	}
 
-		// find beginning of a run of text
-		if (!in_text_run) {
-			if (pct_text > HOR_THRESHOLD) {		// find white space in histogram
-													// signal beginning of run
-				text_run_start = y;
-				in_text_run = 1;
+	for (l = 0; l < line_count; l++) {
+		ComponentKey* line_keys = keys + line_start[l];
+		ctx.line_index = l;
+		int line_size = line_start[l + 1] - line_start[l];
+		qsort(line_keys, line_size, sizeof(ComponentKey), CompareComponentKeys);
+
+		int previous_end = -1;		// column after the previous character of the line
+		j = 0;
+		while (j < line_size) {
+			// a character: a component and those after it that overlap it (the dot of an i, the parts of a colon)
+			int first = j;
+			Component* component = &components[line_keys[j].component];
+			int char_min_x = component->min_x;
+			int char_max_x = component->max_x;
+			int char_min_y = component->min_y;
+			int char_max_y = component->max_y;
+			for (j = first + 1; j < line_size; j++) {
+				component = &components[line_keys[j].component];
+				int overlap = (component->max_x < char_max_x ? component->max_x : char_max_x) - component->min_x + 1;
+				int narrower = component->max_x - component->min_x < char_max_x - char_min_x ? component->max_x - component->min_x + 1 : char_max_x - char_min_x + 1;
+				// a small component wholly above another one it overlaps at all is its dot or accent, even slanted
+				int is_mark = component->max_x - component->min_x + 1 <= narrower && component->max_y < char_min_y && overlap > 0
+					&& component->max_y - component->min_y + 1 < CORE_HEIGHT_FRACTION * median_height;
+				if (overlap < GLYPH_OVERLAP * narrower && !is_mark) break;
+				if (component->max_x > char_max_x) char_max_x = component->max_x;
+				if (component->min_y < char_min_y) char_min_y = component->min_y;
+				if (component->max_y > char_max_y) char_max_y = component->max_y;
 			}
-		}
-
-		// find the end of a run of text
-		else {
-			if (pct_text <= HOR_THRESHOLD) {
-				in_text_run = 0;
-				text_run_end = y - 1;
-
-				// do character segmentation on the row
-				// compute vertical projection profile
-				for (x = 0; x < bd->width; x++) {
-					vpp[x] = 0;
-					for (y = text_run_start; y <= text_run_end; y++) {
-						if (bd->image[x + y * width] == !bd->background_color) {
-							vpp[x]++;
-						}
-					}
-				}
-				CharSegment(	output_set, training, bd, mask, vpp, text_run_start, 
-								text_run_end, symbols, &char_index, num_symbols);		// segment individual characters
-				// insert newline character 
-				DataPoint* new_line = NewDataPoint('\n', NULL);
-				AddTrainingData(output_set, new_line);
+			int char_width = char_max_x - char_min_x + 1;
+			int char_height = char_max_y - char_min_y + 1;
 
+			// try to see if space between this and previous character
+			if (previous_end >= 0 && char_min_x - previous_end >= SPACE_THRESHOLD * ctx.avg_char_width) {
+				DataPoint* space = NewDataPointIn(output_set, ' ', NULL);
+				AddTrainingData(output_set, space);
 			}
+			previous_end = char_max_x + 1;
+
+			// the character is made of its own pixels, leaving out any neighbor that reaches into its box.
+			// its raster is scratch, taken from the arena of the page when there is one
+			int words_per_row = PACKED_WORDS(char_width);
+			size_t rows_size = sizeof(unsigned long long) * words_per_row * char_height;
+			unsigned long long* rows = arena ? ArenaAllocate(arena, rows_size) : MemAllocate(rows_size);
+			for (i = 0; i < words_per_row * char_height; i++) {
+				rows[i] = 0;
+			}
+			for (i = first; i < j; i++) {
+				DrawComponent(&labeling, &components[line_keys[i].component], char_min_x, char_min_y, rows, words_per_row);
+			}
+			int point = AddCharacter(	output_set, training, bd, rows, words_per_row, 0, 0, char_width, char_height, char_min_y - 1, char_max_y + 1,
+										line_min_y[l], line_max_y[l], symbols, num_symbols, &ctx);
+			if (!arena) FreeMemory(rows);
+			AddGlyph(&ctx, char_min_x, char_min_y, char_width, char_height, point);
 		}
+
+		// insert newline character
+		DataPoint* new_line = NewDataPointIn(output_set, '\n', NULL);
+		AddTrainingData(output_set, new_line);
 	}
-	bd->boundaries = mask;
 
+	FreeMemory(keys);
+	FreeMemory(line_of);
+	FreeMemory(core_min_y);
+	FreeMemory(core_max_y);
+	FreeMemory(line_min_y);
+	FreeMemory(line_max_y);
+	FreeMemory(line_start);
+	FreeMemory(line_fill);
+	ComponentLabeling_Free(&labeling);
+	FreeMemory(bd->glyphs);
+	bd->glyphs = ctx.glyphs;
+	bd->glyph_count = ctx.glyph_count;
 	return output_set;
 }
 
+unsigned char* DrawGlyphBoundaries(const BinaryDocument* bd) {
+	int width = bd->width;
+	int height = bd->height;
+	unsigned char* mask = (unsigned char*)MemAllocate(sizeof(unsigned char) * (height * width > 0 ? height * width : 1));
+	int i, x, y;
+	memset(mask, 0, sizeof(unsigned char) * height * width);
+	for (i = 0; i < bd->glyph_count; i++) {
+		const GlyphBox* box = &bd->glyphs[i];
+
+		// the boundary runs a pixel outside the character, clipped to the page
+		int left = box->x > 0 ? box->x - 1 : 0;
+		int right = box->x + box->width < width ? box->x + box->width : width - 1;
+		int top = box->y > 0 ? box->y - 1 : 0;
+		int bottom = box->y + box->height < height ? box->y + box->height : height - 1;
+		if (bottom < top) bottom = top;
+
+		// vertical lines, then horizontal lines
+		for (y = top; y <= bottom; y++) {
+			mask[left + y * width] = 1;
+			mask[right + y * width] = 1;
+		}
+		for (x = left; x <= right; x++) {
+			mask[x + top * width] = 1;
+			mask[x + bottom * width] = 1;
+		}
+	}
+	return mask;
+}
+
+DataSet* SegmentTextWithMethod(DataSet* training, BinaryDocument* bd, char* symbols, int num_symbols, SegmentMethod method, Arena* arena) {
+	if (method == SEGMENT_COMPONENTS) {
+		return SegmentTextComponents(training, bd, symbols, num_symbols, arena);
+	}
+	return SegmentProfiles(training, bd, symbols, num_symbols, arena);
+}
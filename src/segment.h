@@ -4,10 +4,92 @@
 #include "preprocess.h"
 #include "ocr.h"
 
-void CharSegment(	DataSet* test_set, DataSet* ts, BinaryDocument* bd, unsigned char* mask, int* vpp, int min_y,
-					int max_y, char* labels, int* char_index, int max_labels);
+/*
+*	Running state of a single SegmentText call. Every call owns its own context,
+*	so any number of pages may be segmented concurrently.
+*/
+typedef struct _SegmentContext {
+	int char_index;				// number of alphanumeric characters segmented so far
+	int total_char_width;		// running sum of the width of the segmented characters
+	double avg_char_width;		// running average of the width of the segmented characters
+	int line_index;				// line of text being segmented, from 0
+	GlyphBox* glyphs;			// boxes of the characters segmented so far, or NULL when they are not kept
+	int glyph_count;
+	int glyph_capacity;
+} SegmentContext;
 
+void CharSegment(	DataSet* test_set, DataSet* ts, const BinaryDocument* bd, const unsigned long long* line, int* vpp, int min_y,
+					int max_y, char* labels, int max_labels, SegmentContext* ctx);
+
+// also leaves the boxes of the characters in bd->glyphs, replacing those of any earlier segmentation
 DataSet* SegmentText( DataSet* ts, BinaryDocument* bd, char* labels, int num_labels);
 
+/*
+*	Returns a page sized image (height * width bytes, to be freed by the caller) that is 1 on the
+*	boundary drawn a pixel outside each box of bd->glyphs and 0 elsewhere. When superimposed with the
+*	document, the lines identify each individual character. Only built for inspection; segmentation
+*	itself never draws it
+*/
+unsigned char* DrawGlyphBoundaries(const BinaryDocument* bd);
+
+/*
+*	Segments a page that is fed to it a packed row at a time, from the top (see SegmentText).
+*	Only the rows of the current line of text are kept, so a page can be segmented while it
+*	is being read.
+*/
+typedef struct _TextSegmenter {
+	SegmentContext ctx;
+	DataSet* output_set;		// characters segmented so far
+	DataSet* ts;				// training set and labels, as passed to SegmentText
+	char* labels;
+	int num_labels;
+	const BinaryDocument* bd;	// size and colors of the page
+	int* vpp;					// vertical projection profile of the current line, over its rows so far
+	unsigned long long* line;	// rows line_first onwards, PACKED_WORDS(width) words each
+	int line_capacity;			// rows that line has room for
+	int line_first;
+	int y;						// next row
+	int text_run_start;			// first row of the current line of text
+	int in_text_run;
+} TextSegmenter;
+
+// keep_glyphs keeps the boxes of the characters, for TextSegmenter_Finish() to hand over. the data set of
+// the characters is allocated from arena (see EmptyDataSetIn) unless it is NULL
+void TextSegmenter_Init(TextSegmenter* segmenter, DataSet* ts, const BinaryDocument* bd, char* labels, int num_labels, int keep_glyphs,
+	Arena* arena);
+
+// where the next row is to be written before calling TextSegmenter_AddRow()
+unsigned long long* TextSegmenter_RowBuffer(TextSegmenter* segmenter);
+
+void TextSegmenter_AddRow(TextSegmenter* segmenter);
+
+// frees the segmenter and returns the segmented characters. their boxes (NULL unless kept) go to
+// *glyphs and *glyph_count, or are freed if glyphs is NULL
+DataSet* TextSegmenter_Finish(TextSegmenter* segmenter, GlyphBox** glyphs, int* glyph_count);
+
+// segments the page of a stream as it is binarized, without keeping the boxes of the characters.
+// returns NULL if the stream fails before the end of the page
+DataSet* SegmentTextStream(DataSet* ts, BinarizeStream* stream, char* labels, int num_labels, Arena* arena);
+
+/*
+*	Segments the page from its connected components (see components.h) instead of its projection
+*	profiles: the components of full height are grouped into lines, the smaller ones (dots, accents,
+*	punctuation) join the nearest line, and components of a line that overlap horizontally form a
+*	single character. Each character is made of its own pixels only, so lines whose descenders and
+*	ascenders share rows are still split into characters. Slanted (italic) text is split into the right
+*	number of characters, but the classifier only knows upright ones and reads it no better than with
+*	SegmentText. Takes the same arguments and gives the same kind of data set as SegmentText,
+*	allocated from arena unless it is NULL
+*/
+DataSet* SegmentTextComponents(DataSet* ts, BinaryDocument* bd, char* labels, int num_labels, Arena* arena);
+
+typedef enum _SegmentMethod {
+	SEGMENT_PROFILE,			// projection profiles (SegmentText)
+	SEGMENT_COMPONENTS			// connected components (SegmentTextComponents)
+} SegmentMethod;
+
+// the data set of the characters is allocated from arena (see EmptyDataSetIn) unless it is NULL
+DataSet* SegmentTextWithMethod(DataSet* ts, BinaryDocument* bd, char* labels, int num_labels, SegmentMethod method, Arena* arena);
+
 #endif
 
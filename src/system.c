@@ -1,8 +1,23 @@
 #include "system.h"
+#include <string.h>
+#include <ctype.h>
 
 #if LCDK == 1
 #include "m_mem.h"
+#include <time.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #endif
+#include <stdio.h>
 
 void* MemAllocate(size_t size) {
 #if LCDK == 0 
@@ -20,3 +35,498 @@ void FreeMemory(void* ptr) {
 #endif
 }
 
+// over-allocates with MemAllocate and keeps the original pointer just in front of the aligned block,
+// which works the same on every platform (including the LCDK's allocator)
+void* MemAllocateAligned(size_t size, size_t alignment) {
+	unsigned char* raw = MemAllocate(size + alignment + sizeof(void*));
+	if (!raw) return NULL;
+	size_t address = (size_t)(raw + sizeof(void*));
+	unsigned char* aligned = (unsigned char*)((address + alignment - 1) & ~(alignment - 1));
+	((void**)aligned)[-1] = raw;
+	return aligned;
+}
+
+void FreeAligned(void* ptr) {
+	if (ptr) FreeMemory(((void**)ptr)[-1]);
+}
+
+
+/*****************************************************************
+*	Arenas
+*	The blocks form a list. Allocations are carved from the current block, moving on to
+*	the next one (kept from before a reset) or a new one when it is full
+*****************************************************************/
+typedef struct _ArenaBlock {
+	struct _ArenaBlock* next;
+	size_t size;					// bytes of data after the header
+	size_t used;
+} ArenaBlock;
+
+struct _Arena {
+	ArenaBlock* first;
+	ArenaBlock* current;
+	size_t block_size;
+};
+
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+#define ARENA_HEADER ARENA_ROUND(sizeof(ArenaBlock))
+
+static ArenaBlock* NewArenaBlock(size_t size) {
+	// MemAllocate only guarantees the alignment of a double, so the block is aligned by hand
+	ArenaBlock* block = MemAllocateAligned(ARENA_HEADER + size, ARENA_ALIGNMENT);
+	if (!block) return NULL;
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+Arena* ArenaCreate(size_t block_size) {
+	Arena* arena = MemAllocate(sizeof(Arena));
+	arena->first = NULL;
+	arena->current = NULL;
+	arena->block_size = ARENA_ROUND(block_size > 0 ? block_size : ARENA_ALIGNMENT);
+	return arena;
+}
+
+void* ArenaAllocate(Arena* arena, size_t size) {
+	size = ARENA_ROUND(size > 0 ? size : 1);
+	ArenaBlock* block = arena->current;
+	if (block && block->size - block->used >= size) {
+		void* ptr = (unsigned char*)block + ARENA_HEADER + block->used;
+		block->used += size;
+		return ptr;
+	}
+
+	// the next block, if it was kept by a reset and the allocation fits in it
+	ArenaBlock* next = block ? block->next : arena->first;
+	if (!next || next->size < size) {
+		ArenaBlock* fresh = NewArenaBlock(size > arena->block_size ? size : arena->block_size);
+		if (!fresh) return NULL;
+		fresh->next = next;
+		if (block) block->next = fresh;
+		else arena->first = fresh;
+		next = fresh;
+	}
+	next->used = size;
+	arena->current = next;
+	return (unsigned char*)next + ARENA_HEADER;
+}
+
+void ArenaReset(Arena* arena) {
+	ArenaBlock* block;
+	for (block = arena->first; block; block = block->next) {
+		block->used = 0;
+	}
+	arena->current = arena->first;
+}
+
+void ArenaFree(Arena* arena) {
+	if (!arena) return;
+	ArenaBlock* block = arena->first;
+	while (block) {
+		ArenaBlock* next = block->next;
+		FreeAligned(block);
+		block = next;
+	}
+	FreeMemory(arena);
+}
+
+size_t ArenaCapacity(const Arena* arena) {
+	size_t capacity = 0;
+	const ArenaBlock* block;
+	for (block = arena->first; block; block = block->next) {
+		capacity += ARENA_HEADER + block->size;
+	}
+	return capacity;
+}
+
+
+/*****************************************************************
+*	Threading
+*****************************************************************/
+struct _Mutex {
+#if LCDK == 1
+	int unused;
+#elif defined(_WIN32)
+	CRITICAL_SECTION cs;
+#else
+	pthread_mutex_t m;
+#endif
+};
+
+typedef struct {
+	ThreadFunc func;
+	void* arg;
+	int started;		// 0 if the thread could not be created, so the item was run by the caller
+} ThreadStart;
+
+#if LCDK == 0 && defined(_WIN32)
+static DWORD WINAPI ThreadEntry(LPVOID p) {
+	ThreadStart* start = (ThreadStart*)p;
+	start->func(start->arg);
+	return 0;
+}
+#elif LCDK == 0
+static void* ThreadEntry(void* p) {
+	ThreadStart* start = (ThreadStart*)p;
+	start->func(start->arg);
+	return NULL;
+}
+#endif
+
+int GetProcessorCount() {
+#if LCDK == 1
+	return 1;
+#elif defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#endif
+}
+
+static int worker_thread_count = 0;		// 0 until set: use every processor
+
+void SetWorkerThreadCount(int count) {
+	worker_thread_count = count > 0 ? count : 1;
+}
+
+int GetWorkerThreadCount() {
+#if LCDK == 1
+	return 1;
+#else
+	return worker_thread_count > 0 ? worker_thread_count : GetProcessorCount();
+#endif
+}
+
+void RunParallel(ThreadFunc func, void* args, size_t arg_size, int count) {
+	int i;
+	if (count <= 1) {		// no need to spawn anything for a single work item
+		if (count == 1) func(args);
+		return;
+	}
+
+#if LCDK == 1
+	for (i = 0; i < count; i++) {
+		func((char*)args + i * arg_size);
+	}
+#else
+	ThreadStart* starts = MemAllocate(sizeof(ThreadStart) * count);
+#if defined(_WIN32)
+	HANDLE* threads = MemAllocate(sizeof(HANDLE) * count);
+#else
+	pthread_t* threads = MemAllocate(sizeof(pthread_t) * count);
+#endif
+
+	// the calling thread does the first work item itself
+	for (i = 1; i < count; i++) {
+		starts[i].func = func;
+		starts[i].arg = (char*)args + i * arg_size;
+#if defined(_WIN32)
+		threads[i] = CreateThread(NULL, 0, ThreadEntry, &starts[i], 0, NULL);
+		starts[i].started = threads[i] != NULL;
+#else
+		starts[i].started = pthread_create(&threads[i], NULL, ThreadEntry, &starts[i]) == 0;
+#endif
+		// out of threads (e.g. a large -j): the item still has to run, so the caller does it
+		if (!starts[i].started) func(starts[i].arg);
+	}
+	func(args);
+	for (i = 1; i < count; i++) {
+		if (!starts[i].started) continue;
+#if defined(_WIN32)
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+
+	FreeMemory(threads);
+	FreeMemory(starts);
+#endif
+}
+
+Mutex* MutexCreate() {
+	Mutex* m = MemAllocate(sizeof(Mutex));
+#if LCDK == 1
+	m->unused = 0;
+#elif defined(_WIN32)
+	InitializeCriticalSection(&m->cs);
+#else
+	pthread_mutex_init(&m->m, NULL);
+#endif
+	return m;
+}
+
+void MutexLock(Mutex* m) {
+#if LCDK == 0 && defined(_WIN32)
+	EnterCriticalSection(&m->cs);
+#elif LCDK == 0
+	pthread_mutex_lock(&m->m);
+#endif
+}
+
+void MutexUnlock(Mutex* m) {
+#if LCDK == 0 && defined(_WIN32)
+	LeaveCriticalSection(&m->cs);
+#elif LCDK == 0
+	pthread_mutex_unlock(&m->m);
+#endif
+}
+
+void MutexFree(Mutex* m) {
+	if (!m) return;
+#if LCDK == 0 && defined(_WIN32)
+	DeleteCriticalSection(&m->cs);
+#elif LCDK == 0
+	pthread_mutex_destroy(&m->m);
+#endif
+	FreeMemory(m);
+}
+
+
+/*****************************************************************
+*	CPU feature detection
+*****************************************************************/
+#if LCDK == 0 && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define SYSTEM_X86 1
+#if !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+
+static void CPUID(int leaf, int subleaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+	__cpuidex((int*)regs, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// reads the XCR0 register, which tells which register states the OS saves on a context switch
+static unsigned long long ReadXCR0() {
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+#else
+#define SYSTEM_X86 0
+#endif
+
+int GetCPUFeatures() {
+	int features = 0;
+#if SYSTEM_X86
+	unsigned int regs[4];
+	CPUID(0, 0, regs);
+	unsigned int max_leaf = regs[0];
+
+	CPUID(1, 0, regs);
+	if (regs[3] & (1u << 26)) features |= CPU_SSE2;
+	if (regs[2] & (1u << 9)) features |= CPU_SSSE3;
+	int has_fma = (regs[2] >> 12) & 1;
+	int has_osxsave = (regs[2] >> 27) & 1;
+	if (!has_osxsave || max_leaf < 7) return features;
+
+	unsigned long long xcr0 = ReadXCR0();
+	int ymm_enabled = (xcr0 & 0x6) == 0x6;			// SSE and AVX state
+	int zmm_enabled = (xcr0 & 0xe6) == 0xe6;		// plus opmask and upper ZMM state
+
+	CPUID(7, 0, regs);
+	if (ymm_enabled && has_fma && (regs[1] & (1u << 5))) features |= CPU_AVX2;
+	if (zmm_enabled && (regs[1] & (1u << 16))) features |= CPU_AVX512F;
+#endif
+	return features;
+}
+
+
+/*****************************************************************
+*	Timing and file system helpers
+*****************************************************************/
+double GetTimeSeconds() {
+#if LCDK == 1
+	return (double)clock() / CLOCKS_PER_SEC;
+#elif defined(_WIN32)
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+MappedFile* MapFile(const char* path) {
+	MappedFile* file;
+#if LCDK == 1
+	FILE* fp = fopen(path, "rb");
+	if (!fp) return NULL;
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (size <= 0) {
+		fclose(fp);
+		return NULL;
+	}
+	unsigned char* data = MemAllocateAligned(size, 64);
+	if (fread(data, 1, size, fp) != (size_t)size) {
+		FreeAligned(data);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	file = MemAllocate(sizeof(MappedFile));
+	file->Data = data;
+	file->Size = size;
+	file->IsMapped = 0;
+	file->Handle = NULL;
+#elif defined(_WIN32)
+	HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) return NULL;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+		CloseHandle(handle);
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle);			// the mapping keeps the file open
+	if (!mapping) return NULL;
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		CloseHandle(mapping);
+		return NULL;
+	}
+	file = MemAllocate(sizeof(MappedFile));
+	file->Data = data;
+	file->Size = (size_t)size.QuadPart;
+	file->IsMapped = 1;
+	file->Handle = mapping;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);						// the mapping keeps the file open
+	if (data == MAP_FAILED) return NULL;
+	file = MemAllocate(sizeof(MappedFile));
+	file->Data = data;
+	file->Size = st.st_size;
+	file->IsMapped = 1;
+	file->Handle = NULL;
+#endif
+	return file;
+}
+
+void UnmapFile(MappedFile* file) {
+	if (!file) return;
+#if LCDK == 1
+	FreeAligned((void*)file->Data);
+#elif defined(_WIN32)
+	UnmapViewOfFile(file->Data);
+	CloseHandle(file->Handle);
+#else
+	munmap((void*)file->Data, file->Size);
+#endif
+	FreeMemory(file);
+}
+
+int IsDirectory(const char* path) {
+#if LCDK == 1
+	return 0;
+#elif defined(_WIN32)
+	DWORD attributes = GetFileAttributesA(path);
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+// case insensitive check that name ends in extension
+static int HasExtension(const char* name, const char* extension) {
+	size_t name_len = strlen(name);
+	size_t ext_len = strlen(extension);
+	size_t i;
+	if (name_len < ext_len) return 0;
+	for (i = 0; i < ext_len; i++) {
+		if (tolower((unsigned char)name[name_len - ext_len + i]) != tolower((unsigned char)extension[i])) return 0;
+	}
+	return 1;
+}
+
+static int CompareFileName(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// appends directory/name to the growing files array
+static void AddFile(char*** files, int* count, int* allocated, const char* directory, const char* name) {
+	if (*count == *allocated) {		// LCDK has no support for realloc
+		char** grown;
+		*allocated = *allocated ? *allocated * 2 : 64;
+		grown = MemAllocate(sizeof(char*) * (*allocated));
+		if (*count > 0) memcpy(grown, *files, sizeof(char*) * (*count));
+		if (*files) FreeMemory(*files);
+		*files = grown;
+	}
+	char* path = MemAllocate(strlen(directory) + strlen(name) + 2);
+	strcpy(path, directory);
+	strcat(path, "/");
+	strcat(path, name);
+	(*files)[(*count)++] = path;
+}
+
+char** ListDirectory(const char* path, const char* extension, int* count) {
+	char** files = NULL;
+	int allocated = 0;
+	*count = 0;
+
+#if LCDK == 0 && defined(_WIN32)
+	WIN32_FIND_DATAA data;
+	char* pattern = MemAllocate(strlen(path) + 3);
+	strcpy(pattern, path);
+	strcat(pattern, "/*");
+	HANDLE find = FindFirstFileA(pattern, &data);
+	FreeMemory(pattern);
+	if (find == INVALID_HANDLE_VALUE) return NULL;
+	do {
+		if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && HasExtension(data.cFileName, extension)) {
+			AddFile(&files, count, &allocated, path, data.cFileName);
+		}
+	} while (FindNextFileA(find, &data));
+	FindClose(find);
+#elif LCDK == 0
+	DIR* dir = opendir(path);
+	struct dirent* entry;
+	if (!dir) return NULL;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] != '.' && HasExtension(entry->d_name, extension)) {
+			AddFile(&files, count, &allocated, path, entry->d_name);
+		}
+	}
+	closedir(dir);
+#endif
+
+	if (*count > 1) qsort(files, *count, sizeof(char*), CompareFileName);
+	return files;
+}
+
+void FreeFileList(char** files, int count) {
+	int i;
+	if (!files) return;
+	for (i = 0; i < count; i++) {
+		FreeMemory(files[i]);
+	}
+	FreeMemory(files);
+}
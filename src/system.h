@@ -9,5 +9,142 @@ void* MemAllocate(size_t size);
 
 void FreeMemory(void* ptr);
 
+// allocates size bytes starting at a multiple of alignment (a power of two). free with FreeAligned()
+void* MemAllocateAligned(size_t size, size_t alignment);
+
+void FreeAligned(void* ptr);
+
+/*
+*	Arena (bump) allocator for objects that all die together, such as everything made while
+*	one page is recognized. Allocating only moves a pointer through large blocks taken with
+*	MemAllocate, nothing is freed on its own, and ArenaReset releases it all at once while
+*	keeping the blocks for the next page. An arena is not thread safe: give each thread its own.
+*/
+typedef struct _Arena Arena;
+
+#define ARENA_ALIGNMENT 16			// every allocation starts at a multiple of this
+
+// block_size is the size of the blocks taken from the heap (larger allocations get a block of their own)
+Arena* ArenaCreate(size_t block_size);
+
+// returns NULL only if the heap is exhausted
+void* ArenaAllocate(Arena* arena, size_t size);
+
+// releases everything allocated from the arena, keeping its blocks
+void ArenaReset(Arena* arena);
+
+void ArenaFree(Arena* arena);
+
+// bytes taken from the heap for the blocks of the arena
+size_t ArenaCapacity(const Arena* arena);
+
+/*****************************************************************
+*	Threading
+*	On the LCDK there is no threading support, so every "parallel"
+*	call simply runs its work items one after the other.
+*****************************************************************/
+typedef void (*ThreadFunc)(void* arg);
+
+typedef struct _Mutex Mutex;
+
+// returns the number of online processors (1 on the LCDK)
+int GetProcessorCount();
+
+// number of threads a single image processing stage (e.g. Deskew) may split its work across.
+// defaults to GetProcessorCount(); callers that already run whole pages in parallel set it to 1
+void SetWorkerThreadCount(int count);
+
+int GetWorkerThreadCount();
+
+// runs func on count threads, passing the i-th element of the args array (each arg_size bytes)
+// to the i-th thread, and returns once every thread has finished
+void RunParallel(ThreadFunc func, void* args, size_t arg_size, int count);
+
+Mutex* MutexCreate();
+
+void MutexLock(Mutex* m);
+
+void MutexUnlock(Mutex* m);
+
+void MutexFree(Mutex* m);
+
+/*****************************************************************
+*	CPU feature detection (x86 only, 0 everywhere else)
+*****************************************************************/
+#define CPU_SSE2		0x01
+#define CPU_SSSE3		0x02
+#define CPU_AVX2		0x04		// AVX2 and FMA, with OS support for the YMM state
+#define CPU_AVX512F		0x08		// AVX-512 Foundation, with OS support for the ZMM state
+
+// returns a bitmask of the CPU_ flags above supported by the running processor
+int GetCPUFeatures();
+
+/*****************************************************************
+*	Bit counting on 64 bit words, with the compiler's instruction
+*	where there is one and a portable fallback elsewhere (LCDK)
+*****************************************************************/
+#if defined(_MSC_VER) && LCDK == 0
+#include <intrin.h>
+#endif
+
+// number of set bits of value
+static inline int PopCount64(unsigned long long value) {
+#if defined(__GNUC__)
+	return __builtin_popcountll(value);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	return (int)__popcnt64(value);
+#else
+	value = value - ((value >> 1) & 0x5555555555555555ULL);
+	value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+	value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((value * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// index of the lowest set bit of value, which must not be 0
+static inline int LowestSetBit64(unsigned long long value) {
+#if defined(__GNUC__)
+	return __builtin_ctzll(value);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (int)index;
+#else
+	return PopCount64((value & (0 - value)) - 1);
+#endif
+}
+
+/*****************************************************************
+*	Timing and file system helpers
+*****************************************************************/
+
+// wall clock time in seconds (only meaningful as a difference between two calls)
+double GetTimeSeconds();
+
+/*
+*	Read-only view of a whole file. Where the platform supports it the file is memory mapped,
+*	so the pages are shared between processes and only loaded when touched; otherwise (LCDK)
+*	it is read into an aligned heap buffer. Data is at least 64-byte aligned in both cases.
+*/
+typedef struct _MappedFile {
+	const unsigned char* Data;
+	size_t Size;
+	int IsMapped;			// 1 if Data is a memory mapping, 0 if it is a heap copy
+	void* Handle;			// platform mapping handle (Win32 only)
+} MappedFile;
+
+// returns NULL if the file cannot be opened or is empty
+MappedFile* MapFile(const char* path);
+
+void UnmapFile(MappedFile* file);
+
+// returns 1 if path names an existing directory
+int IsDirectory(const char* path);
+
+// returns a sorted, heap allocated array of heap allocated paths of the files in directory path
+// whose name ends in extension (case insensitive). free with FreeFileList()
+char** ListDirectory(const char* path, const char* extension, int* count);
+
+void FreeFileList(char** files, int count);
 
 #endif